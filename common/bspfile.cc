@@ -1536,6 +1536,27 @@ static bool isHexen2(const dheader_t *header, const bspversion_t *bspversion)
     return true;
 }
 
+// lump element types whose in-memory layout is the same as the on-disk
+// layout; when the stream doesn't need byte swapping, whole lumps of these
+// are copied in one go instead of field by field.
+template<typename T>
+struct is_raw_lump : std::is_arithmetic<T>
+{
+};
+
+template<typename T, size_t N>
+struct is_raw_lump<std::array<T, N>> : is_raw_lump<T>
+{
+};
+
+template<typename T, size_t N>
+struct is_raw_lump<qvec<T, N>> : is_raw_lump<T>
+{
+};
+
+template<typename T>
+constexpr bool is_raw_lump_v = is_raw_lump<T>::value && std::is_trivially_copyable_v<T>;
+
 struct lump_reader
 {
     std::istream &s;
@@ -1569,6 +1590,15 @@ struct lump_reader
 
         s.seekg(lump.fileofs);
 
+        if constexpr (is_raw_lump_v<T>) {
+            if (lumpspec.size > 1 && !detail::need_swap(s)) {
+                buffer.resize(length);
+                s.read(reinterpret_cast<char *>(buffer.data()), lump.filelen);
+                Q_assert((bool)s);
+                return;
+            }
+        }
+
         if (lumpspec.size > 1) {
             for (size_t i = 0; i < length; i++) {
                 T &val = buffer.emplace_back();
@@ -1702,8 +1732,8 @@ void LoadBSPFile(fs::path &filename, bspdata_t *bspdata)
 
     bspdata->file = filename;
 
-    /* load the file header */
-    fs::data file_data = fs::load(filename);
+    /* load the file header; the lumps are read straight out of the mapping */
+    fs::mapped file_data = fs::map(filename);
 
     if (!file_data) {
         FError("Unable to load \"{}\"\n", filename);
@@ -1849,8 +1879,17 @@ private:
 
         lump.fileofs = stream.tellp();
 
-        for (auto &v : data)
-            stream <= v;
+        if constexpr (is_raw_lump_v<T>) {
+            if (!detail::need_swap(stream)) {
+                stream.write(reinterpret_cast<const char *>(data.data()), data.size() * sizeof(T));
+            } else {
+                for (auto &v : data)
+                    stream <= v;
+            }
+        } else {
+            for (auto &v : data)
+                stream <= v;
+        }
 
         auto written = static_cast<int32_t>(stream.tellp()) - lump.fileofs;
 
@@ -771,6 +771,34 @@ std::unordered_map<int, std::vector<uint8_t>> DecompressAllVis(const mbsp_t *bsp
     return result;
 }
 
+std::optional<std::vector<uint8_t>> DecompressLeafVis(const mbsp_t *bsp, const mleaf_t *leaf)
+{
+    size_t visofs;
+
+    if (bsp->loadversion->game->has_cluster_support) {
+        if (leaf->cluster < 0 || leaf->cluster >= bsp->dvis.bit_offsets.size()) {
+            return std::nullopt;
+        }
+
+        visofs = bsp->dvis.get_bit_offset(VIS_PVS, leaf->cluster);
+    } else {
+        if (leaf->visofs < 0) {
+            return std::nullopt;
+        }
+
+        visofs = leaf->visofs;
+    }
+
+    if (visofs >= bsp->dvis.bits.size()) {
+        return std::nullopt;
+    }
+
+    std::vector<uint8_t> decompressed(DecompressedVisSize(bsp));
+    DecompressVis(bsp->dvis.bits.data() + visofs, bsp->dvis.bits.data() + bsp->dvis.bits.size(), decompressed.data(),
+        decompressed.data() + decompressed.size());
+    return decompressed;
+}
+
 static void BSP_VisitAllLeafs_R(
     const mbsp_t &bsp, const int nodenum, const std::function<void(const mleaf_t &)> &visitor)
 {
@@ -30,8 +30,113 @@
 #include <system_error>
 #include <unordered_map>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace fs
 {
+mapped archive_like::map(const path &filename)
+{
+    data loaded = load(filename);
+
+    if (!loaded) {
+        return std::nullopt;
+    }
+
+    auto buffer = std::make_shared<std::vector<uint8_t>>(std::move(*loaded));
+    return mapped_file{buffer, buffer->data(), buffer->size()};
+}
+
+std::optional<file_stamp_t> stamp_of(const path &p)
+{
+    std::error_code time_ec, size_ec;
+    const auto time = last_write_time(p, time_ec);
+    const auto size = file_size(p, size_ec);
+
+    if (time_ec || size_ec) {
+        return std::nullopt;
+    }
+
+    return file_stamp_t{time, size};
+}
+
+std::optional<file_stamp_t> archive_like::stamp(const path &)
+{
+    return stamp_of(pathname);
+}
+
+/*
+ * map a loose file read-only. returns nullopt if the platform
+ * refuses, in which case the caller should fall back to loading it.
+ */
+static mapped MapLooseFile(const path &p)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileW(p.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (file == INVALID_HANDLE_VALUE) {
+        return std::nullopt;
+    }
+
+    LARGE_INTEGER size;
+
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return std::nullopt;
+    }
+
+    HANDLE mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+
+    if (!mapping) {
+        return std::nullopt;
+    }
+
+    void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+
+    if (!view) {
+        return std::nullopt;
+    }
+
+    std::shared_ptr<const void> storage(view, [](const void *v) { UnmapViewOfFile(v); });
+    return mapped_file{storage, static_cast<const uint8_t *>(view), static_cast<size_t>(size.QuadPart)};
+#else
+    int fd = open(p.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        return std::nullopt;
+    }
+
+    struct stat st;
+
+    // mmap can't do empty files
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return std::nullopt;
+    }
+
+    const size_t size = static_cast<size_t>(st.st_size);
+    void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (view == MAP_FAILED) {
+        return std::nullopt;
+    }
+
+    std::shared_ptr<const void> storage(view, [size](const void *v) { munmap(const_cast<void *>(v), size); });
+    return mapped_file{storage, static_cast<const uint8_t *>(view), size};
+#endif
+}
+
 struct directory_archive : archive_like
 {
     using archive_like::archive_like;
@@ -60,6 +165,26 @@ struct directory_archive : archive_like
             return std::nullopt;
         }
     }
+
+    mapped map(const path &filename) override
+    {
+        path p = !pathname.empty() ? (pathname / filename) : filename;
+
+        if (!exists(p)) {
+            return std::nullopt;
+        }
+
+        if (auto result = MapLooseFile(p)) {
+            return result;
+        }
+
+        return archive_like::map(filename);
+    }
+
+    std::optional<file_stamp_t> stamp(const path &filename) override
+    {
+        return stamp_of(!pathname.empty() ? (pathname / filename) : filename);
+    }
 };
 
 struct pak_archive : archive_like
@@ -243,6 +368,63 @@ void clear()
     directories.clear();
 }
 
+// archives kept across clear() by set_archive_cache, by absolute path
+struct cached_archive_t
+{
+    std::shared_ptr<archive_like> archive;
+    file_stamp_t stamp;
+};
+
+static bool archive_cache_enabled = false;
+static std::unordered_map<std::string, cached_archive_t> archive_cache;
+
+void set_archive_cache(bool enabled)
+{
+    archive_cache_enabled = enabled;
+
+    if (!enabled) {
+        archive_cache.clear();
+    }
+}
+
+static std::string ArchiveCacheKey(const path &p)
+{
+    std::error_code ec;
+    return absolute(p, ec).lexically_normal().string();
+}
+
+static std::shared_ptr<archive_like> FindCachedArchive(const path &p, bool external)
+{
+    if (!archive_cache_enabled) {
+        return nullptr;
+    }
+
+    auto it = archive_cache.find(ArchiveCacheKey(p));
+
+    if (it == archive_cache.end() || it->second.archive->external != external) {
+        return nullptr;
+    }
+
+    if (stamp_of(p) != it->second.stamp) {
+        // changed on disk; read it again
+        archive_cache.erase(it);
+        return nullptr;
+    }
+
+    return it->second.archive;
+}
+
+static void CacheArchive(const path &p, const std::shared_ptr<archive_like> &archive)
+{
+    if (!archive_cache_enabled) {
+        return;
+    }
+
+    if (auto stamp = stamp_of(p)) {
+        archive_cache[ArchiveCacheKey(p)] = {archive, *stamp};
+    }
+}
+
 inline std::shared_ptr<archive_like> addArchiveInternal(const path &p, bool external)
 {
     if (is_directory(p)) {
@@ -264,6 +446,12 @@ inline std::shared_ptr<archive_like> addArchiveInternal(const path &p, bool exte
             }
         }
 
+        if (auto cached = FindCachedArchive(p, external)) {
+            auto &arch = archives.emplace_front(cached);
+            logging::print(logging::flag::VERBOSE, "Added cached archive '{}'\n", p);
+            return arch;
+        }
+
         auto ext = p.extension();
 
         try {
@@ -271,11 +459,13 @@ inline std::shared_ptr<archive_like> addArchiveInternal(const path &p, bool exte
                 auto &arch = archives.emplace_front(std::make_shared<pak_archive>(p, external));
                 auto &pak = reinterpret_cast<std::shared_ptr<pak_archive> &>(arch);
                 logging::print(logging::flag::VERBOSE, "Added pak '{}' with {} files\n", p, pak->files.size());
+                CacheArchive(p, arch);
                 return arch;
             } else if (string_iequals(ext.generic_string(), ".wad")) {
                 auto &arch = archives.emplace_front(std::make_shared<wad_archive>(p, external));
                 auto &wad = reinterpret_cast<std::shared_ptr<wad_archive> &>(arch);
                 logging::print(logging::flag::VERBOSE, "Added wad '{}' with {} lumps\n", p, wad->files.size());
+                CacheArchive(p, arch);
                 return arch;
             } else {
                 logging::funcprint("WARNING: no idea what to do with archive '{}'\n", p);
@@ -362,6 +552,22 @@ data load(const path &p, bool prefer_loose)
     return load(where(p, prefer_loose));
 }
 
+mapped map(const resolve_result &pos)
+{
+    if (!pos) {
+        return std::nullopt;
+    }
+
+    logging::print(logging::flag::VERBOSE, "Mapped '{}' from archive '{}'\n", pos.filename, pos.archive->pathname);
+
+    return pos.archive->map(pos.filename);
+}
+
+mapped map(const path &p, bool prefer_loose)
+{
+    return map(where(p, prefer_loose));
+}
+
 archive_components splitArchivePath(const path &source)
 {
     // check direct archive loading
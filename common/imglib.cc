@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <vector>
 #include <common/fs.hh>
 #include <common/imglib.hh>
@@ -76,10 +80,27 @@ static bool LoadPCXPalette(const fs::path &filename, std::vector<qvec3b> &palett
     return true;
 }
 
-void init_palette(const gamedef_t *game)
+// hash of `palette`; part of the decode cache key, since paletted images are
+// converted through it and each job may load a different one
+static uint64_t palette_hash = 0;
+
+static uint64_t HashPalette(const std::vector<qvec3b> &pal)
 {
-    palette.clear();
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull;
+
+    for (auto &color : pal) {
+        for (int i = 0; i < 3; i++) {
+            hash ^= color[i];
+            hash *= 1099511628211ull;
+        }
+    }
+
+    return hash;
+}
 
+static void LoadPalette(const gamedef_t *game)
+{
     // Load game-specific palette palette
     if (game->id == GAME_QUAKE_II) {
         constexpr const char *colormap = "pics/colormap.pcx";
@@ -96,6 +117,13 @@ void init_palette(const gamedef_t *game)
     std::copy(pal.begin(), pal.end(), std::back_inserter(palette));
 }
 
+void init_palette(const gamedef_t *game)
+{
+    palette.clear();
+    LoadPalette(game);
+    palette_hash = HashPalette(palette);
+}
+
 static void convert_paletted_to_32_bit(
     const std::vector<uint8_t> &pixels, std::vector<qvec4b> &output, const std::vector<qvec3b> &pal)
 {
@@ -308,6 +336,7 @@ const texture *find(std::string_view str)
 void clear()
 {
     palette.clear();
+    palette_hash = HashPalette(palette);
     textures.clear();
 }
 
@@ -327,6 +356,97 @@ qvec3b calculate_average(const std::vector<qvec4b> &pixels)
     return avg /= n;
 }
 
+// textures decoded by load_texture, kept across clear() by set_decode_cache
+struct decoded_texture_t
+{
+    texture tex;
+    fs::data data;
+    fs::file_stamp_t stamp;
+    size_t bytes;
+    uint64_t last_used;
+};
+
+using decode_key_t = std::tuple<std::string, std::string, std::string, bool, const gamedef_t *, uint64_t>;
+
+// least recently used textures are dropped past this
+static constexpr size_t DECODE_CACHE_MAX_BYTES = 256 * 1024 * 1024;
+
+static std::atomic_bool decode_cache_enabled = false;
+static std::mutex decode_cache_mutex;
+static std::map<decode_key_t, decoded_texture_t> decode_cache;
+static size_t decode_cache_bytes = 0;
+static uint64_t decode_cache_clock = 0;
+
+void set_decode_cache(bool enabled)
+{
+    std::unique_lock lock(decode_cache_mutex);
+
+    decode_cache_enabled = enabled;
+
+    if (!enabled) {
+        decode_cache.clear();
+        decode_cache_bytes = 0;
+    }
+}
+
+static decode_key_t DecodeCacheKey(
+    const fs::resolve_result &pos, std::string_view name, bool meta_only, const gamedef_t *game)
+{
+    return {pos.archive->pathname.string(), pos.filename.generic_string(), std::string(name), meta_only, game,
+        palette_hash};
+}
+
+static std::optional<std::tuple<texture, fs::data>> FindDecodedTexture(
+    const decode_key_t &key, const std::optional<fs::file_stamp_t> &stamp)
+{
+    std::unique_lock lock(decode_cache_mutex);
+
+    auto it = decode_cache.find(key);
+
+    if (it == decode_cache.end()) {
+        return std::nullopt;
+    }
+
+    // changed on disk; decode it again
+    if (stamp != it->second.stamp) {
+        decode_cache_bytes -= it->second.bytes;
+        decode_cache.erase(it);
+        return std::nullopt;
+    }
+
+    it->second.last_used = ++decode_cache_clock;
+    return std::make_tuple(it->second.tex, it->second.data);
+}
+
+static void CacheDecodedTexture(
+    const decode_key_t &key, const fs::file_stamp_t &stamp, const texture &tex, const fs::data &data)
+{
+    const size_t bytes = tex.pixels.size() * sizeof(tex.pixels[0]) + (data ? data->size() : 0);
+
+    std::unique_lock lock(decode_cache_mutex);
+
+    if (!decode_cache_enabled || bytes > DECODE_CACHE_MAX_BYTES) {
+        return;
+    }
+
+    // another thread may have decoded it too
+    if (auto it = decode_cache.find(key); it != decode_cache.end()) {
+        decode_cache_bytes -= it->second.bytes;
+        decode_cache.erase(it);
+    }
+
+    while (decode_cache_bytes + bytes > DECODE_CACHE_MAX_BYTES) {
+        auto oldest = std::min_element(decode_cache.begin(), decode_cache.end(),
+            [](const auto &a, const auto &b) { return a.second.last_used < b.second.last_used; });
+
+        decode_cache_bytes -= oldest->second.bytes;
+        decode_cache.erase(oldest);
+    }
+
+    decode_cache.emplace(key, decoded_texture_t{tex, data, stamp, bytes, ++decode_cache_clock});
+    decode_cache_bytes += bytes;
+}
+
 std::tuple<std::optional<img::texture>, fs::resolve_result, fs::data> load_texture(std::string_view name,
     bool meta_only, const gamedef_t *game, const settings::common_settings &options, bool no_prefix, bool mip_only)
 {
@@ -350,8 +470,26 @@ std::tuple<std::optional<img::texture>, fs::resolve_result, fs::data> load_textu
         p += ext.suffix;
 
         if (auto pos = fs::where(p, options.filepriority.value() == settings::search_priority_t::LOOSE)) {
+            // the lock is only held to look up and insert, so threads decode
+            // different textures in parallel
+            std::optional<decode_key_t> key;
+            std::optional<fs::file_stamp_t> stamp;
+
+            if (decode_cache_enabled) {
+                key = DecodeCacheKey(pos, name, meta_only, game);
+                stamp = pos.archive->stamp(pos.filename);
+
+                if (auto cached = FindDecodedTexture(*key, stamp)) {
+                    return {std::get<0>(*cached), pos, std::get<1>(*cached)};
+                }
+            }
+
             if (auto data = fs::load(pos)) {
                 if (auto texture = ext.loader(name.data(), data, meta_only, game)) {
+                    if (key && stamp) {
+                        CacheDecodedTexture(*key, *stamp, *texture, data);
+                    }
+
                     return {texture, pos, data};
                 }
             }
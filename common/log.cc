@@ -30,6 +30,7 @@
 #include <fmt/chrono.h>
 #include <fmt/color.h>
 #include <string>
+#include <string_view>
 
 #include <common/log.hh>
 #include <common/settings.hh>
@@ -79,8 +80,15 @@ void preinitialize()
     enable_color_codes = is_terminal();
 }
 
+static void trace_open(const fs::path &path);
+static void trace_close();
+
 void init(std::optional<fs::path> filename, const settings::common_settings &settings)
 {
+    if (settings.trace.is_changed()) {
+        trace_open(settings.trace.value());
+    }
+
     if (!settings.log.value()) {
         return;
     }
@@ -111,6 +119,8 @@ void init(std::optional<fs::path> filename, const settings::common_settings &set
 
 void close()
 {
+    trace_close();
+
     if (logfile) {
         fmt::print(logfile, "\n\n");
         logfile.close();
@@ -232,6 +242,182 @@ void header(const char *name)
     print(flag::PROGRESS, "---- {} ----\n", name);
 }
 
+// tracing
+
+bool tracing = false;
+
+struct trace_event_t
+{
+    char phase; // 'X' = complete span, 'C' = counter
+    std::string name;
+    const char *category;
+    int64_t start_us, duration_us;
+    uint32_t thread;
+    size_t value;
+};
+
+static std::mutex trace_mutex;
+static fs::path trace_path;
+static trace_clock::time_point trace_start;
+static std::vector<trace_event_t> trace_events;
+static std::atomic_uint32_t trace_next_thread = 0;
+static thread_local std::vector<const std::string *> trace_stages;
+
+static uint32_t trace_thread_id()
+{
+    static thread_local uint32_t id = trace_next_thread++;
+    return id;
+}
+
+static int64_t trace_microseconds(trace_clock::time_point t)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(t - trace_start).count();
+}
+
+static void trace_open(const fs::path &path)
+{
+    trace_thread_id(); // so the main thread gets id 0
+
+    std::unique_lock lock(trace_mutex);
+
+    trace_path = fs::absolute(path);
+    trace_start = trace_clock::now();
+    trace_events.clear();
+    tracing = true;
+}
+
+static std::string trace_escape(const std::string &str)
+{
+    std::string result;
+
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+            result += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            result += fmt::format("\\u{:04x}", static_cast<int>(c));
+        } else {
+            result += c;
+        }
+    }
+
+    return result;
+}
+
+static void trace_close()
+{
+    if (!tracing) {
+        return;
+    }
+
+    std::unique_lock lock(trace_mutex);
+
+    tracing = false;
+
+    std::ofstream stream(trace_path, std::ios_base::out | std::ios_base::trunc);
+
+    if (!stream) {
+        lock.unlock();
+        print("WARNING: can't write trace to {}\n", trace_path.string());
+        return;
+    }
+
+    fmt::print(stream, "{{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (uint32_t thread = 0; thread < trace_next_thread; thread++) {
+        fmt::print(stream, "{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{},\"args\":{{\"name\":\"{}\"}}}},\n",
+            thread, thread == 0 ? "main" : fmt::format("worker {}", thread));
+    }
+
+    for (size_t i = 0; i < trace_events.size(); i++) {
+        const trace_event_t &e = trace_events[i];
+        const char *separator = (i + 1 < trace_events.size()) ? ",\n" : "\n";
+
+        if (e.phase == 'X') {
+            fmt::print(stream, "{{\"name\":\"{}\",\"cat\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{}}}{}",
+                trace_escape(e.name), e.category, e.start_us, e.duration_us, e.thread, separator);
+        } else {
+            fmt::print(stream, "{{\"name\":\"{}\",\"ph\":\"C\",\"ts\":{},\"pid\":1,\"args\":{{\"count\":{}}}}}{}",
+                trace_escape(e.name), e.start_us, e.value, separator);
+        }
+    }
+
+    fmt::print(stream, "]}}\n");
+
+    trace_events.clear();
+}
+
+void trace_span(
+    const std::string &name, const char *category, trace_clock::time_point start, trace_clock::time_point end)
+{
+    if (!tracing) {
+        return;
+    }
+
+    const uint32_t thread = trace_thread_id();
+
+    std::unique_lock lock(trace_mutex);
+    trace_events.push_back(
+        {'X', name, category, trace_microseconds(start), trace_microseconds(end) - trace_microseconds(start), thread});
+}
+
+void trace_counter(const std::string &name, size_t value)
+{
+    if (!tracing) {
+        return;
+    }
+
+    const uint32_t thread = trace_thread_id();
+    const int64_t now = trace_microseconds(trace_clock::now());
+
+    std::unique_lock lock(trace_mutex);
+    trace_events.push_back({'C', name, "stat", now, 0, thread, value});
+}
+
+std::string trace_current_stage()
+{
+    return trace_stages.empty() ? std::string() : *trace_stages.back();
+}
+
+static stage_callback_t active_stage_callback;
+
+void set_stage_callback(stage_callback_t cb)
+{
+    active_stage_callback = cb;
+}
+
+static bool reports_stage(const char *category)
+{
+    return active_stage_callback && std::string_view(category) == "stage";
+}
+
+trace_scope::trace_scope(std::string name, const char *category)
+    : name(std::move(name)),
+      category(category),
+      active(tracing || reports_stage(category))
+{
+    if (active) {
+        trace_stages.push_back(&this->name);
+        start = trace_clock::now();
+
+        if (reports_stage(category)) {
+            active_stage_callback(this->name, true);
+        }
+    }
+}
+
+trace_scope::~trace_scope()
+{
+    if (active) {
+        if (reports_stage(category)) {
+            active_stage_callback(name, false);
+        }
+
+        trace_span(name, category, start, trace_clock::now());
+        trace_stages.pop_back();
+    }
+}
+
 void assert_(bool success, const char *expr, const char *file, int line)
 {
     if (!success) {
@@ -436,6 +622,14 @@ void stat_tracker_t::print_stats()
 
     stats_printed = true;
 
+    if (tracing) {
+        const std::string stage = trace_current_stage();
+
+        for (auto &stat : stats) {
+            trace_counter(stage.empty() ? stat.name : fmt::format("{}: {}", stage, stat.name), stat.count.load());
+        }
+    }
+
     // add 8 char padding just to keep it away from the left side
     size_t number_padding = number_of_digit_padding() + 4;
 
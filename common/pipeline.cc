@@ -0,0 +1,101 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <common/pipeline.hh>
+
+#include <common/log.hh>
+
+#include <utility>
+
+namespace pipeline
+{
+static handoff_t *current_handoff = nullptr;
+
+scope::scope()
+    : previous(current_handoff)
+{
+    current_handoff = &handoff;
+}
+
+scope::~scope()
+{
+    current_handoff = previous;
+}
+
+std::optional<bspdata_t> scope::finish()
+{
+    if (!handoff.bspdata) {
+        return std::nullopt;
+    }
+
+    WriteBSPFile(handoff.bspdata->file, &*handoff.bspdata);
+    logging::print("Wrote {}\n", handoff.bspdata->file);
+
+    return std::exchange(handoff.bspdata, std::nullopt);
+}
+
+handoff_t *current()
+{
+    return current_handoff;
+}
+
+static bool same_file(const fs::path &a, const fs::path &b)
+{
+    return fs::weakly_canonical(a) == fs::weakly_canonical(b);
+}
+
+bool give_bsp(bspdata_t &bspdata)
+{
+    if (!current_handoff) {
+        return false;
+    }
+
+    current_handoff->bspdata = std::move(bspdata);
+    return true;
+}
+
+std::optional<bspdata_t> take_bsp(const fs::path &path)
+{
+    if (!current_handoff || !current_handoff->bspdata || !same_file(current_handoff->bspdata->file, path)) {
+        return std::nullopt;
+    }
+
+    return std::exchange(current_handoff->bspdata, std::nullopt);
+}
+
+bool give_prt(const fs::path &path, prtfile_t prtfile)
+{
+    if (!current_handoff) {
+        return false;
+    }
+
+    current_handoff->prt_path = path;
+    current_handoff->prtfile = std::move(prtfile);
+    return true;
+}
+
+std::optional<prtfile_t> take_prt(const fs::path &path)
+{
+    if (!current_handoff || !current_handoff->prtfile || !same_file(current_handoff->prt_path, path)) {
+        return std::nullopt;
+    }
+
+    return std::exchange(current_handoff->prtfile, std::nullopt);
+}
+} // namespace pipeline
@@ -33,6 +33,18 @@ constexpr const char *PORTALFILEAM = "PRT1-AM";
 
 constexpr size_t PRT_MAX_WINDING = 64;
 
+// e.g. Quake 1, PRT1 (no func_detail).
+// Assign the identity cluster numbers for consistency
+static void AssignIdentityClusters(prtfile_t &prtfile)
+{
+    prtfile.dleafinfos.clear();
+    prtfile.dleafinfos.resize(prtfile.portalleafs + 1);
+
+    for (int i = 0; i < prtfile.portalleafs; i++) {
+        prtfile.dleafinfos[i + 1].cluster = i;
+    }
+}
+
 prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion)
 {
     std::ifstream f(name);
@@ -120,14 +132,7 @@ prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion)
 
     // No clusters
     if (result.portalleafs == result.portalleafs_real) {
-        // e.g. Quake 1, PRT1 (no func_detail).
-        // Assign the identity cluster numbers for consistency
-
-        result.dleafinfos.resize(result.portalleafs + 1);
-
-        for (int i = 0; i < result.portalleafs; i++) {
-            result.dleafinfos[i + 1].cluster = i;
-        }
+        AssignIdentityClusters(result);
         return result;
     }
 
@@ -174,6 +179,37 @@ prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion)
     return result;
 }
 
+/*
+================
+LoadPrtFile
+
+Takes a portal file built in memory by qbsp, and returns it the way
+LoadPrtFile would read it back from the file WritePortalfile writes for it.
+Used when vis runs in the same process as qbsp.
+================
+*/
+prtfile_t LoadPrtFile(prtfile_t prtfile, const bspversion_t *loadversion, bool uses_detail, bool forceprt1)
+{
+    // Q2 doesn't need this, it's PRT1 has the data we need
+    if (loadversion->game->has_cluster_support) {
+        prtfile.portalleafs_real = 0;
+        prtfile.dleafinfos.clear();
+        return prtfile;
+    }
+
+    // written as PRT1, which has no separate leaf count
+    if (!uses_detail || forceprt1) {
+        prtfile.portalleafs_real = prtfile.portalleafs;
+    }
+
+    // No clusters
+    if (prtfile.portalleafs == prtfile.portalleafs_real) {
+        AssignIdentityClusters(prtfile);
+    }
+
+    return prtfile;
+}
+
 static void WriteDebugPortal(const polylib::winding_t &w, std::ofstream &portalFile)
 {
     ewt::print(portalFile, "{} {} {} ", w.size(), 0, 0);
@@ -817,7 +817,9 @@ common_settings::common_settings()
           "increase texture saturation to match original Q2 tools"},
       logfile{this, "logfile", "auto", "\"path\"", &logging_group,
           "File to output logging data to. If unchanged, it is set by the tool."},
-      logappend{this, "logappend", false, &logging_group, "Whether to append to log file or replace"}
+      logappend{this, "logappend", false, &logging_group, "Whether to append to log file or replace"},
+      trace{this, "trace", "", &logging_group,
+          "write a Chrome tracing / Perfetto JSON file of where the time went (stages, worker tasks and stats)"}
 {
 }
 
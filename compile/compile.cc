@@ -0,0 +1,100 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <compile/compile.hh>
+
+#include <qbsp/qbsp.hh>
+#include <vis/vis.hh>
+#include <light/light.hh>
+#include <common/pipeline.hh>
+#include <common/log.hh>
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * compile [qbsp options] [--vis [vis options]] [--light [light options]] sourcefile
+ *
+ * Runs qbsp, vis and light on sourcefile in one process. The .bsp and .prt are
+ * passed from one stage to the next in memory, and the .bsp is written once at
+ * the end. --novis and --nolight skip a stage.
+ */
+int compile_main(int argc, const char **argv)
+{
+    enum class stage_t
+    {
+        qbsp,
+        vis,
+        light
+    } stage = stage_t::qbsp;
+
+    std::vector<std::string> qbsp_args{argv[0]}, vis_args{argv[0]}, light_args{argv[0]};
+    bool run_vis = true, run_light = true;
+
+    for (int i = 1; i < argc - 1; i++) {
+        const std::string_view arg = argv[i];
+
+        if (arg == "--vis") {
+            stage = stage_t::vis;
+        } else if (arg == "--light") {
+            stage = stage_t::light;
+        } else if (arg == "--novis") {
+            run_vis = false;
+        } else if (arg == "--nolight") {
+            run_light = false;
+        } else if (stage == stage_t::qbsp) {
+            qbsp_args.emplace_back(arg);
+        } else if (stage == stage_t::vis) {
+            vis_args.emplace_back(arg);
+        } else {
+            light_args.emplace_back(arg);
+        }
+    }
+
+    if (argc < 2 || argv[argc - 1][0] == '-') {
+        logging::print("usage: compile [qbsp options] [--vis [vis options]] [--light [light options]] sourcefile\n"
+                       "       --novis and --nolight skip a stage\n");
+        return 1;
+    }
+
+    const fs::path map_path = argv[argc - 1];
+    const fs::path bsp_path = fs::path(map_path).replace_extension("bsp");
+
+    qbsp_args.push_back(map_path.string());
+    vis_args.push_back(bsp_path.string());
+    light_args.push_back(bsp_path.string());
+
+    pipeline::scope pipeline;
+
+    InitQBSP(qbsp_args);
+    ProcessFile();
+    logging::close();
+
+    if (run_vis) {
+        vis_main(vis_args);
+    }
+    if (run_light) {
+        light_main(light_args);
+    }
+
+    pipeline.finish();
+
+    return 0;
+}
@@ -0,0 +1,390 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <compile/compile.hh>
+
+#include <qbsp/qbsp.hh>
+#include <vis/vis.hh>
+#include <light/light.hh>
+#include <common/fs.hh>
+#include <common/imglib.hh>
+#include <common/log.hh>
+#include <common/settings.hh>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#ifndef _WIN32
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+
+constexpr char FRAME_LOG = 'L';
+constexpr char FRAME_EXIT = 'X';
+
+static bool SendAll(int fd, const void *data, size_t size)
+{
+    const char *ptr = static_cast<const char *>(data);
+
+    while (size) {
+        const ssize_t sent = write(fd, ptr, size);
+
+        if (sent <= 0) {
+            return false;
+        }
+
+        ptr += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+static bool ReceiveAll(int fd, void *data, size_t size)
+{
+    char *ptr = static_cast<char *>(data);
+
+    while (size) {
+        const ssize_t received = read(fd, ptr, size);
+
+        if (received <= 0) {
+            return false;
+        }
+
+        ptr += received;
+        size -= received;
+    }
+
+    return true;
+}
+
+static bool SendFrame(int fd, char type, const void *data, uint32_t size)
+{
+    return SendAll(fd, &type, 1) && SendAll(fd, &size, sizeof(size)) && SendAll(fd, data, size);
+}
+
+static bool MakeAddress(const fs::path &socket_path, sockaddr_un &addr)
+{
+    const std::string name = socket_path.string();
+
+    addr = {};
+    addr.sun_family = AF_UNIX;
+
+    if (name.size() >= sizeof(addr.sun_path)) {
+        logging::print("ERROR: socket path {} is too long\n", socket_path);
+        return false;
+    }
+
+    memcpy(addr.sun_path, name.c_str(), name.size() + 1);
+    return true;
+}
+
+/*
+=============
+ReceiveJob
+
+Reads the NUL-terminated strings of a job, up to the empty one.
+=============
+*/
+static bool ReceiveJob(int fd, std::vector<std::string> &job)
+{
+    std::string current;
+    char c;
+
+    while (ReceiveAll(fd, &c, 1)) {
+        if (c != '\0') {
+            current.push_back(c);
+        } else if (current.empty()) {
+            return true;
+        } else {
+            job.push_back(std::move(current));
+            current.clear();
+        }
+    }
+
+    return false;
+}
+
+static int RunTool(const std::vector<std::string> &job)
+{
+    // job[0] is the tool, which stands in for the exe path
+    std::vector<const char *> argv;
+    for (const std::string &arg : job) {
+        argv.push_back(arg.c_str());
+    }
+
+    const int argc = static_cast<int>(argv.size());
+
+    if (job[0] == "qbsp") {
+        return qbsp_main(argc, argv.data());
+    } else if (job[0] == "vis") {
+        return vis_main(argc, argv.data());
+    } else if (job[0] == "light") {
+        return light_main(argc, argv.data());
+    } else if (job[0] == "compile") {
+        return compile_main(argc, argv.data());
+    }
+
+    logging::print("ERROR: unknown tool {}\n", job[0]);
+    return 1;
+}
+
+/*
+=============
+RunJob
+
+Runs a job for the client on `fd`, streaming its log back.
+=============
+*/
+static void RunJob(int fd, const std::vector<std::string> &job)
+{
+    std::mutex send_mutex;
+
+    logging::set_print_callback([&](logging::flag, const char *str) {
+        std::unique_lock lock(send_mutex);
+        SendFrame(fd, FRAME_LOG, str, static_cast<uint32_t>(strlen(str)));
+    });
+
+    int32_t result;
+
+    try {
+        result = RunTool(job);
+    } catch (const settings::quit_after_help_exception &) {
+        result = 0;
+    } catch (const std::exception &e) {
+        logging::print("************ ERROR ************\n{}\n", e.what());
+        logging::close();
+        result = 1;
+    }
+
+    logging::set_print_callback(nullptr);
+
+    SendFrame(fd, FRAME_EXIT, &result, sizeof(result));
+}
+
+// removes the socket at `path` if there is one; returns false if something
+// other than a socket is in the way
+static bool RemoveSocket(const char *path)
+{
+    struct stat st;
+
+    if (lstat(path, &st) == -1) {
+        return errno == ENOENT;
+    }
+
+    if (!S_ISSOCK(st.st_mode)) {
+        return false;
+    }
+
+    return unlink(path) == 0;
+}
+
+// jobs run with the server's permissions, so only take them from its own user
+static bool ClientIsSameUser(int fd)
+{
+#if defined(SO_PEERCRED)
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) {
+        return false;
+    }
+
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+
+    if (getpeereid(fd, &uid, &gid) == -1) {
+        return false;
+    }
+
+    return uid == getuid();
+#endif
+}
+
+int server_main(const fs::path &socket_path)
+{
+    sockaddr_un addr;
+
+    if (!MakeAddress(socket_path, addr)) {
+        return 1;
+    }
+
+    // a client going away mid-job shouldn't take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (listener == -1) {
+        FError("socket: {}", strerror(errno));
+    }
+
+    // left behind by a previous server
+    if (!RemoveSocket(addr.sun_path)) {
+        FError("{} exists and isn't a socket that can be removed", socket_path);
+    }
+
+    // only the owner may connect; the umask covers the window before chmod
+    const mode_t old_umask = umask(0077);
+    const bool bound = bind(listener, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == 0;
+    umask(old_umask);
+
+    if (!bound || chmod(addr.sun_path, 0600) == -1 || listen(listener, 8) == -1) {
+        FError("unable to listen on {}: {}", socket_path, strerror(errno));
+    }
+
+    fs::set_archive_cache(true);
+    img::set_decode_cache(true);
+    Embree_SetSceneCache(true);
+
+    logging::print("Listening on {}\n", socket_path);
+
+    while (true) {
+        const int client = accept(listener, nullptr, nullptr);
+
+        if (client == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            FError("accept: {}", strerror(errno));
+        }
+
+        if (!ClientIsSameUser(client)) {
+            logging::print("WARNING: refused a connection from another user\n");
+            close(client);
+            continue;
+        }
+
+        std::vector<std::string> job;
+
+        if (!ReceiveJob(client, job) || job.empty()) {
+            close(client);
+            continue;
+        }
+
+        if (job.size() == 2 && job[1] == "shutdown") {
+            const int32_t result = 0;
+            SendFrame(client, FRAME_EXIT, &result, sizeof(result));
+            close(client);
+            break;
+        }
+
+        // relative paths in the job are relative to the client
+        std::error_code ec;
+        fs::current_path(job[0], ec);
+        job.erase(job.begin());
+
+        if (ec || job.empty()) {
+            const int32_t result = 1;
+            SendFrame(client, FRAME_EXIT, &result, sizeof(result));
+            close(client);
+            continue;
+        }
+
+        logging::print("Running {} in {}\n", job[0], fs::current_path());
+
+        RunJob(client, job);
+        close(client);
+    }
+
+    close(listener);
+    RemoveSocket(addr.sun_path);
+
+    return 0;
+}
+
+int client_main(const fs::path &socket_path, const std::vector<std::string> &job)
+{
+    sockaddr_un addr;
+
+    if (!MakeAddress(socket_path, addr)) {
+        return 1;
+    }
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1 || connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) == -1) {
+        logging::print("ERROR: unable to connect to {}: {}\n", socket_path, strerror(errno));
+        return 1;
+    }
+
+    const std::string cwd = fs::current_path().string();
+    SendAll(fd, cwd.c_str(), cwd.size() + 1);
+
+    for (const std::string &arg : job) {
+        SendAll(fd, arg.c_str(), arg.size() + 1);
+    }
+    SendAll(fd, "", 1);
+
+    std::vector<char> payload;
+
+    while (true) {
+        char type;
+        uint32_t size;
+
+        if (!ReceiveAll(fd, &type, 1) || !ReceiveAll(fd, &size, sizeof(size))) {
+            break;
+        }
+
+        payload.resize(size);
+
+        if (!ReceiveAll(fd, payload.data(), size)) {
+            break;
+        }
+
+        if (type == FRAME_LOG) {
+            fwrite(payload.data(), 1, payload.size(), stdout);
+            fflush(stdout);
+        } else if (type == FRAME_EXIT && size == sizeof(int32_t)) {
+            int32_t result;
+            memcpy(&result, payload.data(), sizeof(result));
+            close(fd);
+            return result;
+        }
+    }
+
+    logging::print("ERROR: lost connection to {}\n", socket_path);
+    close(fd);
+    return 1;
+}
+
+#else
+
+int server_main(const fs::path &socket_path)
+{
+    logging::print("ERROR: the compile server isn't supported on Windows\n");
+    return 1;
+}
+
+int client_main(const fs::path &socket_path, const std::vector<std::string> &job)
+{
+    logging::print("ERROR: the compile server isn't supported on Windows\n");
+    return 1;
+}
+
+#endif
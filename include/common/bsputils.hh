@@ -122,6 +122,8 @@ int LeafnumToVisleaf(int leafnum);
 bool Pvs_LeafVisible(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, const mleaf_t *leaf);
 void DecompressVis(const uint8_t *in, const uint8_t *inend, uint8_t *out, uint8_t *outend);
 std::unordered_map<int, std::vector<uint8_t>> DecompressAllVis(const mbsp_t *bsp, bool trans_water = false);
+// the row DecompressAllVis has for `leaf`, if any
+std::optional<std::vector<uint8_t>> DecompressLeafVis(const mbsp_t *bsp, const mleaf_t *leaf);
 
 void BSP_VisitAllLeafs(const mbsp_t &bsp, const dmodelh2_t &model, const std::function<void(const mleaf_t &)> &visitor);
 
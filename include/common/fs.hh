@@ -22,6 +22,7 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <vector>
 
@@ -31,6 +32,35 @@ using namespace std::filesystem;
 
 using data = std::optional<std::vector<uint8_t>>;
 
+// read-only view of a whole file. for loose files this is a memory
+// mapping, so pages are only read in when touched and aren't
+// duplicated on the heap. files in archives are loaded into memory.
+struct mapped_file
+{
+    // keeps the mapping (or loaded buffer) alive
+    std::shared_ptr<const void> storage;
+    const uint8_t *ptr = nullptr;
+    size_t length = 0;
+
+    inline const uint8_t *data() const { return ptr; }
+    inline size_t size() const { return length; }
+    inline const uint8_t *begin() const { return ptr; }
+    inline const uint8_t *end() const { return ptr + length; }
+};
+
+using mapped = std::optional<mapped_file>;
+
+// identifies a version of a file on disk
+struct file_stamp_t
+{
+    file_time_type time;
+    uintmax_t size;
+
+    inline bool operator==(const file_stamp_t &) const = default;
+};
+
+std::optional<file_stamp_t> stamp_of(const path &p);
+
 struct archive_like
 {
     path pathname;
@@ -47,11 +77,24 @@ struct archive_like
     virtual bool contains(const path &filename) = 0;
 
     virtual data load(const path &filename) = 0;
+
+    // by default, just wraps load(); archives that can do better
+    // override it.
+    virtual mapped map(const path &filename);
+
+    // when `filename` was last changed on disk and its size; by default,
+    // those of the archive file itself.
+    virtual std::optional<file_stamp_t> stamp(const path &filename);
 };
 
 // clear all initialized/loaded data from fs
 void clear();
 
+// keep .pak/.wad archives loaded across clear(), only re-reading an
+// archive's directory if the file changed on disk. for long-running
+// processes that compile many maps.
+void set_archive_cache(bool enabled);
+
 // add the specified archive to the search path. must be the full
 // path to the archive. Archives can be directories or archive-like
 // files. Returns the archive if it already exists, the new
@@ -87,6 +130,10 @@ data load(const resolve_result &pos);
 // shortcut to load(where(p))
 data load(const path &p, bool prefer_loose = false);
 
+// same as load, but memory-maps loose files instead of reading them.
+mapped map(const resolve_result &pos);
+mapped map(const path &p, bool prefer_loose = false);
+
 struct archive_components
 {
     path archive, filename;
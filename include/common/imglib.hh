@@ -87,6 +87,12 @@ extern std::unordered_map<std::string, texture, case_insensitive_hash, case_inse
 // clears the texture cache
 void clear();
 
+// keep textures decoded by load_texture across clear(), only decoding
+// one again if its file changed on disk (size or modification time).
+// the least recently used ones are dropped past 256 MiB. for
+// long-running processes that compile many maps.
+void set_decode_cache(bool enabled);
+
 qvec3b calculate_average(const std::vector<qvec4b> &pixels);
 
 const texture *find(std::string_view str);
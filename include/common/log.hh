@@ -27,8 +27,10 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstdarg>
 #include <list>
+#include <string>
 #include <cmath> // for log10
 #include <stdexcept> // for std::runtime_error
 #include <functional> // for std::function
@@ -109,13 +111,62 @@ void set_print_callback(print_callback_t cb);
 
 void header(const char *name);
 
+// -trace <file>: writes a Chrome tracing / Perfetto JSON file when the tool
+// exits. Stages show up as nested spans on the thread that ran them,
+// chunks of the parallel_for wrappers as spans on the worker threads, and
+// stat_tracker_t stats as counters. All of this is a no-op without -trace.
+extern bool tracing;
+
+using trace_clock = std::chrono::steady_clock;
+
+void trace_span(
+    const std::string &name, const char *category, trace_clock::time_point start, trace_clock::time_point end);
+void trace_counter(const std::string &name, size_t value);
+
+// name of the innermost trace_scope open on the calling thread, or
+// an empty string
+std::string trace_current_stage();
+
+// called on the opening thread when a "stage" trace_scope opens
+// (entering = true) and closes. Stages can open on several threads at
+// once, so the callback must be thread-safe. While a callback is set,
+// stages are timed even without -trace; the benchmark tool uses this.
+using stage_callback_t = std::function<void(const std::string &name, bool entering)>;
+
+void set_stage_callback(stage_callback_t cb);
+
+// traces a span from construction to the end of the scope
+struct trace_scope
+{
+    std::string name;
+    const char *category;
+    trace_clock::time_point start;
+    bool active;
+
+    trace_scope(std::string name, const char *category = "stage");
+    ~trace_scope();
+
+    trace_scope(const trace_scope &) = delete;
+    trace_scope &operator=(const trace_scope &) = delete;
+};
+
+// prints a header, and traces it as a stage until the end of the scope
+struct header_scope : trace_scope
+{
+    inline header_scope(const char *name)
+        : trace_scope(name)
+    {
+        header(name);
+    }
+};
+
 // TODO: C++20 source_location
 #ifdef _MSC_VER
 #define funcprint(fmt, ...) print("{}: " fmt, __FUNCTION__, ##__VA_ARGS__)
-#define funcheader() header(__FUNCTION__)
+#define funcheader() header_scope funcheader_scope_(__FUNCTION__)
 #else
 #define funcprint(fmt, ...) print("{}: " fmt, __func__, ##__VA_ARGS__)
-#define funcheader() header(__func__)
+#define funcheader() header_scope funcheader_scope_(__func__)
 #endif
 
 void assert_(bool success, const char *expr, const char *file, int line);
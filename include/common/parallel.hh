@@ -21,23 +21,41 @@
 #pragma once
 
 #include "common/log.hh"
+#include <tbb/blocked_range.h>
 #include <tbb/parallel_for.h>
 #include <tbb/parallel_for_each.h>
 
 #include <atomic>
+#include <iterator>
+#include <string>
 
 // parallel extensions to logging
 namespace logging
 {
+namespace detail
+{
+// worker spans are named after the stage that started the loop
+inline std::string task_name()
+{
+    std::string stage = trace_current_stage();
+    return stage.empty() ? std::string("parallel_for") : stage;
+}
+} // namespace detail
+
 template<typename TS, typename TE, typename Body>
 void parallel_for(const TS &start, const TE &end, const Body &func)
 {
     auto length = end - start;
     std::atomic<uint64_t> progress = 0;
+    const std::string name = tracing ? detail::task_name() : std::string();
+
+    tbb::parallel_for(tbb::blocked_range<TS>(start, end), [&](const tbb::blocked_range<TS> &range) {
+        trace_scope task(name, "task");
 
-    tbb::parallel_for(start, end, [&](const auto &it) {
-        percent(progress++, length);
-        func(it);
+        for (TS it = range.begin(); it != range.end(); ++it) {
+            percent(progress++, length);
+            func(it);
+        }
     });
 
     percent(progress, length);
@@ -48,11 +66,27 @@ void parallel_for_each(Container &container, const Body &func)
 {
     auto length = std::size(container);
     std::atomic<uint64_t> progress = 0;
-
-    tbb::parallel_for_each(container, [&](auto &f) {
-        percent(progress++, length);
-        func(f);
-    });
+    const std::string name = tracing ? detail::task_name() : std::string();
+
+    if constexpr (std::random_access_iterator<decltype(std::begin(container))>) {
+        // same partitioning tbb::parallel_for_each uses for these, but
+        // gives us whole chunks to trace
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, length), [&](const tbb::blocked_range<size_t> &range) {
+            trace_scope task(name, "task");
+            auto it = std::begin(container) + range.begin();
+
+            for (size_t i = range.begin(); i != range.end(); ++i, ++it) {
+                percent(progress++, length);
+                func(*it);
+            }
+        });
+    } else {
+        tbb::parallel_for_each(container, [&](auto &f) {
+            trace_scope task(name, "task");
+            percent(progress++, length);
+            func(f);
+        });
+    }
 
     percent(progress, length);
 }
@@ -62,12 +96,26 @@ void parallel_for_each(const Container &container, const Body &func)
 {
     auto length = std::size(container);
     std::atomic<uint64_t> progress = 0;
-
-    tbb::parallel_for_each(container, [&](const auto &f) {
-        percent(progress++, length);
-        func(f);
-    });
+    const std::string name = tracing ? detail::task_name() : std::string();
+
+    if constexpr (std::random_access_iterator<decltype(std::begin(container))>) {
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, length), [&](const tbb::blocked_range<size_t> &range) {
+            trace_scope task(name, "task");
+            auto it = std::begin(container) + range.begin();
+
+            for (size_t i = range.begin(); i != range.end(); ++i, ++it) {
+                percent(progress++, length);
+                func(*it);
+            }
+        });
+    } else {
+        tbb::parallel_for_each(container, [&](const auto &f) {
+            trace_scope task(name, "task");
+            percent(progress++, length);
+            func(f);
+        });
+    }
 
     percent(progress, length);
 }
-} // namespace logging
\ No newline at end of file
+} // namespace logging
@@ -0,0 +1,82 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/bspfile.hh>
+#include <common/fs.hh>
+#include <common/prtfile.hh>
+
+#include <optional>
+
+/*
+ * Lets qbsp, vis and light run back to back in one process without going
+ * through the disk in between. While a pipeline::scope is alive, each stage
+ * leaves its .bsp (and qbsp its .prt) in the handoff instead of writing it, and
+ * the next stage picks it up instead of loading the file. The .bsp is written
+ * once, by scope::finish.
+ *
+ * Without a scope, the tools read and write files as usual.
+ */
+namespace pipeline
+{
+struct handoff_t
+{
+    // the .bsp, in the format it would be written in; `file` is its path
+    std::optional<bspdata_t> bspdata;
+
+    // the portals, as vis would load them from `prt_path`
+    fs::path prt_path;
+    std::optional<prtfile_t> prtfile;
+
+    // also write the .prt, for callers that display it afterwards
+    bool write_prt = false;
+};
+
+class scope
+{
+    handoff_t *previous;
+
+public:
+    handoff_t handoff;
+
+    scope();
+    ~scope();
+
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+
+    // writes the pending .bsp, if any, to disk, and returns it
+    std::optional<bspdata_t> finish();
+};
+
+// the handoff of the innermost scope, or nullptr
+handoff_t *current();
+
+// moves `bspdata` into the handoff, if there is one; returns false
+// if the caller needs to write it itself
+bool give_bsp(bspdata_t &bspdata);
+
+// takes the pending .bsp, if there is one for `path`
+std::optional<bspdata_t> take_bsp(const fs::path &path);
+
+// same as above, for portal files
+bool give_prt(const fs::path &path, prtfile_t prtfile);
+std::optional<prtfile_t> take_prt(const fs::path &path);
+} // namespace pipeline
@@ -51,6 +51,7 @@ struct prtfile_t
 
 struct bspversion_t;
 prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion);
+prtfile_t LoadPrtFile(prtfile_t prtfile, const bspversion_t *loadversion, bool uses_detail, bool forceprt1);
 void WritePortalfile(
     const fs::path &name, const prtfile_t &prtfile, const bspversion_t *loadversion, bool uses_detail, bool forceprt1);
 
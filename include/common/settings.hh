@@ -675,6 +675,7 @@ public:
     setting_scalar tex_saturation_boost;
     setting_string logfile;
     setting_bool logappend;
+    setting_path trace;
 
     common_settings();
 
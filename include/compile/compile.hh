@@ -0,0 +1,50 @@
+/*  Copyright (C) 1996-1997  Id Software, Inc.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#pragma once
+
+#include <common/fs.hh>
+
+#include <string>
+#include <vector>
+
+// runs qbsp, vis and light in one process; see docs/compile.rst
+int compile_main(int argc, const char **argv);
+
+/*
+ * Compile server, for editors that compile on every save: runs jobs one at a
+ * time in a single long-running process, so .pak/.wad directories and decoded
+ * textures are only read once (see fs::set_archive_cache and
+ * img::set_decode_cache), light reuses its embree scene while the geometry
+ * doesn't change (Embree_SetSceneCache), and the thread pool stays up.
+ *
+ * Protocol, over a Unix domain socket:
+ *
+ * - the client sends the job as NUL-terminated strings: its working
+ *   directory, the tool ("qbsp", "vis", "light" or "compile"; "shutdown"
+ *   stops the server), then the tool's arguments as they would be passed on
+ *   the command line, then an empty string.
+ * - the server replies with frames of a 1-byte type, a 4-byte native-endian
+ *   length and that many bytes: 'L' frames carry log output, and a final 'X'
+ *   frame carries the job's exit code as an int32_t.
+ */
+int server_main(const fs::path &socket_path);
+
+// sends one job to a server, printing its log to stdout; returns its exit code
+int client_main(const fs::path &socket_path, const std::vector<std::string> &job);
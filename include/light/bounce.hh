@@ -20,6 +20,11 @@
 
 #pragma once
 
+#include <common/polylib.hh>
+#include <common/qvec.hh>
+
+#include <vector>
+
 namespace settings
 {
 class worldspawn_keys;
@@ -29,3 +34,8 @@ struct mbsp_t;
 // public functions
 
 bool MakeBounceLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp, size_t depth);
+
+// -emissivequality adaptive: the points of a bounce light on `winding` whose brightest
+// style emits `peak`, from one per `subdivision` cell at `full_intensity` down to one
+std::vector<qvec3f> AdaptiveBounceLightPoints(
+    polylib::winding3f_t winding, const qvec3f &normal, float subdivision, float peak, float full_intensity);
@@ -138,11 +138,56 @@ public:
  *    Stores the RGB values to determine the light color
  */
 
+/**
+ * Bounding volume hierarchy over the light entities' spheres of influence (see GetLightReach()), so a
+ * face only visits the lights that CullLight() wouldn't reject anyway. Lights that never fade below
+ * the gate are kept in a separate list that every query returns.
+ */
+class light_tree_t
+{
+public:
+    struct node_t
+    {
+        // union of the origin +/- reach boxes of the lights below
+        aabb3f bounds;
+
+        // leaves only: the light's origin and reach
+        qvec3f origin;
+        float reach;
+
+        // index into GetLights() for leaves, -1 for interior nodes
+        int32_t light;
+        uint32_t children[2];
+    };
+
+private:
+    std::vector<node_t> m_nodes;
+    std::vector<float> m_reach;
+    std::vector<uint32_t> m_unbounded;
+
+    uint32_t build_r(const std::vector<std::unique_ptr<light_t>> &lights, uint32_t *first, uint32_t *last);
+
+public:
+    void clear();
+    void build(const std::vector<std::unique_ptr<light_t>> &lights, std::vector<float> reach);
+
+    /**
+     * Fills `result` with the indices of every light that may reach the sphere at `origin`, sorted in
+     * ascending order so callers visit lights in the same order as a linear walk of GetLights().
+     */
+    void query(const qvec3f &origin, float radius, std::vector<uint32_t> &result) const;
+};
+
 void ResetLightEntities();
 std::string TargetnameForLightStyle(int style);
 std::vector<std::unique_ptr<light_t>> &GetLights();
+const light_tree_t &GetLightsTree();
 const std::vector<entdict_t> &GetEntdicts();
 std::vector<sun_t> &GetSuns();
+/**
+ * Indices into GetSuns(), grouped by sun direction.
+ */
+const std::vector<std::vector<size_t>> &GetSunDirectionGroups();
 std::vector<entdict_t> &GetRadLights();
 /**
  * Returns the light entity that has "_switchableshadow_target" set to the given value, or nullptr.
@@ -67,6 +67,10 @@ public:
     int style;
     std::string suntexture;
     const img::texture *suntexture_value;
+    // part of a _sunlight2/_sunlight3 dome
+    bool dome;
+    // index into GetSunDirectionGroups()
+    size_t direction_group;
 };
 
 class modelinfo_t;
@@ -132,9 +136,10 @@ struct lightsurf_t
 
     /*
      pvs for the entire light surface. generated by ORing together
-     the pvs at each of the sample points
+     the pvs at each of the sample points. shared between surfaces
+     (see CalcPvs), null without vis data or once faces are lit
      */
-    std::vector<uint8_t> pvs;
+    const std::vector<uint8_t> *pvs = nullptr;
     std::vector<const mleaf_t *> leaves;
 
     // output width * extra
@@ -143,6 +148,9 @@ struct lightsurf_t
     int height;
 
     lightmapdict_t lightmapsByStyle;
+    // with -denoise, bounce, surface light and sky dome light are kept
+    // here until PostProcessLightFace filters them into lightmapsByStyle
+    lightmapdict_t noisyLightmapsByStyle;
 
     // surface light stuff
     std::unique_ptr<surfacelight_t> vpl;
@@ -263,7 +271,8 @@ enum class emissivequality_t
 {
     LOW,
     MEDIUM,
-    HIGH
+    HIGH,
+    ADAPTIVE // same points as HIGH for surface lights; see MakeBounceLightsThread
 };
 
 enum class lightgrid_format_t
@@ -325,6 +334,7 @@ public:
     setting_scalar bouncescale;
     setting_scalar bouncecolorscale;
     setting_scalar bouncelightsubdivision;
+    setting_scalar bounceadaptiveintensity;
 
     /* Q2 surface lights (mxd) */
     setting_scalar surflightscale;
@@ -401,11 +411,14 @@ public:
     setting_vec3 debugface;
     setting_vec3 debugvert;
     setting_bool highlightseams;
+    setting_bool nosungroups;
     setting_soft soft;
+    setting_int32 denoise;
     setting_set radlights;
     setting_int32 lightmap_scale;
     setting_extra extra;
     setting_enum<emissivequality_t> emissivequality;
+    setting_int32 skyvis;
     setting_enum<visapprox_t> visapprox;
     setting_func lit;
     setting_func lit2;
@@ -435,6 +448,9 @@ public:
     setting_func debugneighbours;
     setting_func debugmottle;
     setting_bool debug_lightgrid_octree;
+    setting_bool debug_lightgrid_dense;
+    setting_bool debug_surflight_linear;
+    setting_bool debug_single_rays;
 
     light_settings();
 
@@ -457,11 +473,21 @@ public:
 extern settings::light_settings light_options;
 
 const std::unordered_map<int, std::vector<uint8_t>> &UncompressedVis();
+/**
+ * The leaves whose marksurfaces include the given face, in dleafs order.
+ */
+std::span<const mleaf_t *const> LeavesForFace(int facenum);
+/**
+ * Builds the table LeavesForFace() reads from.
+ */
+void BuildFaceLeaves(const mbsp_t *bsp);
 
 bool IsOutputtingSupplementaryData();
 
 std::span<lightsurf_t> &LightSurfaces();
 std::vector<lightsurf_t *> &EmissiveLightSurfaces();
+class surflight_tree_t;
+const surflight_tree_t &EmissiveLightSurfacesTree();
 
 extern std::vector<surfflags_t> extended_texinfo_flags;
 extern std::vector<contentflags_t> extended_content_flags;
@@ -481,5 +507,12 @@ const qvec3b &Face_LookupTextureColor(const mbsp_t *bsp, const mface_t *face);
 const qvec3f &Face_LookupTextureBounceColor(const mbsp_t *bsp, const mface_t *face);
 void SetLitNeeded(const bspdata_t &bspdata);
 void light_reset();
+
+// keep the embree scene across light runs, and reuse it when the next run's
+// shadow-casting triangles are the same (only entities or light options
+// changed). for long-running processes that light the same map many times.
+void Embree_SetSceneCache(bool enabled);
+// whether the last run reused the cached scene instead of building one
+bool Embree_SceneReused();
 int light_main(int argc, const char **argv);
 int light_main(const std::vector<std::string> &args);
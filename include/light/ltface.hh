@@ -23,10 +23,15 @@
 
 #include <common/qvec.hh>
 
+#include <algorithm>
 #include <atomic>
 #include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
 
 struct mface_t;
+struct mleaf_t;
 struct mbsp_t;
 
 namespace settings
@@ -34,6 +39,7 @@ namespace settings
 class worldspawn_keys;
 }
 struct lightsurf_t;
+struct lightsample_t;
 struct bspx_decoupled_lm_perface;
 class faceextents_t;
 class light_t;
@@ -48,14 +54,102 @@ extern std::atomic<uint32_t> fully_transparent_lightmaps; // write.cc
 
 void PrintFaceInfo(const mface_t *face, const mbsp_t *bsp);
 void SetupDirt(settings::worldspawn_keys &cfg);
+void ClearLightsurfPvsPool();
+// the PVS of a surface in `leaves`: their rows of `vis` ORed together, shared
+// with every other surface made of the same rows (until ClearLightsurfPvsPool)
+const std::vector<uint8_t> *LightsurfPvs(const mbsp_t *bsp, const std::unordered_map<int, std::vector<uint8_t>> &vis,
+    std::span<const mleaf_t *const> leaves);
 lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const facesup_t *facesup,
     const bspx_decoupled_lm_perface *facesup_decoupled, const settings::worldspawn_keys &cfg);
+float GetLightReach(const settings::worldspawn_keys &cfg, const light_t *entity);
 bool Face_IsLightmapped(const mbsp_t *bsp, const mface_t *face);
 bool Face_IsEmissive(const mbsp_t *bsp, const mface_t *face);
 void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
 void IndirectLightFace(
     const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, size_t bounce_depth);
 void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
+// the -denoise filter; `spacing` is the world space distance between samples
+void Denoise_Lightsamples(const lightsurf_t &lightsurf, float spacing, int passes, std::vector<lightsample_t> &samples);
+
+/*
+ * -skyvis: fills in hits[i] for the `wanted` samples of a width x height face.
+ * Every `spacing`th sample in s and t, plus the last row and column, is
+ * traced first. The samples in between take the hit of the four lattice
+ * samples around them when those were traced and agree, and are traced
+ * themselves otherwise (across shadow edges). `trace` is given a batch of
+ * sample indices and fills in their hits. Returns how many samples were traced.
+ */
+template<typename T, typename F>
+size_t SkyVis_TraceLattice(
+    int width, int height, int spacing, const std::vector<uint8_t> &wanted, std::vector<T> &hits, F &&trace)
+{
+    thread_local static std::vector<uint8_t> traced;
+    thread_local static std::vector<int> batch;
+    traced.assign(static_cast<size_t>(width) * height, false);
+
+    auto on_lattice = [spacing](int x, int size) { return x % spacing == 0 || x == size - 1; };
+
+    batch.clear();
+    for (int t = 0; t < height; t++) {
+        for (int s = 0; s < width; s++) {
+            const int i = t * width + s;
+
+            if (!wanted[i])
+                continue;
+            if (spacing > 1 && !(on_lattice(s, width) && on_lattice(t, height)))
+                continue;
+
+            batch.push_back(i);
+        }
+    }
+
+    if (!batch.empty()) {
+        trace(batch);
+    }
+    for (int i : batch) {
+        traced[i] = true;
+    }
+
+    size_t num_traced = batch.size();
+
+    if (spacing <= 1) {
+        return num_traced;
+    }
+
+    batch.clear();
+    for (int t = 0; t < height; t++) {
+        for (int s = 0; s < width; s++) {
+            const int i = t * width + s;
+
+            if (!wanted[i] || traced[i])
+                continue;
+
+            const int s0 = s - (s % spacing), s1 = std::min(s0 + spacing, width - 1);
+            const int t0 = t - (t % spacing), t1 = std::min(t0 + spacing, height - 1);
+            const int corners[4] = {t0 * width + s0, t0 * width + s1, t1 * width + s0, t1 * width + s1};
+
+            bool agree = true;
+            for (int corner : corners) {
+                if (!traced[corner] || !(hits[corner] == hits[corners[0]])) {
+                    agree = false;
+                    break;
+                }
+            }
+
+            if (agree) {
+                hits[i] = hits[corners[0]];
+            } else {
+                batch.push_back(i);
+            }
+        }
+    }
+
+    if (!batch.empty()) {
+        trace(batch);
+    }
+
+    return num_traced + batch.size();
+}
 
 qvec3b round_to_int(const qvec3f &color);
 
@@ -22,6 +22,7 @@ See file, 'COPYING', for details.
 
 #include <vector>
 #include <optional>
+#include <algorithm>
 #include <tuple>
 
 #include <common/qvec.hh>
@@ -48,6 +49,10 @@ struct surfacelight_t
 
     std::vector<qvec3f> points;
 
+    // points are ordered so any prefix is spread over the whole face, and receivers
+    // may stop tracing once their estimate converges (-emissivequality adaptive)
+    bool progressive = false;
+
     // Surface light settings...
     struct per_style_t
     {
@@ -71,6 +76,90 @@ struct surfacelight_t
 };
 
 class light_t;
+struct lightsurf_t;
+
+/**
+ * Bounding volume hierarchy over the emissive light surfaces (see EmissiveLightSurfaces()).
+ *
+ * Each node stores conservative bounds for all of the emitters below it (point bounds, a normal cone
+ * and the peak intensity), so a receiving face can reject a whole subtree of surface lights at once
+ * instead of testing every emitter. Leaves hold a single emitter, so the node tests also replace the
+ * per-emitter tests.
+ */
+class surflight_tree_t
+{
+public:
+    struct node_t
+    {
+        // bounds of every VPL point (rays are cast from these)
+        aabb3f point_bounds;
+        // bounds of surfacelight_t::pos
+        aabb3f pos_bounds;
+        // union of surfacelight_t::bounds (only populated with visapprox RAYS)
+        aabb3f visible_bounds;
+
+        // normal cone of the emitters; ignored if any style is omnidirectional
+        qvec3f cone_axis;
+        float cone_angle;
+        bool omnidirectional;
+
+        // max over all styles of |totalintensity| * |color|, for the gate test
+        float peak_intensity;
+        // min over all styles of atten
+        float min_atten;
+
+        // index into EmissiveLightSurfaces() for leaves, -1 for interior nodes
+        int32_t emitter;
+        uint32_t children[2];
+    };
+
+private:
+    std::vector<node_t> m_nodes;
+
+    uint32_t build_r(const std::vector<lightsurf_t *> &emitters, uint32_t *first, uint32_t *last);
+
+public:
+    void clear() { m_nodes.clear(); }
+    void build(const std::vector<lightsurf_t *> &emitters);
+
+    const std::vector<node_t> &nodes() const { return m_nodes; }
+
+    /**
+     * Fills `result` with the indices of every emitter whose leaf (and all of whose ancestors) are not
+     * rejected by `culled`, sorted in ascending order so callers visit emitters in the same order
+     * as a linear walk of EmissiveLightSurfaces().
+     */
+    template<typename TCull>
+    void query(TCull &&culled, std::vector<uint32_t> &result) const
+    {
+        result.clear();
+
+        if (m_nodes.empty()) {
+            return;
+        }
+
+        uint32_t stack[64];
+        size_t stack_size = 0;
+        stack[stack_size++] = 0;
+
+        while (stack_size) {
+            const node_t &node = m_nodes[stack[--stack_size]];
+
+            if (culled(node)) {
+                continue;
+            }
+
+            if (node.emitter >= 0) {
+                result.push_back(node.emitter);
+            } else {
+                stack[stack_size++] = node.children[1];
+                stack[stack_size++] = node.children[0];
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+    }
+};
 
 void ResetSurflight();
 size_t GetSurflightPoints();
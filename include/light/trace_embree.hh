@@ -23,6 +23,7 @@
 #include <common/qvec.hh>
 #include <common/log.hh> // for FError
 
+#include <array>
 #include <vector>
 #include <set>
 
@@ -68,11 +69,72 @@ struct alignas(16) aligned_vec3
     float x, y, z, w;
 };
 
+extern RTCScene scene;
+
+// widest ray packet the embree device traces natively (4, 8 or 16); 1 disables packet tracing.
+// set by Embree_TraceInit
+extern int embree_packet_width;
+
+// maps a packet width onto the embree packet types / entry points
+template<size_t N>
+struct embree_packet_traits_t;
+
+template<>
+struct embree_packet_traits_t<4>
+{
+    using ray_type = RTCRay4;
+    using rayhit_type = RTCRayHit4;
+
+    static inline void occluded(const int *valid, ray_type *ray, RTCOccludedArguments *args)
+    {
+        rtcOccluded4(valid, scene, ray, args);
+    }
+    static inline void intersect(const int *valid, rayhit_type *rayhit, RTCIntersectArguments *args)
+    {
+        rtcIntersect4(valid, scene, rayhit, args);
+    }
+};
+
+template<>
+struct embree_packet_traits_t<8>
+{
+    using ray_type = RTCRay8;
+    using rayhit_type = RTCRayHit8;
+
+    static inline void occluded(const int *valid, ray_type *ray, RTCOccludedArguments *args)
+    {
+        rtcOccluded8(valid, scene, ray, args);
+    }
+    static inline void intersect(const int *valid, rayhit_type *rayhit, RTCIntersectArguments *args)
+    {
+        rtcIntersect8(valid, scene, rayhit, args);
+    }
+};
+
+template<>
+struct embree_packet_traits_t<16>
+{
+    using ray_type = RTCRay16;
+    using rayhit_type = RTCRayHit16;
+
+    static inline void occluded(const int *valid, ray_type *ray, RTCOccludedArguments *args)
+    {
+        rtcOccluded16(valid, scene, ray, args);
+    }
+    static inline void intersect(const int *valid, rayhit_type *rayhit, RTCIntersectArguments *args)
+    {
+        rtcIntersect16(valid, scene, rayhit, args);
+    }
+};
+
 class raystream_embree_common_t
 {
 protected:
     aligned_vector<ray_io> _rays;
 
+    // scratch; indices into _rays grouped by direction octant, see sortRaysByOctant
+    std::vector<uint32_t> _order;
+
 public:
     inline raystream_embree_common_t() = default;
     inline raystream_embree_common_t(size_t capacity) { _rays.reserve(capacity); }
@@ -132,9 +194,138 @@ protected:
         ray.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
         return ray;
     }
-};
 
-extern RTCScene scene;
+    /**
+     * Fills _order with the indices of _rays, grouped by the sign bits of the ray
+     * direction, so each packet handed to embree shares a traversal order as much as possible.
+     * Stable within an octant, so the already-coherent batches pushed by the callers stay together.
+     */
+    inline void sortRaysByOctant()
+    {
+        auto octant = [](const RTCRay &ray) {
+            return (ray.dir_x < 0.0f ? 1 : 0) | (ray.dir_y < 0.0f ? 2 : 0) | (ray.dir_z < 0.0f ? 4 : 0);
+        };
+
+        std::array<uint32_t, 9> offsets{};
+        for (const ray_io &ray : _rays) {
+            offsets[octant(ray.ray.ray) + 1]++;
+        }
+        for (size_t i = 1; i < offsets.size(); i++) {
+            offsets[i] += offsets[i - 1];
+        }
+
+        _order.resize(_rays.size());
+        for (uint32_t i = 0; i < _rays.size(); i++) {
+            _order[offsets[octant(_rays[i].ray.ray)]++] = i;
+        }
+    }
+
+    template<typename TPacket>
+    static inline void LoadPacketRay(TPacket &packet, size_t lane, const RTCRay &ray)
+    {
+        packet.org_x[lane] = ray.org_x;
+        packet.org_y[lane] = ray.org_y;
+        packet.org_z[lane] = ray.org_z;
+        packet.tnear[lane] = ray.tnear;
+        packet.dir_x[lane] = ray.dir_x;
+        packet.dir_y[lane] = ray.dir_y;
+        packet.dir_z[lane] = ray.dir_z;
+        packet.time[lane] = ray.time;
+        packet.tfar[lane] = ray.tfar;
+        packet.mask[lane] = ray.mask;
+        packet.id[lane] = ray.id;
+        packet.flags[lane] = ray.flags;
+    }
+
+    template<typename THitPacket>
+    static inline void LoadPacketHit(THitPacket &packet, size_t lane, const RTCHit &hit)
+    {
+        packet.geomID[lane] = hit.geomID;
+        packet.primID[lane] = hit.primID;
+        packet.instID[0][lane] = hit.instID[0];
+    }
+
+    template<typename THitPacket>
+    static inline void StorePacketHit(const THitPacket &packet, size_t lane, RTCHit &hit)
+    {
+        hit.Ng_x = packet.Ng_x[lane];
+        hit.Ng_y = packet.Ng_y[lane];
+        hit.Ng_z = packet.Ng_z[lane];
+        hit.u = packet.u[lane];
+        hit.v = packet.v[lane];
+        hit.primID = packet.primID[lane];
+        hit.geomID = packet.geomID[lane];
+        hit.instID[0] = packet.instID[0][lane];
+    }
+
+    /**
+     * Traces _rays for occlusion in packets of N, writing each ray's tfar back
+     * (negative if occluded). Ray ids are preserved so the filter functions can still
+     * find the originating ray_io via ray_source_info::raystream.
+     */
+    template<size_t N>
+    inline void traceOccludedPackets(RTCOccludedArguments *args)
+    {
+        using traits = embree_packet_traits_t<N>;
+
+        sortRaysByOctant();
+
+        for (size_t first = 0; first < _order.size(); first += N) {
+            const size_t count = std::min(N, _order.size() - first);
+
+            alignas(64) int valid[N];
+            alignas(64) typename traits::ray_type packet;
+
+            // inactive lanes are masked off by `valid`, but still get a copy of the first ray so they hold sane data
+            for (size_t lane = 0; lane < N; lane++) {
+                valid[lane] = (lane < count) ? -1 : 0;
+                LoadPacketRay(packet, lane, _rays[_order[first + (lane < count ? lane : 0)]].ray.ray);
+            }
+
+            traits::occluded(valid, &packet, args);
+
+            for (size_t lane = 0; lane < count; lane++) {
+                _rays[_order[first + lane]].ray.ray.tfar = packet.tfar[lane];
+            }
+        }
+    }
+
+    /**
+     * Traces _rays for the closest hit in packets of N, writing tfar and the hit record back.
+     */
+    template<size_t N>
+    inline void traceIntersectionPackets(RTCIntersectArguments *args)
+    {
+        using traits = embree_packet_traits_t<N>;
+
+        sortRaysByOctant();
+
+        for (size_t first = 0; first < _order.size(); first += N) {
+            const size_t count = std::min(N, _order.size() - first);
+
+            alignas(64) int valid[N];
+            alignas(64) typename traits::rayhit_type packet;
+
+            // inactive lanes are masked off by `valid`, but still get a copy of the first ray so they hold sane data
+            for (size_t lane = 0; lane < N; lane++) {
+                const RTCRayHit &src = _rays[_order[first + (lane < count ? lane : 0)]].ray;
+
+                valid[lane] = (lane < count) ? -1 : 0;
+                LoadPacketRay(packet.ray, lane, src.ray);
+                LoadPacketHit(packet.hit, lane, src.hit);
+            }
+
+            traits::intersect(valid, &packet, args);
+
+            for (size_t lane = 0; lane < count; lane++) {
+                RTCRayHit &dst = _rays[_order[first + lane]].ray;
+
+                dst.ray.tfar = packet.ray.tfar[lane];
+                StorePacketHit(packet.hit, lane, dst.hit);
+            }
+        }
+    }
+};
 
 struct ray_source_info : public RTCRayQueryContext
 {
@@ -222,8 +413,18 @@ public:
         ray_source_info ctx2(this, self, shadowmask);
 
         RTCIntersectArguments embree4_args = ctx2.setup_intersection_arguments();
-        for (auto &ray : _rays)
-            rtcIntersect1(scene, &ray.ray, &embree4_args);
+
+        // a single ray isn't worth packing
+        if (embree_packet_width == 16 && _rays.size() > 1) {
+            traceIntersectionPackets<16>(&embree4_args);
+        } else if (embree_packet_width == 8 && _rays.size() > 1) {
+            traceIntersectionPackets<8>(&embree4_args);
+        } else if (embree_packet_width == 4 && _rays.size() > 1) {
+            traceIntersectionPackets<4>(&embree4_args);
+        } else {
+            for (auto &ray : _rays)
+                rtcIntersect1(scene, &ray.ray, &embree4_args);
+        }
     }
 
     inline const qvec3f &getPushedRayDir(size_t j) const { return *((qvec3f *)&_rays[j].ray.ray.dir_x); }
@@ -282,8 +483,18 @@ public:
 
         ray_source_info ctx2(this, self, shadowmask);
         RTCOccludedArguments embree4_args = ctx2.setup_occluded_arguments();
-        for (auto &ray : _rays)
-            rtcOccluded1(scene, &ray.ray.ray, &embree4_args);
+
+        // a single ray isn't worth packing
+        if (embree_packet_width == 16 && _rays.size() > 1) {
+            traceOccludedPackets<16>(&embree4_args);
+        } else if (embree_packet_width == 8 && _rays.size() > 1) {
+            traceOccludedPackets<8>(&embree4_args);
+        } else if (embree_packet_width == 4 && _rays.size() > 1) {
+            traceOccludedPackets<4>(&embree4_args);
+        } else {
+            for (auto &ray : _rays)
+                rtcOccluded1(scene, &ray.ray.ray, &embree4_args);
+        }
     }
 
     inline bool getPushedRayOccluded(size_t j) const { return (_rays[j].ray.ray.tfar < 0.0f); }
@@ -26,6 +26,7 @@
 
 #include <list>
 #include <memory>
+#include <span>
 #include <tuple>
 #include <vector>
 
@@ -38,4 +39,17 @@ std::tuple<std::unique_ptr<face_t>, std::unique_ptr<face_t>> SplitFace(
     std::unique_ptr<face_t> in, const qplane3d &split);
 void UpdateFaceSphere(face_t *in);
 
+// for each brush, the indices of the other brushes whose bounds touch or overlap it
+struct brush_overlaps_t
+{
+    std::vector<size_t> offsets; // size() + 1 entries into `indices`
+    std::vector<size_t> indices;
+
+    inline std::span<const size_t> of(size_t i) const
+    {
+        return {indices.data() + offsets[i], indices.data() + offsets[i + 1]};
+    }
+};
+
+brush_overlaps_t FindOverlappingBrushes(const bspbrush_t::container &brushes);
 bspbrush_t::container CSGFaces(bspbrush_t::container brushes);
@@ -37,6 +37,8 @@
 #include <shared_mutex>
 #include <string_view>
 
+#include <tbb/concurrent_vector.h>
+
 struct mapface_t
 {
     size_t planenum;
@@ -192,11 +194,19 @@ struct mapdata_t
     // output in the BSP, from the map's own sides. The positive planes
     // come first (are even-numbered, with 0 being even) and the negative
     // planes are odd-numbered.
-    std::vector<mapplane_t> planes;
+    // concurrent_vector keeps plane references stable while the collision
+    // hulls add planes from parallel tasks; see add_or_find_plane.
+    tbb::concurrent_vector<mapplane_t> planes;
 
-    // planes indices (into the `planes` vector)
+    // planes indices (into the `planes` vector); safe to use from parallel tasks
     std::unique_ptr<planehash_t> plane_hash;
 
+    // set while the collision hulls are built in parallel. add_or_find_plane
+    // still finds the planes made before, but a new plane (numbered at or
+    // above this) is left out of plane_hash, so only the task that made it
+    // uses it; CreateClipHull merges them afterwards, in entity order.
+    std::optional<size_t> frozen_plane_count;
+
     mapdata_t();
 
     // add the specified plane to the list
@@ -337,6 +347,8 @@ qvec3d FixRotateOrigin(mapentity_t &entity);
 
 /* Create BSP brushes from map brushes */
 void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes, size_t &num_clipped);
+/* Create the expanded planes a collision hull will use, ahead of building it */
+void Brush_ReserveHullPlanes(const mapentity_t &entity, hull_index_t hullnum);
 
 size_t EmitFaces(node_t *headnode);
 void EmitVertices(node_t *headnode);
@@ -199,6 +199,8 @@ public:
     setting_bool leaktest;
     setting_bool outsidedebug;
     setting_bool debugchop;
+    setting_bool debugchopnoislands;
+    setting_bool debugserialhulls;
     setting_bool debugleak;
     setting_bool debugbspbrushes;
     setting_bool debugleafvolumes;
@@ -26,6 +26,8 @@
 #include <common/prtfile.hh>
 #include <vis/leafbits.hh>
 
+#include <atomic>
+
 constexpr double VIS_ON_EPSILON = 0.1;
 constexpr double VIS_EQUAL_EPSILON = 0.001;
 
@@ -137,6 +139,18 @@ struct visportal_t
     int numcansee;
 };
 
+// status, mightsee and nummightsee of other portals change while a portal
+// flows, so they're accessed atomically outside of setup
+inline pstatus_t PortalStatus(const visportal_t &p)
+{
+    return std::atomic_ref(const_cast<pstatus_t &>(p.status)).load();
+}
+
+inline void SetPortalStatus(visportal_t &p, pstatus_t status)
+{
+    std::atomic_ref(p.status).store(status);
+}
+
 inline float viswinding_t::distFromPortal(visportal_t &p)
 {
     double mindist = 1e20;
@@ -210,6 +224,17 @@ struct visstats_t
 viswinding_t *AllocStackWinding(pstack_t &stack);
 void FreeStackWinding(viswinding_t *&w, pstack_t &stack);
 viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split);
+viswinding_t *ClipStackWindingToPlanes(
+    visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d *planes, size_t numplanes);
+
+// distances and SIDE_* of each point to the plane; counts is indexed by SIDE_*
+void ClassifyPoints(
+    const qvec3d *points, size_t numpoints, const qplane3d &plane, double *dists, int *sides, int *counts);
+void ClassifyPoints_Scalar(
+    const qvec3d *points, size_t numpoints, const qplane3d &plane, double *dists, int *sides, int *counts);
+// SIDE_* of a bounding sphere against each plane
+void ClassifySphere(const qplane3d *planes, size_t numplanes, const qvec3d &origin, double radius, int *sides);
+void ClassifySphere_Scalar(const qplane3d *planes, size_t numplanes, const qvec3d &origin, double radius, int *sides);
 
 struct threaddata_t
 {
@@ -224,6 +249,7 @@ struct threaddata_t
 extern int numportals;
 extern int portalleafs;
 extern int portalleafs_real;
+extern int reusedportals; // by -incremental, out of numportals * 2
 
 extern std::vector<visportal_t> portals; // always numportals * 2; front and back
 extern std::vector<leaf_t> leafs;
@@ -252,6 +278,7 @@ extern qtime_point starttime, endtime, statetime;
 
 void SaveVisState();
 bool LoadVisState();
+int ReuseVisState();
 void CleanVisState();
 
 #include <common/settings.hh>
@@ -276,6 +303,8 @@ public:
     setting_scalar visdist{
         this, "visdist", 0.0, &vis_advanced_group, "control the distance required for a portal to be considered seen"};
     setting_bool nostate{this, "nostate", false, &vis_advanced_group, "ignore saved state files, for forced re-runs"};
+    setting_bool incremental{this, "incremental", false, &vis_advanced_group,
+        "keep the state file after vis finishes, and on the next run reuse the results of portals unaffected by map changes"};
     setting_bool phsonly{
         this, "phsonly", false, &vis_advanced_group, "re-calculate the PHS of a Quake II BSP without touching the PVS"};
     setting_invertible_bool autoclean{
@@ -33,6 +33,8 @@
 #include <common/polylib.hh>
 #include <common/bsputils.hh>
 
+#include <algorithm>
+#include <numeric>
 #include <vector>
 #include <unordered_map>
 #include <mutex>
@@ -74,6 +76,75 @@ static bool Face_ShouldBounce(const mbsp_t *bsp, const mface_t *face)
     return true;
 }
 
+static uint32_t ReverseBits(uint32_t v)
+{
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0F0F0F0Fu) | ((v & 0x0F0F0F0Fu) << 4);
+    v = ((v >> 8) & 0x00FF00FFu) | ((v & 0x00FF00FFu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+/*
+ * Picks `count` of the diced cells for an adaptive bounce light, stratified over the
+ * cumulative cell area. The strata are visited in van der Corput order, so any prefix
+ * of the result is spread over the whole face (see LightFace_SurfaceLight_Progressive).
+ * Large cells may be picked more than once; that keeps the area weighting exact.
+ */
+static std::vector<qvec3f> SelectAdaptivePoints(
+    const std::vector<qvec3f> &cells, const std::vector<float> &cell_areas, size_t count)
+{
+    if (cells.empty()) {
+        return {};
+    }
+
+    count = std::clamp<size_t>(count, 1, cells.size());
+
+    std::vector<float> cumulative(cell_areas.size());
+    std::partial_sum(cell_areas.begin(), cell_areas.end(), cumulative.begin());
+    const float total = cumulative.back();
+
+    std::vector<uint32_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [](uint32_t a, uint32_t b) { return ReverseBits(a) < ReverseBits(b); });
+
+    std::vector<qvec3f> points;
+    points.reserve(count);
+
+    for (uint32_t k : order) {
+        const float u = (k + 0.5f) / count * total;
+        const size_t cell = std::min<size_t>(
+            std::upper_bound(cumulative.begin(), cumulative.end(), u) - cumulative.begin(), cells.size() - 1);
+        points.push_back(cells[cell]);
+    }
+
+    return points;
+}
+
+/*
+ * The number of points follows the emitter's power (intensity * area), relative to the one
+ * point per cell HIGH uses for a face emitting `full_intensity`, so dim faces get fewer.
+ *
+ * Distance to the receivers is deliberately left out. The points only decide how finely the
+ * emitter's area is sampled, and the receivers that need that are the close ones, which the
+ * emitter can't know about here. Far and dim receivers are what the progressive tracing in
+ * LightFace_SurfaceLight_Progressive saves on: each luxel stops once its estimate converges.
+ */
+std::vector<qvec3f> AdaptiveBounceLightPoints(
+    polylib::winding3f_t winding, const qvec3f &normal, float subdivision, float peak, float full_intensity)
+{
+    std::vector<qvec3f> cells;
+    std::vector<float> cell_areas;
+
+    winding.dice(subdivision, [&](polylib::winding3f_t &w) {
+        cells.push_back(w.center() + normal);
+        cell_areas.push_back(w.area());
+    });
+
+    const size_t count = static_cast<size_t>(std::ceil(cells.size() * peak / full_intensity));
+    return SelectAdaptivePoints(cells, cell_areas, count);
+}
+
 static void MakeBounceLight(const mbsp_t *bsp, const settings::worldspawn_keys &cfg, lightsurf_t &surf,
     qvec3f texture_color, int32_t style, std::vector<qvec3f> &points, float area, const qvec3f &facenormal,
     const qvec3f &facemidpoint, size_t depth)
@@ -116,6 +187,7 @@ static void MakeBounceLight(const mbsp_t *bsp, const settings::worldspawn_keys &
         }
 
         l->pos = facemidpoint;
+        l->progressive = light_options.emissivequality.value() == emissivequality_t::ADAPTIVE;
     }
 
     // Store surfacelight settings...
@@ -210,6 +282,14 @@ static bool MakeBounceLightsThread(
                 points.push_back(pt + faceplane.normal);
             }
         }
+    } else if (light_options.emissivequality.value() == emissivequality_t::ADAPTIVE) {
+        float peak = 0;
+        for (const auto &style : emitcolors) {
+            peak = std::max(peak, qv::max(style.second));
+        }
+
+        points = AdaptiveBounceLightPoints(std::move(winding), faceplane.normal,
+            cfg.bouncelightsubdivision.value(), peak, cfg.bounceadaptiveintensity.value());
     } else {
         winding.dice(cfg.bouncelightsubdivision.value(),
             [&points, &faceplane](polylib::winding3f_t &w) { points.push_back(w.center() + faceplane.normal); });
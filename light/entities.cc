@@ -31,11 +31,15 @@
 #include <light/trace.hh>
 #include <light/trace_embree.hh>
 #include <light/light.hh>
+#include <light/ltface.hh> // for GetLightReach
 #include <common/bsputils.hh>
 #include <common/parallel.hh>
 
 static std::vector<std::unique_ptr<light_t>> all_lights;
+// BVH over all_lights
+static light_tree_t lights_tree;
 static std::vector<sun_t> all_suns;
+static std::vector<std::vector<size_t>> sun_direction_groups;
 static std::vector<entdict_t> entdicts;
 static std::vector<entdict_t> radlights;
 static std::vector<std::pair<std::string, int>> lightstyleForTargetname;
@@ -50,7 +54,9 @@ static std::map<std::string, light_t *> lights_by_switchableshadow_target;
 void ResetLightEntities()
 {
     all_lights.clear();
+    lights_tree.clear();
     all_suns.clear();
+    sun_direction_groups.clear();
     entdicts.clear();
     radlights.clear();
 
@@ -67,6 +73,11 @@ std::vector<std::unique_ptr<light_t>> &GetLights()
     return all_lights;
 }
 
+const light_tree_t &GetLightsTree()
+{
+    return lights_tree;
+}
+
 const std::vector<entdict_t> &GetEntdicts()
 {
     return entdicts;
@@ -77,6 +88,11 @@ std::vector<sun_t> &GetSuns()
     return all_suns;
 }
 
+const std::vector<std::vector<size_t>> &GetSunDirectionGroups()
+{
+    return sun_direction_groups;
+}
+
 std::vector<entdict_t> &GetRadLights()
 {
     return radlights;
@@ -417,6 +433,8 @@ static void AddSun(const settings::worldspawn_keys &cfg, const qvec3f &sunvec, f
     sun.anglescale = sun_anglescale;
     sun.dirt = Dirt_ResolveFlag(cfg, dirtInt);
     sun.style = style;
+    sun.dome = false;
+    sun.direction_group = 0;
     sun.suntexture = suntexture;
     if (!suntexture.empty())
         sun.suntexture_value = img::find(suntexture);
@@ -558,6 +576,8 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, float upperLight,
         return;
     }
 
+    const size_t firstSun = all_suns.size();
+
     /* setup */
     elevationSteps = iterations - 1;
     angleSteps = elevationSteps * 4;
@@ -615,6 +635,10 @@ static void SetupSkyDome(const settings::worldspawn_keys &cfg, float upperLight,
         AddSun(
             cfg, {0.0, 0.0, 1.0}, sunlight3value, lowerColor, lowerDirt, lowerAnglescale, lowerStyle, lowerSuntexture);
     }
+
+    for (size_t k = firstSun; k < all_suns.size(); k++) {
+        all_suns[k].dome = true;
+    }
 }
 
 static void SetupSkyDomes(const settings::worldspawn_keys &cfg)
@@ -644,6 +668,160 @@ static void SetupSkyDomes(const settings::worldspawn_keys &cfg)
     }
 }
 
+/*
+ * =============
+ * GroupSunsByDirection
+ *
+ * Groups the indices of suns that cast along exactly the same direction
+ * (e.g. overlapping sky domes), so their rays only need tracing once.
+ * Groups are in order of their first sun. With -denoise or -skyvis, dome
+ * suns never share a group with other suns, since their light is filtered
+ * (or traced) separately. -nosungroups gives every sun a group of its own.
+ * =============
+ */
+static void GroupSunsByDirection()
+{
+    sun_direction_groups.clear();
+
+    std::map<std::pair<qvec3f, bool>, size_t> group_for_direction;
+    const bool split_domes = light_options.denoise.value() > 0 || light_options.skyvis.value() > 1;
+
+    for (size_t i = 0; i < all_suns.size(); i++) {
+        size_t group = sun_direction_groups.size();
+
+        if (!light_options.nosungroups.value()) {
+            group = group_for_direction
+                        .try_emplace(std::make_pair(all_suns[i].sunvec, split_domes && all_suns[i].dome), group)
+                        .first->second;
+        }
+
+        if (group == sun_direction_groups.size()) {
+            sun_direction_groups.emplace_back();
+        }
+
+        sun_direction_groups[group].push_back(i);
+        all_suns[i].direction_group = group;
+    }
+}
+
+// light_tree_t
+
+void light_tree_t::clear()
+{
+    m_nodes.clear();
+    m_reach.clear();
+    m_unbounded.clear();
+}
+
+uint32_t light_tree_t::build_r(const std::vector<std::unique_ptr<light_t>> &lights, uint32_t *first, uint32_t *last)
+{
+    const uint32_t node_index = m_nodes.size();
+    m_nodes.emplace_back();
+
+    node_t node{};
+    node.light = -1;
+
+    aabb3f origin_bounds;
+
+    for (uint32_t *it = first; it != last; ++it) {
+        const qvec3f &origin = lights[*it]->origin.value();
+        const qvec3f reach{m_reach[*it]};
+
+        node.bounds += aabb3f(origin - reach, origin + reach);
+        origin_bounds += origin;
+    }
+
+    if (last - first == 1) {
+        node.light = *first;
+        node.origin = lights[*first]->origin.value();
+        node.reach = m_reach[*first];
+    } else {
+        // median split along the longest axis of the light origins
+        const qvec3f size = origin_bounds.size();
+        const size_t axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2] ? 1 : 2);
+
+        uint32_t *mid = first + (last - first) / 2;
+        std::nth_element(first, mid, last,
+            [&](uint32_t a, uint32_t b) { return lights[a]->origin.value()[axis] < lights[b]->origin.value()[axis]; });
+
+        node.children[0] = build_r(lights, first, mid);
+        node.children[1] = build_r(lights, mid, last);
+    }
+
+    m_nodes[node_index] = node;
+    return node_index;
+}
+
+void light_tree_t::build(const std::vector<std::unique_ptr<light_t>> &lights, std::vector<float> reach)
+{
+    clear();
+
+    m_reach = std::move(reach);
+
+    std::vector<uint32_t> bounded;
+
+    for (uint32_t i = 0; i < lights.size(); i++) {
+        if (std::isfinite(m_reach[i])) {
+            bounded.push_back(i);
+        } else {
+            m_unbounded.push_back(i);
+        }
+    }
+
+    if (bounded.empty()) {
+        return;
+    }
+
+    m_nodes.reserve(bounded.size() * 2 - 1);
+    build_r(lights, bounded.data(), bounded.data() + bounded.size());
+}
+
+void light_tree_t::query(const qvec3f &origin, float radius, std::vector<uint32_t> &result) const
+{
+    result = m_unbounded;
+
+    if (m_nodes.empty()) {
+        return;
+    }
+
+    // the sphere can only touch a node's lights if it touches the node's bounds
+    auto touches = [&](const aabb3f &bounds) {
+        float dist_squared = 0;
+
+        for (int i = 0; i < 3; i++) {
+            const float d = std::max({bounds.mins()[i] - origin[i], 0.0f, origin[i] - bounds.maxs()[i]});
+            dist_squared += d * d;
+        }
+
+        return dist_squared <= radius * radius;
+    };
+
+    uint32_t stack[64];
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size) {
+        const node_t &node = m_nodes[stack[--stack_size]];
+
+        if (!touches(node.bounds)) {
+            continue;
+        }
+
+        if (node.light >= 0) {
+            // the box is only a bound of the light's sphere, so finish with
+            // the same test as CullLight()
+            if (qv::length(node.origin - origin) - radius < node.reach) {
+                result.push_back(node.light);
+            }
+        } else {
+            stack[stack_size++] = node.children[1];
+            stack[stack_size++] = node.children[0];
+        }
+    }
+
+    std::sort(result.begin(), result.end());
+}
+
 /*
  * =============
  * DuplicateEntity
@@ -1235,6 +1413,7 @@ void SetupLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp)
     SetupSpotlights(bsp, cfg);
     SetupSuns(cfg);
     SetupSkyDomes(cfg);
+    GroupSunsByDirection();
     FixLightsOnFaces(bsp);
     if (light_options.visapprox.value() == visapprox_t::RAYS) {
         EstimateLightVisibility();
@@ -1242,7 +1421,14 @@ void SetupLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp)
         SetupLightLeafnums(bsp);
     }
 
-    logging::print("Final count: {} lights, {} suns in use.\n", all_lights.size(), all_suns.size());
+    std::vector<float> reach(all_lights.size());
+    for (size_t i = 0; i < all_lights.size(); i++) {
+        reach[i] = GetLightReach(cfg, all_lights[i].get());
+    }
+    lights_tree.build(all_lights, std::move(reach));
+
+    logging::print("Final count: {} lights, {} suns in use ({} directions).\n", all_lights.size(), all_suns.size(),
+        sun_direction_groups.size());
 
     Q_assert(final_lightcount == all_lights.size());
 }
@@ -38,6 +38,7 @@
 #include <common/fs.hh>
 #include <common/imglib.hh>
 #include <common/parallel.hh>
+#include <common/pipeline.hh>
 #include <common/ostream.hh>
 
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
@@ -49,6 +50,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_set>
 #include <algorithm>
 #include <mutex>
 #include <string>
@@ -64,6 +66,8 @@ static std::span<lightsurf_t> light_surfaces_span;
 
 // light_surfaces filtered down to just the emissive ones
 static std::vector<lightsurf_t *> emissive_light_surfaces;
+// BVH over emissive_light_surfaces
+static surflight_tree_t emissive_light_tree;
 
 std::span<lightsurf_t> &LightSurfaces()
 {
@@ -75,6 +79,11 @@ std::vector<lightsurf_t *> &EmissiveLightSurfaces()
     return emissive_light_surfaces;
 }
 
+const surflight_tree_t &EmissiveLightSurfacesTree()
+{
+    return emissive_light_tree;
+}
+
 static void UpdateEmissiveLightSurfacesList()
 {
     emissive_light_surfaces.clear();
@@ -84,6 +93,8 @@ static void UpdateEmissiveLightSurfacesList()
             emissive_light_surfaces.push_back(&surf_ptr);
         }
     }
+
+    emissive_light_tree.build(emissive_light_surfaces);
 }
 
 std::vector<facesup_t> faces_sup; // lit2/bspx stuff
@@ -101,6 +112,58 @@ const std::unordered_map<int, std::vector<uint8_t>> &UncompressedVis()
     return all_uncompressed_vis;
 }
 
+// leaves containing each face, in CSR form: the leaves of face f are
+// face_leaves[face_leaf_offsets[f]] to face_leaves[face_leaf_offsets[f + 1]]
+static std::vector<uint32_t> face_leaf_offsets;
+static std::vector<const mleaf_t *> face_leaves;
+
+std::span<const mleaf_t *const> LeavesForFace(int facenum)
+{
+    if (facenum < 0 || facenum + 1 >= face_leaf_offsets.size()) {
+        return {};
+    }
+
+    return std::span(face_leaves).subspan(
+        face_leaf_offsets[facenum], face_leaf_offsets[facenum + 1] - face_leaf_offsets[facenum]);
+}
+
+/*
+ * Inverts the leaf -> marksurfaces lists. Each face lists its leaves in
+ * dleafs order.
+ */
+void BuildFaceLeaves(const mbsp_t *bsp)
+{
+    face_leaf_offsets.assign(bsp->dfaces.size() + 1, 0);
+
+    for (auto &leaf : bsp->dleafs) {
+        for (uint32_t k = 0; k < leaf.nummarksurfaces; k++) {
+            const uint32_t facenum = bsp->dleaffaces[leaf.firstmarksurface + k];
+
+            if (facenum < bsp->dfaces.size()) {
+                face_leaf_offsets[facenum + 1]++;
+            }
+        }
+    }
+
+    for (size_t i = 1; i < face_leaf_offsets.size(); i++) {
+        face_leaf_offsets[i] += face_leaf_offsets[i - 1];
+    }
+
+    face_leaves.resize(face_leaf_offsets.back());
+
+    std::vector<uint32_t> next(face_leaf_offsets.begin(), face_leaf_offsets.end() - 1);
+
+    for (auto &leaf : bsp->dleafs) {
+        for (uint32_t k = 0; k < leaf.nummarksurfaces; k++) {
+            const uint32_t facenum = bsp->dleaffaces[leaf.firstmarksurface + k];
+
+            if (facenum < bsp->dfaces.size()) {
+                face_leaves[next[facenum]++] = &leaf;
+            }
+        }
+    }
+}
+
 std::vector<modelinfo_t *> modelinfo;
 std::vector<const modelinfo_t *> tracelist;
 std::vector<const modelinfo_t *> selfshadowlist;
@@ -192,6 +255,7 @@ worldspawn_keys::worldspawn_keys()
       bouncescale{this, "bouncescale", 1.0, 0.0, 100.0, &worldspawn_group},
       bouncecolorscale{this, "bouncecolorscale", 0.0, 0.0, 1.0, &worldspawn_group},
       bouncelightsubdivision{this, "bouncelightsubdivision", 64.0, 1.0, 8192.0, &worldspawn_group},
+      bounceadaptiveintensity{this, "bounceadaptiveintensity", 64.0, 1.0, 65536.0, &worldspawn_group},
       surflightscale{this, "surflightscale", 1.0, &worldspawn_group},
       surflightskyscale{this, "surflightskyscale", 1.0, &worldspawn_group},
       surflightskydist{this, "surflightskydist", 0.0, &worldspawn_group},
@@ -299,8 +363,12 @@ light_settings::light_settings()
       debugvert{this, "debugvert", std::numeric_limits<float>::quiet_NaN(), std::numeric_limits<float>::quiet_NaN(),
           std::numeric_limits<float>::quiet_NaN(), &debug_group, ""},
       highlightseams{this, "highlightseams", false, &debug_group, ""},
+      nosungroups{this, "nosungroups", false, &debug_group,
+          "trace every sun on its own, even when other suns share its direction"},
       soft{this, "soft", 0, -1, std::numeric_limits<int32_t>::max(), &postprocessing_group,
           "blurs the lightmap. specify n to blur radius in samples, otherwise auto"},
+      denoise{this, "denoise", 0, 0, 8, settings::can_omit_argument_tag(), 3, &postprocessing_group,
+          "edge-aware filtering of bounce, surface light and sky dome lighting. specify n for the number of passes"},
       radlights{this, "radlights", "\"filename.rad\"", &experimental_group,
           "loads a <surfacename> <r> <g> <b> <intensity> file"},
       lightmap_scale{
@@ -308,9 +376,12 @@ light_settings::light_settings()
       extra{
           this, {"extra", "extra4"}, 1, &performance_group, "supersampling; 2x2 (extra) or 4x4 (extra4) respectively"},
       emissivequality{this, "emissivequality", emissivequality_t::LOW,
-          {{"LOW", emissivequality_t::LOW}, {"MEDIUM", emissivequality_t::MEDIUM}, {"HIGH", emissivequality_t::HIGH}},
+          {{"LOW", emissivequality_t::LOW}, {"MEDIUM", emissivequality_t::MEDIUM}, {"HIGH", emissivequality_t::HIGH},
+              {"ADAPTIVE", emissivequality_t::ADAPTIVE}},
           &performance_group,
-          "low = one point in the center of the face, med = center + all verts, high = spread points out for antialiasing"},
+          "low = one point in the center of the face, med = center + all verts, high = spread points out for antialiasing, adaptive = high, but bounce lights get points by brightness and stop tracing once converged"},
+      skyvis{this, "skyvis", 1, 1, 16, settings::can_omit_argument_tag(), 4, &performance_group,
+          "trace sky dome visibility every n samples, tracing the samples in between only near shadow edges"},
       visapprox{this, "visapprox", visapprox_t::AUTO,
           {{"auto", visapprox_t::AUTO}, {"none", visapprox_t::NONE}, {"vis", visapprox_t::VIS},
               {"rays", visapprox_t::RAYS}},
@@ -454,7 +525,13 @@ light_settings::light_settings()
           &debug_group, "save mottle pattern to lightmap"},
 
       debug_lightgrid_octree{
-          this, "debug_lightgrid_octree", false, &debug_group, "write .octree.prt file for light grid"}
+          this, "debug_lightgrid_octree", false, &debug_group, "write .octree.prt file for light grid"},
+      debug_lightgrid_dense{this, "debug_lightgrid_dense", false, &debug_group,
+          "test every light grid point, without skipping solid regions or reusing the nudged points"},
+      debug_surflight_linear{this, "debug_surflight_linear", false, &debug_group,
+          "test every surface light against every face, without culling with the surface light tree"},
+      debug_single_rays{this, "debug_single_rays", false, &debug_group,
+          "trace rays one at a time instead of in packets"}
 {
 }
 
@@ -686,11 +763,32 @@ static void CreateLightmapSurfaces(mbsp_t *bsp)
     });
 }
 
+/*
+ * Once the lightsurfs have their PVS, the decompressed vis is only needed for the rows
+ * they point at directly (see InternLightsurfPvs); the rest is freed. The kept rows stay
+ * at the same address, since the map's nodes don't move.
+ */
+static void KeepLightsurfVisRows()
+{
+    std::unordered_set<const std::vector<uint8_t> *> used;
+
+    for (auto &surf : light_surfaces_span) {
+        if (surf.pvs) {
+            used.insert(surf.pvs);
+        }
+    }
+
+    std::erase_if(all_uncompressed_vis, [&used](const auto &row) { return !used.contains(&row.second); });
+}
+
 static void ClearLightmapSurfaces()
 {
     logging::funcheader();
     light_surfaces.reset();
     light_surfaces_span = {};
+    emissive_light_surfaces.clear();
+    emissive_light_tree.clear();
+    ClearLightsurfPvsPool();
 }
 
 static void FindModelInfo(const mbsp_t *bsp)
@@ -832,6 +930,7 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
 
     // create lightmap surfaces
     CreateLightmapSurfaces(&bsp);
+    KeepLightsurfVisRows();
 
     const bool bouncerequired =
         light_options.bounce.value() &&
@@ -841,15 +940,17 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
     MakeRadiositySurfaceLights(light_options, &bsp);
     UpdateEmissiveLightSurfacesList();
 
-    logging::header("Direct Lighting"); // mxd
-    logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
-        if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
+    {
+        logging::header_scope stage("Direct Lighting"); // mxd
+        logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
+            if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
-            _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+                _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
-            DirectLightFace(&bsp, light_surfaces[i], light_options);
-        }
-    });
+                DirectLightFace(&bsp, light_surfaces[i], light_options);
+            }
+        });
+    }
 
     if (bouncerequired && !light_options.nolighting.value()) {
 
@@ -861,7 +962,7 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
             }
             UpdateEmissiveLightSurfacesList();
 
-            logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+            logging::header_scope stage(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
 
             logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [i, &bsp](size_t f) {
                 if (Face_IsLightmapped(&bsp, &bsp.dfaces[f])) {
@@ -876,7 +977,7 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
     }
 
     if (!light_options.nolighting.value()) {
-        logging::header("Post-Processing"); // mxd
+        logging::header_scope stage("Post-Processing"); // mxd
         logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
             if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
@@ -888,6 +989,13 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
         });
     }
 
+    // the shared lightsurf PVS rows are only needed to light faces
+    for (auto &surf : light_surfaces_span) {
+        surf.pvs = nullptr;
+    }
+    ClearLightsurfPvsPool();
+    all_uncompressed_vis.clear();
+
     SaveLightmapSurfaces(bspdata, source);
 
     // kill this stuff if its somehow found.
@@ -1216,6 +1324,8 @@ static void ResetLight()
     facesup_decoupled_global.clear();
 
     all_uncompressed_vis.clear();
+    face_leaf_offsets.clear();
+    face_leaves.clear();
     modelinfo.clear();
     tracelist.clear();
     selfshadowlist.clear();
@@ -1275,7 +1385,18 @@ int light_main(int argc, const char **argv)
     ParseLightsFile(source); // map-specific file name
 
     source.replace_extension("bsp");
-    LoadBSPFile(source, &bspdata);
+
+    // qbsp/vis may have just handed it to us
+    if (auto handoff = pipeline::take_bsp(source)) {
+        bspdata = std::move(*handoff);
+
+        // -litonly leaves the .bsp alone, so it's written as it was handed to us
+        if (light_options.litonly.value()) {
+            WriteBSPFile(source, &bspdata);
+        }
+    } else {
+        LoadBSPFile(source, &bspdata);
+    }
 
     bspdata.version->game->init_filesystem(source, light_options);
 
@@ -1333,6 +1454,7 @@ int light_main(int argc, const char **argv)
     light_options.print_summary();
 
     all_uncompressed_vis = DecompressAllVis(&bsp, true);
+    BuildFaceLeaves(&bsp);
     FindModelInfo(&bsp);
 
     FindDebugFace(&bsp);
@@ -1387,7 +1509,7 @@ int light_main(int argc, const char **argv)
     /* Convert data format back if necessary */
     ConvertBSPFormat(&bspdata, bspdata.loadversion);
 
-    if (!light_options.litonly.value()) {
+    if (!light_options.litonly.value() && !pipeline::give_bsp(bspdata)) {
         WriteBSPFile(source, &bspdata);
     }
 
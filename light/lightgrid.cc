@@ -26,6 +26,9 @@
 #include <algorithm>
 #include <string>
 #include <utility>
+#include <atomic>
+#include <mutex>
+#include <optional>
 
 #include <light/light.hh>
 #include <light/entities.hh>
@@ -66,15 +69,189 @@ struct lightgrid_raw_data
     qvec3f grid_dist;
     qvec3f grid_mins;
     qvec3i grid_size;
-    std::vector<lightgrid_samples_t> grid_result;
+    // 1 for each grid point that's in solid (after nudging), 0 otherwise
+    std::vector<uint8_t> occlusion;
+    // grid index and position of each point FixLightOnFace nudged out of solid,
+    // sorted by index; the rest are sampled where they are
+    std::vector<std::pair<int, qvec3f>> nudged_points;
     uint8_t num_styles;
 
     int get_grid_index(int x, int y, int z) const { return (grid_size[0] * grid_size[1] * z) + (grid_size[0] * y) + x; }
 
     qvec3f grid_index_to_world(const qvec3i &index) const { return grid_mins + (index * grid_dist); }
+
+    size_t num_points() const { return static_cast<size_t>(grid_size[0]) * grid_size[1] * grid_size[2]; }
+
+    // where the unoccluded point at `index` is sampled
+    qvec3f sample_point(const qvec3i &grid_index, int index) const
+    {
+        auto it = std::lower_bound(nudged_points.begin(), nudged_points.end(), index,
+            [](const std::pair<int, qvec3f> &nudged, int i) { return nudged.first < i; });
+
+        if (it != nudged_points.end() && it->first == index) {
+            return it->second;
+        }
+
+        return grid_index_to_world(grid_index);
+    }
+};
+
+struct lightgrid_octree_node
+{
+    qvec3i division_point;
+    std::array<uint32_t, 8> children;
+};
+
+struct lightgrid_octree_leaf
+{
+    qvec3i mins, size;
+    // size[0] * size[1] * size[2] samples, x fastest
+    std::vector<lightgrid_samples_t> samples;
+};
+
+struct lightgrid_octree
+{
+    uint32_t root_node;
+    std::vector<lightgrid_octree_node> nodes;
+    std::vector<lightgrid_octree_leaf> leafs;
 };
 
-static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_raw_data &data, lightgrid_format_t format)
+/*
+ * Returns true if every point in `bounds` is in solid, as Light_PointInWorld decides it
+ * (points within 0.1 units of a plane are solid if either side is). Conservative; may
+ * return false for boxes that are in fact solid.
+ */
+static bool Light_BoundsInSolid_r(const mbsp_t *bsp, const int nodenum, const aabb3d &bounds)
+{
+    if (nodenum < 0) {
+        const mleaf_t *leaf = BSP_GetLeafFromNodeNum(bsp, nodenum);
+        const contentflags_t &contentflags = extended_content_flags[BSP_GetLeafNum(bsp, leaf)];
+
+        return !!(contentflags.flags & (EWT_VISCONTENTS_SOLID | EWT_VISCONTENTS_DETAIL_WALL | EWT_VISCONTENTS_SKY));
+    }
+
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+    const dplane_t &plane = bsp->dplanes[node->planenum];
+
+    const qvec3d center = bounds.centroid();
+    const qvec3d extents = bounds.maxs() - center;
+    const double center_dist = plane.distance_to_fast(center);
+    const double radius = qv::dot(qv::abs(qvec3d(plane.normal)), extents);
+    const double dmin = center_dist - radius, dmax = center_dist + radius;
+
+    if (dmin > 0.1)
+        return Light_BoundsInSolid_r(bsp, node->children[0], bounds);
+    if (dmax < -0.1)
+        return Light_BoundsInSolid_r(bsp, node->children[1], bounds);
+
+    // points near the plane are solid if either side is; points clearly on
+    // one side need that side to be solid
+    const bool front_solid = Light_BoundsInSolid_r(bsp, node->children[0], bounds);
+    if (front_solid && dmin >= -0.1)
+        return true;
+
+    const bool back_solid = Light_BoundsInSolid_r(bsp, node->children[1], bounds);
+    if (back_solid && dmax <= 0.1)
+        return true;
+
+    return front_solid && back_solid;
+}
+
+/*
+ * Returns where the light grid samples `world_point`: the point itself, or
+ * the point nudged out of solid by FixLightOnFace, or nullopt if it's occluded.
+ */
+static std::optional<qvec3f> FixLightgridPoint(const mbsp_t *bsp, const qvec3f &world_point)
+{
+    if (!Light_PointInWorld(bsp, extended_content_flags, world_point)) {
+        return world_point;
+    }
+
+    // search for a nearby point
+    auto [fixed_pos, success] = FixLightOnFace(bsp, world_point, false, 2.0f);
+    if (success) {
+        return fixed_pos;
+    }
+
+    return std::nullopt;
+}
+
+/*
+ * Fills data.occlusion and data.nudged_points, a brick of grid points at a time.
+ * Bricks that are wholly in solid according to the BSP (including the distance
+ * FixLightOnFace may nudge points by) are marked occluded without testing each
+ * point, unless -debug_lightgrid_dense is set.
+ */
+static void CalcLightgridOcclusion(const mbsp_t &bsp, lightgrid_raw_data &data)
+{
+    constexpr int BRICK_SIZE = 8;
+    // FixLightgridPoint nudges points by up to this much, plus some slack for float rounding
+    constexpr float NUDGE_DIST = 2.0f + 0.01f;
+
+    data.occlusion.assign(data.num_points(), 0);
+    data.nudged_points.clear();
+
+    std::mutex nudged_points_mutex;
+
+    const qvec3i bricks = (data.grid_size + qvec3i(BRICK_SIZE - 1)) / BRICK_SIZE;
+
+    std::atomic<size_t> solid_points = 0;
+
+    logging::parallel_for(0, bricks[0] * bricks[1] * bricks[2], [&](int brick_index) {
+        const qvec3i brick{brick_index % bricks[0], (brick_index / bricks[0]) % bricks[1],
+            brick_index / (bricks[0] * bricks[1])};
+        const qvec3i mins = brick * BRICK_SIZE;
+        const qvec3i maxs = qv::min(mins + qvec3i(BRICK_SIZE), data.grid_size) - qvec3i(1);
+
+        const aabb3d bounds =
+            aabb3d(data.grid_index_to_world(mins), data.grid_index_to_world(maxs)).grow(qvec3d(NUDGE_DIST));
+        const bool solid = !light_options.debug_lightgrid_dense.value() &&
+                           Light_BoundsInSolid_r(&bsp, bsp.dmodels[0].headnode[0], bounds);
+
+        std::vector<std::pair<int, qvec3f>> nudged;
+
+        for (int z = mins[2]; z <= maxs[2]; ++z) {
+            for (int y = mins[1]; y <= maxs[1]; ++y) {
+                for (int x = mins[0]; x <= maxs[0]; ++x) {
+                    const int index = data.get_grid_index(x, y, z);
+                    std::optional<qvec3f> sample_point;
+
+                    if (!solid) {
+                        const qvec3f world_point = data.grid_index_to_world({x, y, z});
+                        sample_point = FixLightgridPoint(&bsp, world_point);
+
+                        if (sample_point && *sample_point != world_point) {
+                            nudged.emplace_back(index, *sample_point);
+                        }
+                    }
+
+                    data.occlusion[index] = !sample_point.has_value();
+                }
+            }
+        }
+
+        if (!nudged.empty()) {
+            std::unique_lock lock(nudged_points_mutex);
+            data.nudged_points.insert(data.nudged_points.end(), nudged.begin(), nudged.end());
+        }
+
+        if (solid) {
+            const qvec3i size = maxs - mins + qvec3i(1);
+            solid_points += size[0] * size[1] * size[2];
+        }
+    });
+
+    std::sort(data.nudged_points.begin(), data.nudged_points.end(),
+        [](const auto &a, const auto &b) { return a.first < b.first; });
+
+    logging::print("     {} of {} grid points skipped as solid\n", solid_points.load(), data.num_points());
+}
+
+/*
+ * Builds the octree top-down from the occlusion data, then samples the lighting
+ * only at the unoccluded points of its leafs.
+ */
+static lightgrid_octree BuildLightgridOctree(const mbsp_t &bsp, const lightgrid_raw_data &data)
 {
     using lightgrid::child_index;
     using lightgrid::get_octant;
@@ -102,7 +279,7 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
             for (int y = mins[1]; y < (mins[1] + size[1]); ++y) {
                 for (int x = mins[0]; x < (mins[0] + size[0]); ++x) {
                     int sample_index = data.get_grid_index(x, y, z);
-                    if (data.grid_result[sample_index].occluded) {
+                    if (data.occlusion[sample_index]) {
                         std::get<0>(occluded_unoccluded)++;
                     } else {
                         std::get<1>(occluded_unoccluded)++;
@@ -117,19 +294,9 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
     // if any axis is fewer than this many grid points, don't bother subdividing further, just create a leaf
     constexpr int MIN_NODE_DIMENSION = 4;
 
-    struct octree_node
-    {
-        qvec3i division_point;
-        std::array<uint32_t, 8> children;
-    };
-
-    struct octree_leaf
-    {
-        qvec3i mins, size;
-    };
-
-    std::vector<octree_node> octree_nodes;
-    std::vector<octree_leaf> octree_leafs;
+    lightgrid_octree octree;
+    auto &octree_nodes = octree.nodes;
+    auto &octree_leafs = octree.leafs;
 
     int occluded_cells = 0;
 
@@ -191,7 +358,34 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
     };
 
     // build the root node
-    const uint32_t root_node = build_octree(qvec3i{0, 0, 0}, data.grid_size, 0);
+    octree.root_node = build_octree(qvec3i{0, 0, 0}, data.grid_size, 0);
+
+    // sample the lighting; only leafs are stored, so that's the only place it's needed
+    logging::parallel_for(static_cast<size_t>(0), octree_leafs.size(), [&](size_t leafnum) {
+        auto &leaf = octree_leafs[leafnum];
+        auto &cm = leaf.mins;
+        auto &cs = leaf.size;
+
+        leaf.samples.resize(cs[0] * cs[1] * cs[2]);
+
+        size_t i = 0;
+        for (int z = cm[2]; z < (cm[2] + cs[2]); ++z) {
+            for (int y = cm[1]; y < (cm[1] + cs[1]); ++y) {
+                for (int x = cm[0]; x < (cm[0] + cs[0]); ++x, ++i) {
+                    const int index = data.get_grid_index(x, y, z);
+
+                    if (light_options.debug_lightgrid_dense.value()) {
+                        // place the point from scratch
+                        leaf.samples[i] = FixPointAndCalcLightgrid(&bsp, data.grid_index_to_world({x, y, z}));
+                    } else if (data.occlusion[index]) {
+                        leaf.samples[i].occluded = true;
+                    } else {
+                        leaf.samples[i] = CalcLightgridAtPoint(&bsp, data.sample_point({x, y, z}, index));
+                    }
+                }
+            }
+        }
+    });
 
     // visualize the leafs
     if (light_options.debug_lightgrid_octree.value()) {
@@ -218,14 +412,14 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
         stored_cells += leaf.size[0] * leaf.size[1] * leaf.size[2];
     }
     logging::print("octree stored {} grid nodes + {} occluded = {} total, full stored {} (octree is {} percent)\n",
-        stored_cells, occluded_cells, stored_cells + occluded_cells, data.grid_result.size(),
-        100.0f * stored_cells / (float)data.grid_result.size());
+        stored_cells, occluded_cells, stored_cells + occluded_cells, data.num_points(),
+        100.0f * stored_cells / (float)data.num_points());
 
-    logging::print("octree nodes size: {} bytes ({} * {})\n", octree_nodes.size() * sizeof(octree_node),
-        octree_nodes.size(), sizeof(octree_node));
+    logging::print("octree nodes size: {} bytes ({} * {})\n", octree_nodes.size() * sizeof(lightgrid_octree_node),
+        octree_nodes.size(), sizeof(lightgrid_octree_node));
 
-    logging::print(
-        "octree leafs {} overhead {} bytes\n", octree_leafs.size(), octree_leafs.size() * sizeof(octree_leaf));
+    logging::print("octree leafs {} overhead {} bytes\n", octree_leafs.size(),
+        octree_leafs.size() * (sizeof(qvec3i) * 2));
 
     // lookup function
     std::function<std::tuple<lightgrid_samples_t, bool>(uint32_t, qvec3i)> octree_lookup_r;
@@ -234,9 +428,10 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
             return {lightgrid_samples_t{}, true};
         }
         if (node_index & lightgrid::FLAG_LEAF) {
-            // in actuality, we'd pull the data from a 3D grid stored in the leaf.
-            int i = data.get_grid_index(test_point[0], test_point[1], test_point[2]);
-            return {data.grid_result[i], data.grid_result[i].occluded};
+            auto &leaf = octree_leafs[node_index & ~lightgrid::FLAGS];
+            qvec3i local = test_point - leaf.mins;
+            auto &sample = leaf.samples[(leaf.size[0] * leaf.size[1] * local[2]) + (leaf.size[0] * local[1]) + local[0]];
+            return {sample, sample.occluded};
         }
         auto &node = octree_nodes[node_index];
         int i = child_index(node.division_point, test_point); // [0..7]
@@ -248,22 +443,23 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
     for (int z = 0; z < data.grid_size[2]; ++z) {
         for (int y = 0; y < data.grid_size[1]; ++y) {
             for (int x = 0; x < data.grid_size[0]; ++x) {
-                auto [color, occluded] = octree_lookup_r(root_node, {x, y, z});
+                auto [color, occluded] = octree_lookup_r(octree.root_node, {x, y, z});
 
                 int sample_index = data.get_grid_index(x, y, z);
 
                 // compare against original data
-                if (occluded) {
-                    Q_assert(data.occlusion[sample_index]);
-                } else {
-                    Q_assert(!data.occlusion[sample_index]);
-                    Q_assert(data.grid_result[sample_index] == color);
-                }
+                Q_assert(occluded == !!data.occlusion[sample_index]);
             }
         }
     }
 #endif
 
+    return octree;
+}
+
+static std::vector<uint8_t> MakeOctreeLump(
+    const lightgrid_raw_data &data, const lightgrid_octree &octree, lightgrid_format_t format)
+{
     // pack into the output data structures
     lightgrid_header_t header;
     header.grid_dist = data.grid_dist;
@@ -271,11 +467,11 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
     header.grid_mins = data.grid_mins;
     header.num_styles = data.num_styles;
 
-    header.root_node = root_node;
+    header.root_node = octree.root_node;
 
     // the nodes (fixed-size)
     std::vector<lightgrid_node_t> nodes;
-    for (const auto &node : octree_nodes) {
+    for (const auto &node : octree.nodes) {
         lightgrid_node_t &node_out = nodes.emplace_back();
 
         node_out.division_point = node.division_point;
@@ -288,23 +484,14 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
         result.nodes = nodes;
 
         // the leafs (each is variable sized)
-        for (const auto &leaf : octree_leafs) {
+        for (const auto &leaf : octree.leafs) {
             lightgrid_leaf_t &leaf_out = result.leafs.emplace_back();
 
             leaf_out.mins = leaf.mins;
             leaf_out.size = leaf.size;
 
-            auto &cm = leaf.mins;
-            auto &cs = leaf.size;
-
-            for (int z = cm[2]; z < (cm[2] + cs[2]); ++z) {
-                for (int y = cm[1]; y < (cm[1] + cs[1]); ++y) {
-                    for (int x = cm[0]; x < (cm[0] + cs[0]); ++x) {
-                        int sample_index = data.get_grid_index(x, y, z);
-
-                        leaf_out.samples.push_back(data.grid_result[sample_index].to_bspx_lightgrid_samples());
-                    }
-                }
+            for (const auto &sample : leaf.samples) {
+                leaf_out.samples.push_back(sample.to_bspx_lightgrid_samples());
             }
         }
 
@@ -321,23 +508,14 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
         result.nodes = nodes;
 
         // the leafs (each is variable sized)
-        for (const auto &leaf : octree_leafs) {
+        for (const auto &leaf : octree.leafs) {
             lightgrids_leaf_t &leaf_out = result.leafs.emplace_back();
 
             leaf_out.mins = leaf.mins;
             leaf_out.size = leaf.size;
 
-            auto &cm = leaf.mins;
-            auto &cs = leaf.size;
-
-            for (int z = cm[2]; z < (cm[2] + cs[2]); ++z) {
-                for (int y = cm[1]; y < (cm[1] + cs[1]); ++y) {
-                    for (int x = cm[0]; x < (cm[0] + cs[0]); ++x) {
-                        int sample_index = data.get_grid_index(x, y, z);
-
-                        leaf_out.samples.push_back(data.grid_result[sample_index].to_lightgrids_sampleset_t());
-                    }
-                }
+            for (const auto &sample : leaf.samples) {
+                leaf_out.samples.push_back(sample.to_lightgrids_sampleset_t());
             }
         }
 
@@ -355,20 +533,10 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
 
 lightgrid_samples_t FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3f world_point)
 {
-    bool occluded = Light_PointInWorld(bsp, extended_content_flags, world_point);
-    if (occluded) {
-        // search for a nearby point
-        auto [fixed_pos, success] = FixLightOnFace(bsp, world_point, false, 2.0f);
-        if (success) {
-            occluded = false;
-            world_point = fixed_pos;
-        }
-    }
-
     lightgrid_samples_t samples;
 
-    if (!occluded)
-        samples = CalcLightgridAtPoint(bsp, world_point);
+    if (auto sample_point = FixLightgridPoint(bsp, world_point))
+        samples = CalcLightgridAtPoint(bsp, *sample_point);
     else
         samples.occluded = true;
 
@@ -397,27 +565,17 @@ void LightGrid(bspdata_t *bspdata)
     data.grid_size = {ceil(world_size[0] / data.grid_dist[0]), ceil(world_size[1] / data.grid_dist[1]),
         ceil(world_size[2] / data.grid_dist[2])};
 
-    data.grid_result.resize(data.grid_size[0] * data.grid_size[1] * data.grid_size[2]);
-
-    logging::parallel_for(0, data.grid_size[0] * data.grid_size[1] * data.grid_size[2], [&](int sample_index) {
-        const int z = (sample_index / (data.grid_size[0] * data.grid_size[1]));
-        const int y = (sample_index / data.grid_size[0]) % data.grid_size[1];
-        const int x = sample_index % data.grid_size[0];
+    CalcLightgridOcclusion(bsp, data);
 
-        qvec3f world_point = data.grid_mins + (qvec3f{x, y, z} * data.grid_dist);
-
-        lightgrid_samples_t samples;
-
-        samples = FixPointAndCalcLightgrid(&bsp, world_point);
-
-        data.grid_result[sample_index] = samples;
-    });
+    const lightgrid_octree octree = BuildLightgridOctree(bsp, data);
 
     // the maximum used styles across the map.
     data.num_styles = [&]() {
         int result = 0;
-        for (auto &samples : data.grid_result) {
-            result = std::max(result, samples.used_styles());
+        for (auto &leaf : octree.leafs) {
+            for (auto &samples : leaf.samples) {
+                result = std::max(result, samples.used_styles());
+            }
         }
         return result;
     }();
@@ -430,8 +588,8 @@ void LightGrid(bspdata_t *bspdata)
 
     // octree lump
     if (light_options.lightgrid_format.value() == lightgrid_format_t::OCTREE) {
-        bspdata->bspx.transfer("LIGHTGRID_OCTREE", MakeOctreeLump(bsp, data, lightgrid_format_t::OCTREE));
+        bspdata->bspx.transfer("LIGHTGRID_OCTREE", MakeOctreeLump(data, octree, lightgrid_format_t::OCTREE));
     } else if (light_options.lightgrid_format.value() == lightgrid_format_t::LIGHTGRIDS) {
-        bspdata->bspx.transfer("LIGHTGRIDS", MakeOctreeLump(bsp, data, lightgrid_format_t::LIGHTGRIDS));
+        bspdata->bspx.transfer("LIGHTGRIDS", MakeOctreeLump(data, octree, lightgrid_format_t::LIGHTGRIDS));
     }
 }
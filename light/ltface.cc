@@ -37,9 +37,12 @@
 
 #include <atomic>
 #include <cassert>
+#include <map>
+#include <mutex>
 #include <cmath>
 #include <algorithm>
 #include <fstream>
+#include <numeric>
 
 #if 0
 std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
@@ -461,46 +464,88 @@ static void CalcPoints(
     }
 }
 
-static bool Mod_LeafPvs(const mbsp_t *bsp, const mleaf_t *leaf, uint8_t *out)
+static const std::vector<uint8_t> *Mod_LeafPvs(
+    const mbsp_t *bsp, const std::unordered_map<int, std::vector<uint8_t>> &vis, const mleaf_t *leaf)
 {
-    const size_t num_pvsclusterbytes = DecompressedVisSize(bsp);
+    if (bsp->loadversion->game->create_contents_from_native(leaf->contents).is_liquid()) {
+        // the liquid case is because leaf->contents might be in an opaque liquid,
+        // which we typically want light to pass through, but visdata would report that
+        // there's no visibility across the opaque liquid. so, skip culling and do the raytracing.
+        return nullptr;
+    }
 
-    // init to all visible
-    memset(out, 0xFF, num_pvsclusterbytes);
+    const int key = (bsp->loadversion->game->has_cluster_support) ? leaf->cluster : leaf->visofs;
+    if (auto it = vis.find(key); it != vis.end()) {
+        return &it->second;
+    }
+    return nullptr;
+}
 
-    if (bsp->loadversion->game->has_cluster_support) {
-        auto it = UncompressedVis().find(leaf->cluster);
-        if (it == UncompressedVis().end()) {
-            return false;
-        }
+/*
+ * Lightsurf PVS rows, interned by the set of vis rows ORed together to make
+ * them. A surface whose leaves share one vis row points at that row of
+ * UncompressedVis() instead.
+ */
+using pvs_rows_t = std::vector<const std::vector<uint8_t> *>;
 
-        memcpy(out, it->second.data(), num_pvsclusterbytes);
-    } else {
-        auto it = UncompressedVis().find(leaf->visofs);
-        if (it == UncompressedVis().end()) {
-            return false;
+static std::mutex lightsurf_pvs_mutex;
+static std::map<pvs_rows_t, std::vector<uint8_t>> lightsurf_pvs_pool;
+
+// `rows` is sorted and unique; a null row stands for "everything visible"
+static const std::vector<uint8_t> *InternLightsurfPvs(const mbsp_t *bsp, pvs_rows_t rows)
+{
+    if (rows.size() == 1 && rows[0]) {
+        return rows[0];
+    }
+
+    // built outside the lock so faces with different rows don't wait on each other;
+    // if another thread interned the same rows first, this copy is dropped
+    std::vector<uint8_t> pvs(DecompressedVisSize(bsp));
+
+    for (const std::vector<uint8_t> *row : rows) {
+        if (!row) {
+            std::fill(pvs.begin(), pvs.end(), 0xff);
+            break;
         }
 
-        memcpy(out, it->second.data(), num_pvsclusterbytes);
+        for (size_t j = 0; j < pvs.size(); j++) {
+            pvs[j] |= (*row)[j];
+        }
     }
 
-    return true;
+    std::unique_lock lock(lightsurf_pvs_mutex);
+    auto it = lightsurf_pvs_pool.try_emplace(std::move(rows), std::move(pvs)).first;
+
+    return &it->second;
 }
 
-static const std::vector<uint8_t> *Mod_LeafPvs(const mbsp_t *bsp, const mleaf_t *leaf)
+void ClearLightsurfPvsPool()
 {
-    if (bsp->loadversion->game->create_contents_from_native(leaf->contents).is_liquid()) {
-        // the liquid case is because leaf->contents might be in an opaque liquid,
-        // which we typically want light to pass through, but visdata would report that
-        // there's no visibility across the opaque liquid. so, skip culling and do the raytracing.
-        return nullptr;
-    }
+    lightsurf_pvs_pool.clear();
+}
 
-    const int key = (bsp->loadversion->game->has_cluster_support) ? leaf->cluster : leaf->visofs;
-    if (auto it = UncompressedVis().find(key); it != UncompressedVis().end()) {
-        return &it->second;
+const std::vector<uint8_t> *LightsurfPvs(const mbsp_t *bsp, const std::unordered_map<int, std::vector<uint8_t>> &vis,
+    std::span<const mleaf_t *const> leaves)
+{
+    pvs_rows_t rows;
+
+    for (auto &leaf : leaves) {
+        /* the leaf's row of the decompressed vis; null for liquid leaves
+           (see Mod_LeafPvs) or leaves without vis, which see everything */
+        const std::vector<uint8_t> *leafpvs = Mod_LeafPvs(bsp, vis, leaf);
+
+        if (!leafpvs) {
+            rows = {nullptr};
+            break;
+        }
+
+        rows.push_back(leafpvs);
     }
-    return nullptr;
+
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+
+    return InternLightsurfPvs(bsp, std::move(rows));
 }
 
 static void CalcPvs(const mbsp_t *bsp, lightsurf_t *lightsurf)
@@ -509,22 +554,10 @@ static void CalcPvs(const mbsp_t *bsp, lightsurf_t *lightsurf)
         return;
     }
 
-    const int pvssize = DecompressedVisSize(bsp);
-
-    // set lightsurf->pvs
-    uint8_t *pointpvs = (uint8_t *)alloca(pvssize);
-    lightsurf->pvs.resize(pvssize);
-
     if (lightsurf->modelinfo->isWorld()) {
-        size_t face_index = lightsurf->face - bsp->dfaces.data();
+        const auto leaves = LeavesForFace(Face_GetNum(bsp, lightsurf->face));
 
-        for (auto &leaf : bsp->dleafs) {
-            for (size_t surf = 0; surf < leaf.nummarksurfaces; surf++) {
-                if (bsp->dleaffaces[leaf.firstmarksurface + surf] == face_index) {
-                    lightsurf->leaves.push_back(&leaf);
-                }
-            }
-        }
+        lightsurf->leaves.assign(leaves.begin(), leaves.end());
     } else {
         for (auto &sample : lightsurf->samples) {
             const mleaf_t *leaf = Light_PointInLeaf(bsp, sample.point);
@@ -535,26 +568,7 @@ static void CalcPvs(const mbsp_t *bsp, lightsurf_t *lightsurf)
         }
     }
 
-    for (auto &leaf : lightsurf->leaves) {
-        /* copy the pvs for this leaf into pointpvs */
-        Mod_LeafPvs(bsp, leaf, pointpvs);
-
-        if (bsp->loadversion->game->create_contents_from_native(leaf->contents).is_liquid()) {
-            // hack for when the sample point might be in an opaque liquid, blocking vis,
-            // but we typically want light to pass through these.
-            // see also VisCullEntity() which handles the case when the light emitter is in liquid.
-            for (int j = 0; j < pvssize; j++) {
-                lightsurf->pvs[j] |= 0xff;
-            }
-            break;
-        }
-
-        /* merge the pvs for this sample point into lightsurf->pvs */
-        for (int j = 0; j < pvssize; j++) {
-            lightsurf->pvs[j] |= pointpvs[j];
-        }
-    }
-
+    lightsurf->pvs = LightsurfPvs(bsp, UncompressedVis(), lightsurf->leaves);
     lightsurf->leaves.shrink_to_fit();
 }
 
@@ -889,6 +903,48 @@ static float GetLightValue(const settings::worldspawn_keys &cfg, const light_t *
         entity->atten.value(), dist, LF_SCALE);
 }
 
+/*
+ * ================
+ * GetLightReach
+ *
+ * Returns the distance at which the light has faded to the gate, so
+ * CullLight() rejects every surface at least that far away, or infinity if
+ * the light never gets there.
+ * ================
+ */
+float GetLightReach(const settings::worldspawn_keys &cfg, const light_t *entity)
+{
+    const auto reaches = [&](float dist) {
+        return fabs(GetLightValue(cfg, entity, dist)) > light_options.gate.value();
+    };
+
+    // light values only fall off with distance, so find the first power of
+    // two the light doesn't reach and bisect below it
+    float lo = 0, hi = 1;
+
+    while (reaches(hi)) {
+        lo = hi;
+        hi *= 2;
+
+        if (hi > 1e9f) {
+            return std::numeric_limits<float>::infinity();
+        }
+    }
+
+    for (int i = 0; i < 24; i++) {
+        const float mid = (lo + hi) * 0.5f;
+
+        if (reaches(mid)) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // plus a unit, since callers measure distance slightly differently
+    return hi + 1.0f;
+}
+
 static float GetLightValueWithAngle(const settings::worldspawn_keys &cfg, const light_t *entity, const qvec3f &surfnorm,
     bool use_surfnorm, const qvec3f &surfpointToLightDir, float dist, bool twosided)
 {
@@ -1173,9 +1229,9 @@ inline bool CullLight(const light_t *entity, const lightsurf_t *lightsurf)
     return fabs(GetLightValue(cfg, entity, dist)) <= light_options.gate.value();
 }
 
-static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, const mleaf_t *entleaf)
+static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> *pvs, const mleaf_t *entleaf)
 {
-    if (pvs.empty()) {
+    if (pvs == nullptr) {
         return false;
     }
     if (entleaf == nullptr) {
@@ -1191,7 +1247,25 @@ static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, co
         return false;
     }
 
-    return !Pvs_LeafVisible(bsp, pvs, entleaf);
+    return !Pvs_LeafVisible(bsp, *pvs, entleaf);
+}
+
+/*
+ * ================
+ * LightsNearSurface
+ *
+ * Indices into GetLights() of the lights that CullLight() might not reject
+ * for this surface, in ascending order. Valid until the next call on the
+ * same thread.
+ * ================
+ */
+static const std::vector<uint32_t> &LightsNearSurface(const lightsurf_t *lightsurf)
+{
+    thread_local static std::vector<uint32_t> result;
+
+    GetLightsTree().query(lightsurf->extents.origin, lightsurf->extents.radius, result);
+
+    return result;
 }
 
 /*
@@ -1365,6 +1439,55 @@ static void LightPoint_Entity(const mbsp_t *bsp, raystream_occlusion_t &rs, cons
     }
 }
 
+/*
+ * =============
+ * SunReachesFace
+ *
+ * False if the face can't receive any light from along `incoming`.
+ * =============
+ */
+static bool SunReachesFace(const lightsurf_t *lightsurf, const qvec3f &incoming)
+{
+    /* Don't bother if surface facing away from sun */
+    const float dp = qv::dot(incoming, lightsurf->plane.normal);
+    if (dp < -LIGHT_ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided) {
+        return false;
+    }
+
+    // check lighting channels (currently sunlight is always on CHANNEL_MASK_DEFAULT)
+    return lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT;
+}
+
+/*
+ * =============
+ * SunLightAtSample
+ *
+ * The light `sun` gives `sample` if the sample sees the sky; `value` is set
+ * to its brightness before the sun's color is applied.
+ * =============
+ */
+static qvec3f SunLightAtSample(const settings::worldspawn_keys &cfg, const sun_t *sun, const qvec3f &incoming,
+    const lightsurf_t *lightsurf, const lightsurf_t::sample_data_t &sample, float &value)
+{
+    float angle = qv::dot(incoming, sample.normal);
+    if (lightsurf->twosided) {
+        if (angle < 0) {
+            angle = -angle;
+        }
+    }
+
+    angle = std::max(0.0f, angle);
+
+    angle = (1.0f - sun->anglescale) + sun->anglescale * angle;
+    value = angle * sun->sunlight;
+
+    if (sun->dirt) {
+        value *= Dirt_GetScaleFactor(cfg, sample.occlusion, NULL, 0.0f, lightsurf);
+    }
+
+    return sun->sunlight_color * (value / 255.0f);
+}
+
 /*
  * =============
  * LightFace_Sky
@@ -1374,21 +1497,13 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
 {
     const settings::worldspawn_keys &cfg = *lightsurf->cfg;
     const modelinfo_t *modelinfo = lightsurf->modelinfo;
-    const qplane3f &plane = lightsurf->plane;
 
     // FIXME: Normalized sun vector should be stored in the sun_t. Also clarify which way the vector points (towards or
     // away..)
     // FIXME: Much of this is copied/pasted from LightFace_Entity, should probably be merged
     qvec3f incoming = qv::normalize(sun->sunvec);
 
-    /* Don't bother if surface facing away from sun */
-    const float dp = qv::dot(incoming, plane.normal);
-    if (dp < -LIGHT_ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided) {
-        return;
-    }
-
-    // check lighting channels (currently sunlight is always on CHANNEL_MASK_DEFAULT)
-    if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
+    if (!SunReachesFace(lightsurf, incoming)) {
         return;
     }
 
@@ -1402,26 +1517,8 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
         if (sample.occluded)
             continue;
 
-        const qvec3f &surfpoint = sample.point;
-        const qvec3f &surfnorm = sample.normal;
-
-        float angle = qv::dot(incoming, surfnorm);
-        if (lightsurf->twosided) {
-            if (angle < 0) {
-                angle = -angle;
-            }
-        }
-
-        angle = std::max(0.0f, angle);
-
-        angle = (1.0f - sun->anglescale) + sun->anglescale * angle;
-        float value = angle * sun->sunlight;
-
-        if (sun->dirt) {
-            value *= Dirt_GetScaleFactor(cfg, sample.occlusion, NULL, 0.0f, lightsurf);
-        }
-
-        qvec3f color = sun->sunlight_color * (value / 255.0f);
+        float value;
+        qvec3f color = SunLightAtSample(cfg, sun, incoming, lightsurf, sample, value);
 
         /* Quick distance check first */
         if (fabs(LightSample_Brightness(color)) <= light_options.gate.value()) {
@@ -1430,7 +1527,7 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
 
         qvec3f normalcontrib = incoming * value;
 
-        rs.pushRay(i, surfpoint, incoming, MAX_SKY_DIST, &color, &normalcontrib);
+        rs.pushRay(i, sample.point, incoming, MAX_SKY_DIST, &color, &normalcontrib);
     }
 
     // We need to check if the first hit face is a sky face, so we need
@@ -1487,6 +1584,195 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
     }
 }
 
+struct sky_hit_t
+{
+    const img::texture *texture = nullptr; // sky face that was hit, or null if no sky was hit
+    int dynamic_style = 0;
+
+    inline bool operator==(const sky_hit_t &other) const
+    {
+        return texture == other.texture && dynamic_style == other.dynamic_style;
+    }
+};
+
+/*
+ * =============
+ * TraceSkyHits
+ *
+ * Traces towards the sky along `incoming` from the samples of `lightsurf`
+ * that are `wanted`, filling `hits` with what each sample sees; with a
+ * `spacing` above 1, through the -skyvis lattice (SkyVis_TraceLattice).
+ * Returns false if no sample sees the sky.
+ * =============
+ */
+static bool TraceSkyHits(const lightsurf_t *lightsurf, const qvec3f &incoming, int spacing,
+    const std::vector<uint8_t> &wanted, std::vector<sky_hit_t> &hits)
+{
+    hits.assign(lightsurf->samples.size(), {});
+
+    raystream_intersection_t &rs = intersection_stream;
+    bool any_sky = false;
+
+    SkyVis_TraceLattice(lightsurf->width, lightsurf->height, spacing, wanted, hits, [&](const std::vector<int> &batch) {
+        rs.clearPushedRays();
+
+        for (int i : batch) {
+            rs.pushRay(i, lightsurf->samples[i].point, incoming, MAX_SKY_DIST);
+        }
+
+        rs.tracePushedRaysIntersection(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
+
+        for (int j = 0; j < rs.numPushedRays(); j++) {
+            if (rs.getPushedRayHitType(j) != hittype_t::SKY) {
+                continue;
+            }
+
+            const ray_io &ray = rs.getRay(j);
+            hits[ray.index] = {rs.getPushedRayHitFaceInfo(j)->texture, ray.dynamic_style};
+            any_sky = true;
+        }
+    });
+
+    return any_sky;
+}
+
+/*
+ * =============
+ * LightFace_Suns
+ *
+ * Lights a face with the suns `use_sun` picks, in GetSuns() order, the same
+ * as calling LightFace_Sky for each. Suns that share a direction (a
+ * GetSunDirectionGroups() group) see the same sky, so when the first of them
+ * is applied the rays are traced once for the samples any of them would
+ * light, and the hits are kept until the last one. With -skyvis, sky domes
+ * are traced hierarchically (TraceSkyHits).
+ * =============
+ */
+template<typename F>
+static void LightFace_Suns(const mbsp_t *bsp, F &&use_sun, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const auto &suns = GetSuns();
+    const auto &groups = GetSunDirectionGroups();
+
+    struct sun_group_state_t
+    {
+        // suns of the group still to apply to this face
+        size_t remaining = 0;
+        bool traced = false;
+        bool any_sky = false;
+        std::vector<sky_hit_t> hits;
+    };
+
+    thread_local static std::vector<sun_group_state_t> states;
+    thread_local static std::vector<uint8_t> wanted;
+    states.resize(groups.size());
+
+    for (const sun_t &sun : suns) {
+        if (use_sun(sun)) {
+            states[sun.direction_group].remaining++;
+        }
+    }
+
+    for (const sun_t &sun : suns) {
+        if (!use_sun(sun)) {
+            continue;
+        }
+
+        sun_group_state_t &state = states[sun.direction_group];
+        const bool hierarchical = light_options.skyvis.value() > 1 && sun.dome;
+
+        if (state.remaining == 1 && !state.traced && !hierarchical) {
+            // nothing to share
+            state.remaining = 0;
+            LightFace_Sky(bsp, &sun, lightsurf, lightmaps);
+            continue;
+        }
+
+        const qvec3f incoming = qv::normalize(sun.sunvec);
+
+        if (!state.traced) {
+            state.traced = true;
+
+            if (SunReachesFace(lightsurf, incoming)) {
+                // the samples at least one of the suns would light; the rest are gated, as in LightFace_Sky
+                wanted.assign(lightsurf->samples.size(), false);
+
+                for (size_t index : groups[sun.direction_group]) {
+                    if (!use_sun(suns[index])) {
+                        continue;
+                    }
+
+                    for (int i = 0; i < lightsurf->samples.size(); i++) {
+                        if (lightsurf->samples[i].occluded)
+                            continue;
+
+                        float value;
+                        const qvec3f color =
+                            SunLightAtSample(cfg, &suns[index], incoming, lightsurf, lightsurf->samples[i], value);
+
+                        if (fabs(LightSample_Brightness(color)) > light_options.gate.value()) {
+                            wanted[i] = true;
+                        }
+                    }
+                }
+
+                state.any_sky = TraceSkyHits(
+                    lightsurf, incoming, hierarchical ? light_options.skyvis.value() : 1, wanted, state.hits);
+            }
+        }
+
+        if (SunReachesFace(lightsurf, incoming)) {
+            // same as LightFace_Sky, with the traced hits
+            int cached_style = sun.style;
+            lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+
+            for (int i = 0; state.any_sky && i < lightsurf->samples.size(); i++) {
+                const auto &sample = lightsurf->samples[i];
+                const sky_hit_t &hit = state.hits[i];
+
+                if (sample.occluded || !hit.texture)
+                    continue;
+
+                float value;
+                const qvec3f color = SunLightAtSample(cfg, &sun, incoming, lightsurf, sample, value);
+
+                if (fabs(LightSample_Brightness(color)) <= light_options.gate.value()) {
+                    continue;
+                }
+
+                // check if we hit the wrong texture
+                if (sun.suntexture_value && sun.suntexture_value != hit.texture)
+                    continue;
+
+                // check if we hit a dynamic shadow caster
+                int desired_style = sun.style;
+                if (desired_style == 0) {
+                    desired_style = hit.dynamic_style;
+                }
+
+                // if necessary, switch which lightmap we are writing to.
+                if (desired_style != cached_style) {
+                    cached_style = desired_style;
+                    cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+                }
+
+                lightsample_t &lightsample = cached_lightmap->samples[i];
+
+                lightsample.color += color;
+                cached_lightmap->bounce_color += color;
+                lightsample.direction += incoming * value;
+
+                Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
+            }
+        }
+
+        if (--state.remaining == 0) {
+            state = {};
+        }
+    }
+}
+
 static void LightPoint_Sky(const mbsp_t *bsp, raystream_intersection_t &rs, const sun_t *sun, const qvec3f &surfpoint,
     lightgrid_samples_t &result)
 {
@@ -1699,7 +1985,8 @@ static void LightFace_LocalMin(
         return;
 
     /* Cast rays for local minlight entities */
-    for (const auto &entity : GetLights()) {
+    for (uint32_t index : LightsNearSurface(lightsurf)) {
+        const auto &entity = GetLights()[index];
         if (entity->getFormula() != LF_LOCALMIN) {
             continue;
         }
@@ -1979,7 +2266,70 @@ static bool SurfaceLight_VisCull(const mbsp_t *bsp, const std::vector<uint8_t> *
 {
     if (pvs && light_options.visapprox.value() == visapprox_t::VIS) {
         for (auto &leaf : lightsurf_b->leaves) {
-            if (VisCullEntity(bsp, *pvs, leaf)) {
+            if (VisCullEntity(bsp, pvs, leaf)) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Conservative versions of the per-emitter culls, applied to a whole subtree of
+ * the surface light tree. Only rejects nodes where every emitter below would have been
+ * rejected by SurfaceLight_SphereCull, or would have returned zero from GetSurfaceLighting
+ * for every sample, so the lighting result is unchanged.
+ */
+static bool SurfaceLight_NodeCull(const surflight_tree_t::node_t &node, const lightsurf_t *lightsurf,
+    const aabb3f &sample_bounds, float bouncelight_gate, float hotspot_clamp)
+{
+    // same test as SurfaceLight_SphereCull
+    if (light_options.visapprox.value() == visapprox_t::RAYS &&
+        node.visible_bounds.disjoint(lightsurf->extents.bounds, 0.001f)) {
+        return true;
+    }
+
+    // every sample is behind every emitter: GetSurfaceLighting() would return 0
+    if (!node.omnidirectional) {
+        const qvec3f point_center = node.point_bounds.centroid();
+        const qvec3f sample_center = sample_bounds.centroid();
+        const float radii = (qv::length(node.point_bounds.size()) + qv::length(sample_bounds.size())) * 0.5f;
+
+        const qvec3f between = sample_center - point_center;
+        const float dist = qv::length(between);
+
+        // keep well clear of the 0.01 distance clamp in LightFace_SurfaceLight
+        if (dist - radii > 1.0f) {
+            const float spread = std::asin(radii / dist);
+            const float angle = std::acos(std::clamp(qv::dot(node.cone_axis, between / dist), -1.0f, 1.0f));
+
+            // dp1 < -LIGHT_ANGLE_EPSILON for every (emitter normal, point -> sample) pair, with some slack for rounding
+            if (angle - node.cone_angle - spread > (Q_PI / 2) + std::asin(LIGHT_ANGLE_EPSILON) + 0.01f) {
+                return true;
+            }
+        }
+    }
+
+    // upper bound of the SurfaceLight_SphereCull gate test over the node
+    if (bouncelight_gate) {
+        const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+
+        const qvec3f origin = lightsurf->extents.origin;
+        const qvec3f nearest = qv::min(qv::max(origin, node.pos_bounds.mins()), node.pos_bounds.maxs());
+        const float mindist = qv::length(origin - nearest) + lightsurf->extents.radius;
+
+        const float scale = std::max(std::abs(cfg.surflightscale.value()), std::abs(cfg.surflightskyscale.value()));
+        const float falloff = (cfg.scaledist.value() >= 0 && node.min_atten >= 0)
+                                  ? cfg.scaledist.value() * node.min_atten * mindist
+                                  : 0.0f;
+        const float d = std::max(falloff, hotspot_clamp);
+
+        if (d > 0) {
+            const float bound = node.peak_intensity * scale / (d * d);
+
+            // 1% slack for float rounding differences against the per-emitter test
+            if (bound * 1.01f <= bouncelight_gate) {
                 return true;
             }
         }
@@ -1988,19 +2338,185 @@ static bool SurfaceLight_VisCull(const mbsp_t *bsp, const std::vector<uint8_t> *
     return false;
 }
 
+// -emissivequality adaptive: a sample stops tracing a progressive surface light once the standard
+// error of its estimate is below this fraction of the estimate, or below one lightmap unit
+constexpr float PROGRESSIVE_RELATIVE_ERROR = 0.05f;
+constexpr size_t PROGRESSIVE_MIN_POINTS = 8;
+constexpr size_t PROGRESSIVE_BATCH = 4;
+
+/*
+ * Traces the points of a progressive surface light (see surfacelight_t::progressive) in order,
+ * checking every few points which samples have converged. Converged samples stop tracing; their
+ * result is their mean per-point contribution scaled up to the full point count.
+ */
+static void LightFace_SurfaceLight_Progressive(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+    const surfacelight_t &vpl, const surfacelight_t::per_style_t &vpl_setting, float surflight_gate,
+    float standard_scale, float sky_scale, float hotspot_clamp)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const size_t numsamples = lightsurf->samples.size();
+    const size_t numpoints = vpl.points.size();
+
+    thread_local static std::vector<qvec3f> sum;
+    thread_local static std::vector<float> sum_peak, sum_peak_sq;
+    thread_local static std::vector<uint32_t> taken;
+    thread_local static std::vector<bool> active;
+
+    sum.assign(numsamples, {});
+    sum_peak.assign(numsamples, 0);
+    sum_peak_sq.assign(numsamples, 0);
+    taken.assign(numsamples, 0);
+    active.assign(numsamples, false);
+
+    size_t num_active = 0;
+    for (size_t i = 0; i < numsamples; i++) {
+        if (!lightsurf->samples[i].occluded) {
+            active[i] = true;
+            num_active++;
+        }
+    }
+
+    raystream_occlusion_t &rs = occlusion_stream;
+
+    for (size_t c = 0; c < numpoints && num_active; c++) {
+        rs.clearPushedRays();
+
+        const qvec3f &pos = vpl.points[c];
+
+        for (size_t i = 0; i < numsamples; i++) {
+            if (!active[i])
+                continue;
+
+            const auto &sample = lightsurf->samples[i];
+            qvec3f dir = sample.point - pos;
+            float dist = std::max(0.01f, qv::length(dir));
+            bool use_normal = true;
+
+            if (lightsurf->twosided) {
+                use_normal = false;
+                dir /= dist;
+            } else if (dist == 0.0f) {
+                dir = sample.normal;
+                use_normal = false;
+            } else {
+                dir /= dist;
+            }
+
+            taken[i]++;
+
+            const qvec3f indirect = GetSurfaceLighting(cfg, vpl, vpl_setting, dir, dist, sample.normal, use_normal,
+                standard_scale, sky_scale, hotspot_clamp);
+            if (!qv::gate(indirect, surflight_gate)) {
+                rs.pushRay(i, pos, dir, dist, &indirect);
+            }
+        }
+
+        if (rs.numPushedRays()) {
+            rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
+
+            const int numrays = rs.numPushedRays();
+            for (int j = 0; j < numrays; j++) {
+                if (rs.getPushedRayOccluded(j))
+                    continue;
+
+                const int i = rs.getRay(j).index;
+                const qvec3f indirect = rs.getPushedRayColor(j);
+                const float peak = qv::max(indirect);
+
+                sum[i] += indirect;
+                sum_peak[i] += peak;
+                sum_peak_sq[i] += peak * peak;
+            }
+        }
+
+        const size_t traced = c + 1;
+
+        if (traced < PROGRESSIVE_MIN_POINTS || traced == numpoints || (traced % PROGRESSIVE_BATCH) != 0)
+            continue;
+
+        for (size_t i = 0; i < numsamples; i++) {
+            if (!active[i])
+                continue;
+
+            const float n = taken[i];
+            const float mean = sum_peak[i] / n;
+            const float variance = std::max(0.0f, sum_peak_sq[i] / n - mean * mean);
+
+            // estimate and standard error of the sum over all of the points
+            const float estimate = mean * numpoints;
+            const float error = std::sqrt(variance / n) * numpoints;
+
+            if (error <= std::max(estimate * PROGRESSIVE_RELATIVE_ERROR, 1.0f)) {
+                active[i] = false;
+                num_active--;
+            }
+        }
+    }
+
+    const int lightmapstyle = vpl_setting.style;
+    lightmap_t *lightmap = nullptr;
+
+    for (size_t i = 0; i < numsamples; i++) {
+        if (!taken[i] || qv::emptyExact(sum[i]))
+            continue;
+
+        qvec3f indirect = sum[i] * (static_cast<float>(numpoints) / taken[i]);
+
+        // Use dirt scaling on the surface lighting.
+        const float dirtscale = Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
+        indirect *= dirtscale;
+
+        if (!lightmap) {
+            lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+        }
+
+        lightsample_t &sample = lightmap->samples[i];
+        sample.color += indirect;
+        lightmap->bounce_color += indirect;
+    }
+
+    // If surface light contributed anything, save.
+    if (lightmap)
+        Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
+}
+
 static void // mxd
 LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
     std::optional<size_t> bounce_depth, float standard_scale, float sky_scale, float hotspot_clamp)
 {
     const settings::worldspawn_keys &cfg = *lightsurf->cfg;
-    const float surflight_gate = light_options.emissivequality.value() == emissivequality_t::HIGH ? 0.0f : 0.01f;
+    const float surflight_gate = light_options.emissivequality.value() >= emissivequality_t::HIGH ? 0.0f : 0.01f;
 
     // check lighting channels (currently surface lights are always on CHANNEL_MASK_DEFAULT)
     if (!(lightsurf->object_channel_mask & CHANNEL_MASK_DEFAULT)) {
         return;
     }
 
-    for (const auto &surf_ptr : EmissiveLightSurfaces()) {
+    aabb3f sample_bounds;
+    for (const auto &sample : lightsurf->samples) {
+        if (!sample.occluded) {
+            sample_bounds += sample.point;
+        }
+    }
+    if (!sample_bounds.valid()) {
+        return;
+    }
+
+    // fetch the emitters that can reach this face from the surface light tree
+    thread_local static std::vector<uint32_t> emitters;
+    if (light_options.debug_surflight_linear.value()) {
+        emitters.resize(EmissiveLightSurfaces().size());
+        std::iota(emitters.begin(), emitters.end(), 0);
+    } else {
+        EmissiveLightSurfacesTree().query(
+            [&](const surflight_tree_t::node_t &node) {
+                return SurfaceLight_NodeCull(node, lightsurf, sample_bounds, surflight_gate, hotspot_clamp);
+            },
+            emitters);
+    }
+
+    for (const uint32_t emitter : emitters) {
+        const lightsurf_t *surf_ptr = EmissiveLightSurfaces()[emitter];
         auto &vpl = *surf_ptr->vpl.get();
 
         for (const auto &vpl_setting : surf_ptr->vpl->styles) {
@@ -2009,8 +2525,14 @@ LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t
                 continue;
             else if (SurfaceLight_SphereCull(&vpl, lightsurf, vpl_setting, surflight_gate, hotspot_clamp))
                 continue;
-            else if (SurfaceLight_VisCull(bsp, &lightsurf->pvs, surf_ptr))
+            else if (SurfaceLight_VisCull(bsp, lightsurf->pvs, surf_ptr))
+                continue;
+
+            if (vpl.progressive) {
+                LightFace_SurfaceLight_Progressive(bsp, lightsurf, lightmaps, vpl, vpl_setting, surflight_gate,
+                    standard_scale, sky_scale, hotspot_clamp);
                 continue;
+            }
 
             raystream_occlusion_t &rs = occlusion_stream;
 
@@ -2099,7 +2621,7 @@ LightPoint_SurfaceLight(const mbsp_t *bsp, const std::vector<uint8_t> *pvs, rays
     float standard_scale, float sky_scale, float hotspot_clamp, const qvec3f &surfpoint, lightgrid_samples_t &result)
 {
     const settings::worldspawn_keys &cfg = light_options;
-    const float surflight_gate = light_options.emissivequality.value() == emissivequality_t::HIGH ? 0 : 0.01f;
+    const float surflight_gate = light_options.emissivequality.value() >= emissivequality_t::HIGH ? 0 : 0.01f;
 
     for (const auto &surf : EmissiveLightSurfaces()) {
         const surfacelight_t &vpl = *surf->vpl;
@@ -2551,6 +3073,150 @@ lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const
     return Lightsurf_Init(modelinfo, cfg, face, bsp, facesup, facesup_decoupled);
 }
 
+/*
+ * ============
+ * LightFace_SaveNoisyBounce
+ *
+ * With -denoise, the noisy lights write to noisyLightmapsByStyle, but the
+ * light they bounce is still collected from lightmapsByStyle (see bounce.cc),
+ * so move their bounce_color over.
+ * ============
+ */
+static void LightFace_SaveNoisyBounce(const mbsp_t *bsp, lightsurf_t *lightsurf)
+{
+    for (lightmap_t &noisy : lightsurf->noisyLightmapsByStyle) {
+        if (noisy.style == INVALID_LIGHTSTYLE || qv::emptyExact(noisy.bounce_color)) {
+            continue;
+        }
+
+        lightmap_t *lightmap = Lightmap_ForStyle(&lightsurf->lightmapsByStyle, noisy.style, lightsurf);
+        lightmap->bounce_color += noisy.bounce_color;
+        noisy.bounce_color = {};
+
+        Lightmap_Save(bsp, &lightsurf->lightmapsByStyle, lightsurf, lightmap, noisy.style);
+    }
+}
+
+/*
+ * ============
+ * Denoise_Lightsamples
+ *
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Every pass
+ * applies the 5x5 B3-spline kernel with its taps spread twice as far apart as
+ * the last, and a neighbouring sample only contributes as much as its normal
+ * and plane agree with the center sample, so creases and corners aren't
+ * blurred across. `spacing` is the world space distance between neighbouring
+ * samples.
+ * ============
+ */
+void Denoise_Lightsamples(const lightsurf_t &lightsurf, float spacing, int passes, std::vector<lightsample_t> &current)
+{
+    static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+    // cos^64 falls to half at ~8 degrees
+    static constexpr float normal_power = 64.0f;
+
+    const int width = lightsurf.width;
+    const int height = lightsurf.height;
+    const auto &samples = lightsurf.samples;
+
+    std::vector<lightsample_t> filtered(current.size());
+
+    for (int pass = 0; pass < passes; pass++) {
+        const int step = 1 << pass;
+
+        for (int t = 0; t < height; t++) {
+            for (int s = 0; s < width; s++) {
+                const int i = (t * width) + s;
+                const auto &center = samples[i];
+
+                if (center.occluded) {
+                    filtered[i] = current[i];
+                    continue;
+                }
+
+                lightsample_t sum{};
+                float total = 0;
+
+                for (int dt = -2; dt <= 2; dt++) {
+                    const int nt = t + (dt * step);
+
+                    if (nt < 0 || nt >= height)
+                        continue;
+
+                    for (int ds = -2; ds <= 2; ds++) {
+                        const int ns = s + (ds * step);
+
+                        if (ns < 0 || ns >= width)
+                            continue;
+
+                        const int j = (nt * width) + ns;
+                        const auto &other = samples[j];
+
+                        if (other.occluded)
+                            continue;
+
+                        const float cosangle = qv::dot(center.normal, other.normal);
+
+                        if (cosangle <= 0)
+                            continue;
+
+                        const float planedist = qv::dot(center.normal, other.point - center.point) / (spacing * step);
+                        const float weight = kernel[dt + 2] * kernel[ds + 2] * std::pow(cosangle, normal_power) *
+                                             std::exp(-(planedist * planedist));
+
+                        sum.color += current[j].color * weight;
+                        sum.direction += current[j].direction * weight;
+                        total += weight;
+                    }
+                }
+
+                // the center sample always contributes, so total > 0
+                filtered[i].color = sum.color / total;
+                filtered[i].direction = sum.direction / total;
+            }
+        }
+
+        std::swap(current, filtered);
+    }
+}
+
+/*
+ * ============
+ * LightFace_Denoise
+ *
+ * Filters the light collected in noisyLightmapsByStyle with
+ * Denoise_Lightsamples and adds it back to the lightmaps.
+ * ============
+ */
+static void LightFace_Denoise(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+{
+    // world space distance between neighbouring samples
+    const qvec3f origin = lightsurf->extents.LMCoordToWorld({0, 0});
+    const float spacing = std::max(0.01f,
+        std::min(qv::length(lightsurf->extents.LMCoordToWorld({1, 0}) - origin),
+            qv::length(lightsurf->extents.LMCoordToWorld({0, 1}) - origin)) /
+            light_options.extra.value());
+
+    for (lightmap_t &noisy : lightsurf->noisyLightmapsByStyle) {
+        if (noisy.style == INVALID_LIGHTSTYLE) {
+            continue;
+        }
+
+        Denoise_Lightsamples(*lightsurf, spacing, light_options.denoise.value(), noisy.samples);
+
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, noisy.style, lightsurf);
+
+        for (size_t i = 0; i < noisy.samples.size(); i++) {
+            lightmap->samples[i].color += noisy.samples[i].color;
+            lightmap->samples[i].direction += noisy.samples[i].direction;
+        }
+
+        Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, noisy.style);
+    }
+
+    lightsurf->noisyLightmapsByStyle.clear();
+}
+
 /*
  * ============
  * LightFace
@@ -2582,7 +3248,8 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
 
         /* positive lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
+            for (uint32_t index : LightsNearSurface(&lightsurf)) {
+                const auto &entity = GetLights()[index];
                 if (entity->getFormula() == LF_LOCALMIN)
                     continue;
                 if (entity->nostaticlight.value())
@@ -2590,14 +3257,28 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
                 if (entity->light.value() > 0)
                     LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
             }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight > 0)
-                    LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+            const bool denoise = light_options.denoise.value() > 0;
+
+            LightFace_Suns(
+                bsp, [denoise](const sun_t &sun) { return sun.sunlight > 0 && !(denoise && sun.dome); }, &lightsurf,
+                lightmaps);
+
+            // sky domes and surface lights are filtered separately with -denoise
+            lightmapdict_t *noisy_lightmaps = denoise ? &lightsurf.noisyLightmapsByStyle : lightmaps;
+
+            if (denoise) {
+                LightFace_Suns(
+                    bsp, [](const sun_t &sun) { return sun.sunlight > 0 && sun.dome; }, &lightsurf, noisy_lightmaps);
+            }
 
             // mxd. Add surface lights...
             // FIXME: negative surface lights
-            LightFace_SurfaceLight(bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(),
+            LightFace_SurfaceLight(bsp, &lightsurf, noisy_lightmaps, std::nullopt, cfg.surflightscale.value(),
                 cfg.surflightskyscale.value(), 16.0f);
+
+            if (denoise) {
+                LightFace_SaveNoisyBounce(bsp, &lightsurf);
+            }
         }
 
         LightFace_LocalMin(bsp, face, &lightsurf, lightmaps);
@@ -2635,10 +3316,16 @@ void IndirectLightFace(
         /* positive lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
 
+            const bool denoise = light_options.denoise.value() > 0;
+
             /* add bounce lighting */
             // note: scale here is just to keep it close-ish to the old code
-            LightFace_SurfaceLight(bsp, &lightsurf, lightmaps, bounce_depth, cfg.bouncescale.value() * 0.5,
-                cfg.bouncescale.value(), 128.0f);
+            LightFace_SurfaceLight(bsp, &lightsurf, denoise ? &lightsurf.noisyLightmapsByStyle : lightmaps,
+                bounce_depth, cfg.bouncescale.value() * 0.5, cfg.bouncescale.value(), 128.0f);
+
+            if (denoise) {
+                LightFace_SaveNoisyBounce(bsp, &lightsurf);
+            }
         }
     }
 }
@@ -2655,6 +3342,10 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
 
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
+    if (!lightsurf.noisyLightmapsByStyle.empty()) {
+        LightFace_Denoise(bsp, &lightsurf, lightmaps);
+    }
+
     if (light_options.debugmode == debugmodes::none) {
 #if 0
         total_samplepoints += lightsurf.samples.size();
@@ -2699,7 +3390,8 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
 
         /* negative lights */
         if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
+            for (uint32_t index : LightsNearSurface(&lightsurf)) {
+                const auto &entity = GetLights()[index];
                 if (entity->getFormula() == LF_LOCALMIN)
                     continue;
                 if (entity->nostaticlight.value())
@@ -2707,9 +3399,7 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
                 if (entity->light.value() < 0)
                     LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
             }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight < 0)
-                    LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+            LightFace_Suns(bsp, [](const sun_t &sun) { return sun.sunlight < 0; }, &lightsurf, lightmaps);
         }
     }
 
@@ -2867,7 +3557,15 @@ lightgrid_samples_t CalcLightgridAtPoint(const mbsp_t *bsp, const qvec3f &world_
     raystream_occlusion_t rs(1);
     raystream_intersection_t rsi(1);
 
-    const auto *pvs = Mod_LeafPvs(bsp, BSP_FindLeafAtPoint(bsp, &bsp->dmodels[0], world_point));
+    // the decompressed vis is freed once the lightsurfs have their PVS (see LightWorld),
+    // so the row is decompressed here
+    const mleaf_t *leaf = BSP_FindLeafAtPoint(bsp, &bsp->dmodels[0], world_point);
+    std::optional<std::vector<uint8_t>> leafvis;
+    if (!bsp->loadversion->game->create_contents_from_native(leaf->contents).is_liquid()) {
+        // liquids aren't culled; see Mod_LeafPvs
+        leafvis = DecompressLeafVis(bsp, leaf);
+    }
+    const std::vector<uint8_t> *pvs = leafvis ? &*leafvis : nullptr;
 
     auto &cfg = light_options;
 
@@ -33,6 +33,7 @@ See file, 'COPYING', for details.
 #include <vector>
 #include <map>
 #include <mutex>
+#include <numeric> // for std::iota
 
 #include <common/qvec.hh>
 
@@ -284,3 +285,88 @@ MakeRadiositySurfaceLights(const settings::worldspawn_keys &cfg, const mbsp_t *b
 
     logging::print("{} surface light points in use.\n", total_surflight_points.load());
 }
+
+// surflight_tree_t
+
+uint32_t surflight_tree_t::build_r(const std::vector<lightsurf_t *> &emitters, uint32_t *first, uint32_t *last)
+{
+    const uint32_t node_index = m_nodes.size();
+    m_nodes.emplace_back();
+
+    node_t node{};
+    node.omnidirectional = false;
+    node.peak_intensity = 0.0f;
+    node.min_atten = std::numeric_limits<float>::max();
+    node.emitter = -1;
+
+    qvec3f normal_sum{};
+
+    for (uint32_t *it = first; it != last; ++it) {
+        const surfacelight_t &vpl = *emitters[*it]->vpl;
+
+        for (const qvec3f &pt : vpl.points) {
+            node.point_bounds += pt;
+        }
+        node.pos_bounds += vpl.pos;
+        if (vpl.bounds.valid()) {
+            node.visible_bounds += vpl.bounds;
+        }
+
+        for (const auto &style : vpl.styles) {
+            node.omnidirectional |= style.omnidirectional;
+            node.peak_intensity = std::max(node.peak_intensity,
+                std::abs(style.totalintensity) * qv::max(qv::abs(style.color)));
+            node.min_atten = std::min(node.min_atten, style.atten);
+        }
+
+        normal_sum += vpl.surfnormal;
+    }
+
+    // normal cone: average normal, widened to cover every emitter
+    const float normal_sum_len = qv::length(normal_sum);
+    if (normal_sum_len < 0.001f) {
+        node.cone_axis = {0, 0, 1};
+        node.cone_angle = Q_PI;
+    } else {
+        node.cone_axis = normal_sum / normal_sum_len;
+        node.cone_angle = 0.0f;
+
+        for (uint32_t *it = first; it != last; ++it) {
+            const float cosangle = std::clamp(qv::dot(node.cone_axis, emitters[*it]->vpl->surfnormal), -1.0f, 1.0f);
+            node.cone_angle = std::max(node.cone_angle, std::acos(cosangle));
+        }
+    }
+
+    if (last - first == 1) {
+        node.emitter = *first;
+    } else {
+        // median split along the longest axis of the emitter positions
+        const qvec3f size = node.pos_bounds.size();
+        const size_t axis = (size[0] >= size[1] && size[0] >= size[2]) ? 0 : (size[1] >= size[2] ? 1 : 2);
+
+        uint32_t *mid = first + (last - first) / 2;
+        std::nth_element(first, mid, last,
+            [&](uint32_t a, uint32_t b) { return emitters[a]->vpl->pos[axis] < emitters[b]->vpl->pos[axis]; });
+
+        node.children[0] = build_r(emitters, first, mid);
+        node.children[1] = build_r(emitters, mid, last);
+    }
+
+    m_nodes[node_index] = node;
+    return node_index;
+}
+
+void surflight_tree_t::build(const std::vector<lightsurf_t *> &emitters)
+{
+    m_nodes.clear();
+
+    if (emitters.empty()) {
+        return;
+    }
+
+    std::vector<uint32_t> order(emitters.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    m_nodes.reserve(emitters.size() * 2 - 1);
+    build_r(emitters, order.data(), order.data() + order.size());
+}
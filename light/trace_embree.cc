@@ -25,9 +25,37 @@
 #include <common/bsputils.hh>
 #include <common/polylib.hh>
 #include <vector>
+#include <array>
 #include <climits>
+#include <cstring>
 #include <set>
 
+struct Vertex
+{
+    float point[4];
+}; // 4th element is padding
+struct Triangle
+{
+    int v0, v1, v2;
+};
+
+/**
+ * The triangles handed to embree for one geometry. The scene shares these
+ * (rtcSetSharedGeometryBuffer), so they live as long as it does.
+ */
+struct geometry_buffers_t
+{
+    std::vector<Vertex> vertices;
+    std::vector<Triangle> triangles;
+
+    bool operator==(const geometry_buffers_t &other) const
+    {
+        return vertices.size() == other.vertices.size() && triangles.size() == other.triangles.size() &&
+               !memcmp(vertices.data(), other.vertices.data(), vertices.size() * sizeof(Vertex)) &&
+               !memcmp(triangles.data(), other.triangles.data(), triangles.size() * sizeof(Triangle));
+    }
+};
+
 sceneinfo skygeom; // sky. always occludes.
 sceneinfo solidgeom; // solids. always occludes.
 sceneinfo filtergeom; // conditional occluders.. needs to run ray intersection filter
@@ -37,16 +65,20 @@ std::set<const mface_t *> shadow_casting_solid_faces;
 
 static RTCDevice device;
 RTCScene scene;
+int embree_packet_width = 1;
 
 static const mbsp_t *bsp_static;
 
-void ResetEmbree()
-{
-    skygeom = {};
-    solidgeom = {};
-    filtergeom = {};
-    shadow_casting_solid_faces = {};
+// sky, solid, filter and skip geometry that `scene` was built from
+static std::array<geometry_buffers_t, 4> scene_buffers;
+static std::array<unsigned int, 3> scene_geomids;
+
+// see Embree_SetSceneCache
+static bool scene_cache_enabled = false;
+static bool scene_reused = false;
 
+static void ReleaseScene()
+{
     if (scene) {
         rtcReleaseScene(scene);
         scene = nullptr;
@@ -57,7 +89,36 @@ void ResetEmbree()
         device = nullptr;
     }
 
+    scene_buffers = {};
+}
+
+void ResetEmbree()
+{
+    skygeom = {};
+    solidgeom = {};
+    filtergeom = {};
+    shadow_casting_solid_faces = {};
+
+    // the next run may be able to reuse it
+    if (!scene_cache_enabled) {
+        ReleaseScene();
+    }
+
     bsp_static = nullptr;
+    embree_packet_width = 1;
+}
+
+void Embree_SetSceneCache(bool enabled)
+{
+    scene_cache_enabled = enabled;
+
+    // either way, start over; the last run's scene may still be around
+    ReleaseScene();
+}
+
+bool Embree_SceneReused()
+{
+    return scene_reused;
 }
 
 const std::set<const mface_t *> &ShadowCastingSolidFacesSet()
@@ -98,36 +159,16 @@ static float Face_Alpha(const mbsp_t *bsp, const modelinfo_t *modelinfo, const m
     return 1.0f;
 }
 
-sceneinfo CreateGeometry(
-    const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std::vector<const mface_t *> &faces)
+/**
+ * Gathers the triangles of `faces` into `buffers`, and returns the matching
+ * triinfo. The geomID is filled in when the geometry is attached.
+ */
+static sceneinfo GatherGeometry(
+    const mbsp_t *bsp, const std::vector<const mface_t *> &faces, geometry_buffers_t &buffers)
 {
-    unsigned int geomID;
-    RTCGeometry geom_0 = rtcNewGeometry(g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-    // we're not using masks, but they need to be set to something or else all rays miss
-    // if embree is compiled with them
-    rtcSetGeometryMask(geom_0, 1);
-    rtcSetGeometryBuildQuality(geom_0, RTC_BUILD_QUALITY_MEDIUM);
-    rtcSetGeometryTimeStepCount(geom_0, 1);
-    geomID = rtcAttachGeometry(scene, geom_0);
-    rtcReleaseGeometry(geom_0);
-
-    struct Vertex
-    {
-        float point[4];
-    }; // 4th element is padding
-    struct Triangle
-    {
-        int v0, v1, v2;
-    };
-
-    // temprary buffers used while gathering faces
-    std::vector<Vertex> vertices_temp;
-    std::vector<Triangle> tris_temp;
-
     sceneinfo s;
-    s.geomID = geomID;
 
-    auto add_vert = [&](const qvec3f &pos) { vertices_temp.push_back({.point{pos[0], pos[1], pos[2], 0.0f}}); };
+    auto add_vert = [&](const qvec3f &pos) { buffers.vertices.push_back({.point{pos[0], pos[1], pos[2], 0.0f}}); };
 
     // FIXME: reuse vertices
     auto add_tri = [&](const mface_t *face, int bsp_vert0, int bsp_vert1, int bsp_vert2, const modelinfo_t *modelinfo) {
@@ -136,12 +177,12 @@ sceneinfo CreateGeometry(
         const qvec3f final_pos2 = Vertex_GetPos(bsp, bsp_vert2) + modelinfo->offset;
 
         // push the 3 vertices
-        int first_vert_index = vertices_temp.size();
+        int first_vert_index = buffers.vertices.size();
         add_vert(final_pos0);
         add_vert(final_pos1);
         add_vert(final_pos2);
 
-        tris_temp.push_back({first_vert_index, first_vert_index + 1, first_vert_index + 2});
+        buffers.triangles.push_back({first_vert_index, first_vert_index + 1, first_vert_index + 2});
 
         const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
 
@@ -199,85 +240,50 @@ sceneinfo CreateGeometry(
         }
     }
 
-    // copy vertices, triangles from temporary buffers to embree-managed memory
-    Vertex *vertices = (Vertex *)rtcSetNewGeometryBuffer(
-        geom_0, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 4 * sizeof(float), vertices_temp.size());
-
-    Triangle *triangles = (Triangle *)rtcSetNewGeometryBuffer(
-        geom_0, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(int), tris_temp.size());
-
-    memcpy(vertices, vertices_temp.data(), sizeof(Vertex) * vertices_temp.size());
-    memcpy(triangles, tris_temp.data(), sizeof(Triangle) * tris_temp.size());
-
-    rtcCommitGeometry(geom_0);
     return s;
 }
 
-static void CreateGeometryFromWindings(
-    RTCDevice g_device, RTCScene scene, const std::vector<polylib::winding3f_t> &windings)
+static void GatherGeometryFromWindings(const std::vector<polylib::winding3f_t> &windings, geometry_buffers_t &buffers)
 {
-    if (windings.empty())
-        return;
-
-    // count triangles
-    int numtris = 0;
-    int numverts = 0;
     for (const auto &winding : windings) {
         Q_assert(winding.size() >= 3);
-        numtris += (winding.size() - 2);
-        numverts += winding.size();
-    }
 
-    RTCGeometry geom_1 = rtcNewGeometry(g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-    rtcSetGeometryBuildQuality(geom_1, RTC_BUILD_QUALITY_MEDIUM);
-    rtcSetGeometryMask(geom_1, 1);
-    rtcSetGeometryTimeStepCount(geom_1, 1);
-    rtcAttachGeometry(scene, geom_1);
-    rtcReleaseGeometry(geom_1);
+        const int first_vert_index = buffers.vertices.size();
 
-    struct Vertex
-    {
-        float point[4];
-    }; // 4th element is padding
-    struct Triangle
-    {
-        int v0, v1, v2;
-    };
-
-    // fill in vertices
-    Vertex *vertices = (Vertex *)rtcSetNewGeometryBuffer(
-        geom_1, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 4 * sizeof(float), numverts);
-    {
-        int vert_index = 0;
-        for (const auto &winding : windings) {
-            for (int j = 0; j < winding.size(); j++) {
-                for (int k = 0; k < 3; k++) {
-                    vertices[vert_index + j].point[k] = winding.at(j)[k];
-                }
-            }
-            vert_index += winding.size();
+        for (int j = 0; j < winding.size(); j++) {
+            buffers.vertices.push_back({.point{winding.at(j)[0], winding.at(j)[1], winding.at(j)[2], 0.0f}});
         }
-    }
 
-    // fill in triangles
-    Triangle *triangles = (Triangle *)rtcSetNewGeometryBuffer(
-        geom_1, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(int), numtris);
-    int tri_index = 0;
-    int vert_index = 0;
-    for (const auto &winding : windings) {
         for (int j = 2; j < winding.size(); j++) {
-            Triangle *tri = &triangles[tri_index];
-            tri->v0 = vert_index + (j - 1);
-            tri->v1 = vert_index + j;
-            tri->v2 = vert_index + 0;
-            tri_index++;
+            buffers.triangles.push_back({first_vert_index + (j - 1), first_vert_index + j, first_vert_index + 0});
         }
-        vert_index += winding.size();
     }
-    Q_assert(vert_index == numverts);
-    Q_assert(tri_index == numtris);
+}
+
+static unsigned int AttachGeometry(RTCDevice g_device, RTCScene scene, const geometry_buffers_t &buffers)
+{
+    RTCGeometry geom = rtcNewGeometry(g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    // we're not using masks, but they need to be set to something or else all rays miss
+    // if embree is compiled with them
+    rtcSetGeometryMask(geom, 1);
+    rtcSetGeometryBuildQuality(geom, RTC_BUILD_QUALITY_MEDIUM);
+    rtcSetGeometryTimeStepCount(geom, 1);
+    const unsigned int geomID = rtcAttachGeometry(scene, geom);
+    rtcReleaseGeometry(geom);
+
+    if (buffers.triangles.empty()) {
+        // nothing to share; the vectors may not have storage
+        rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, sizeof(Vertex), 0);
+        rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, sizeof(Triangle), 0);
+    } else {
+        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, buffers.vertices.data(), 0,
+            sizeof(Vertex), buffers.vertices.size());
+        rtcSetSharedGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, buffers.triangles.data(), 0,
+            sizeof(Triangle), buffers.triangles.size());
+    }
 
-    rtcCommitGeometry(geom_1);
+    rtcCommitGeometry(geom);
+    return geomID;
 }
 
 void ErrorCallback(void *userptr, const RTCError code, const char *str)
@@ -547,7 +553,6 @@ static void MakeFaces(
 void Embree_TraceInit(const mbsp_t *bsp)
 {
     bsp_static = bsp;
-    Q_assert(device == nullptr);
 
     std::vector<const mface_t *> skyfaces, solidfaces, filterfaces;
 
@@ -657,32 +662,76 @@ void Embree_TraceInit(const mbsp_t *bsp)
         }
     }
 
-    device = rtcNewDevice(NULL);
-    rtcSetDeviceErrorFunction(
-        device, ErrorCallback, nullptr); // mxd. Changed from rtcDeviceSetErrorFunction to silence compiler warning...
+    std::array<geometry_buffers_t, 4> buffers;
+    skygeom = GatherGeometry(bsp, skyfaces, buffers[0]);
+    solidgeom = GatherGeometry(bsp, solidfaces, buffers[1]);
+    filtergeom = GatherGeometry(bsp, filterfaces, buffers[2]);
+    GatherGeometryFromWindings(skipwindings, buffers[3]);
+
+    // the BVH only depends on the triangles, so if they're the same as the
+    // cached scene's (see Embree_SetSceneCache), it can be used as-is
+    scene_reused = scene && buffers == scene_buffers;
+
+    if (scene_reused) {
+        logging::funcprint("reusing the previous run's scene, the geometry is unchanged\n");
+    } else {
+        if (scene) {
+            rtcReleaseScene(scene);
+            scene = nullptr;
+        }
 
-    // log version
-    const size_t ver_maj = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_MAJOR);
-    const size_t ver_min = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_MINOR);
-    const size_t ver_pat = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_PATCH);
-    logging::funcprint("Embree version: {}.{}.{}\n", ver_maj, ver_min, ver_pat);
+        if (!device) {
+            device = rtcNewDevice(NULL);
+            rtcSetDeviceErrorFunction(device, ErrorCallback,
+                nullptr); // mxd. Changed from rtcDeviceSetErrorFunction to silence compiler warning...
 
-    scene = rtcNewScene(device);
-    // necessary for RTCOccludedArguments::filter and RTCIntersectArguments::filter
-    // to work, which we use (see: ray_source_info::setup_intersection_arguments() and
-    // ray_source_info::setup_occluded_arguments())
-    rtcSetSceneFlags(scene, RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS);
+            // log version
+            const size_t ver_maj = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_MAJOR);
+            const size_t ver_min = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_MINOR);
+            const size_t ver_pat = rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_VERSION_PATCH);
+            logging::funcprint("Embree version: {}.{}.{}\n", ver_maj, ver_min, ver_pat);
+        }
 
-    rtcSetSceneBuildQuality(scene, RTC_BUILD_QUALITY_HIGH);
-    skygeom = CreateGeometry(bsp, device, scene, skyfaces);
-    solidgeom = CreateGeometry(bsp, device, scene, solidfaces);
-    filtergeom = CreateGeometry(bsp, device, scene, filterfaces);
-    CreateGeometryFromWindings(device, scene, skipwindings);
+        scene_buffers = std::move(buffers);
 
-    rtcSetGeometryIntersectFilterFunction(rtcGetGeometry(scene, filtergeom.geomID), Embree_FilterFuncN);
-    rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene, filtergeom.geomID), Embree_FilterFuncN);
+        scene = rtcNewScene(device);
+        // necessary for RTCOccludedArguments::filter and RTCIntersectArguments::filter
+        // to work, which we use (see: ray_source_info::setup_intersection_arguments() and
+        // ray_source_info::setup_occluded_arguments())
+        rtcSetSceneFlags(scene, RTC_SCENE_FLAG_FILTER_FUNCTION_IN_ARGUMENTS);
+
+        rtcSetSceneBuildQuality(scene, RTC_BUILD_QUALITY_HIGH);
+        scene_geomids[0] = AttachGeometry(device, scene, scene_buffers[0]);
+        scene_geomids[1] = AttachGeometry(device, scene, scene_buffers[1]);
+        scene_geomids[2] = AttachGeometry(device, scene, scene_buffers[2]);
+        if (!scene_buffers[3].triangles.empty()) {
+            AttachGeometry(device, scene, scene_buffers[3]);
+        }
 
-    rtcCommitScene(scene);
+        rtcSetGeometryIntersectFilterFunction(rtcGetGeometry(scene, scene_geomids[2]), Embree_FilterFuncN);
+        rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene, scene_geomids[2]), Embree_FilterFuncN);
+
+        rtcCommitScene(scene);
+    }
+
+    skygeom.geomID = scene_geomids[0];
+    solidgeom.geomID = scene_geomids[1];
+    filtergeom.geomID = scene_geomids[2];
+
+    // pick the widest ray packet the device traces natively (depends on the ISA embree was built for
+    // and the CPU we're running on); falls back to single rays if embree was built without packet support
+    if (light_options.debug_single_rays.value()) {
+        embree_packet_width = 1;
+    } else if (rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY16_SUPPORTED)) {
+        embree_packet_width = 16;
+    } else if (rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY8_SUPPORTED)) {
+        embree_packet_width = 8;
+    } else if (rtcGetDeviceProperty(device, RTC_DEVICE_PROPERTY_NATIVE_RAY4_SUPPORTED)) {
+        embree_packet_width = 4;
+    } else {
+        embree_packet_width = 1;
+    }
+    logging::funcprint("ray packet width: {}\n", embree_packet_width);
 
     // keep a backup of solidfaces
     for (const mface_t *face : solidfaces) {
@@ -55,6 +55,7 @@ See file, 'COPYING', for details.
 
 #include <common/bspfile.hh>
 #include <common/litfile.hh>
+#include <common/pipeline.hh>
 #include <qbsp/qbsp.hh>
 #include <vis/vis.hh>
 #include <light/light.hh>
@@ -790,6 +791,11 @@ bspdata_t MainWindow::QbspVisLight_Common(const std::filesystem::path &name, std
     }
     args.push_back(name.string());
 
+    // pass the .bsp between the stages in memory; the .prt is still
+    // written, since we draw the portals from it
+    pipeline::scope pipeline;
+    pipeline.handoff.write_prt = true;
+
     // run qbsp
     m_activeLogTab = ETLogTab::TAB_BSP;
 
@@ -837,10 +843,15 @@ bspdata_t MainWindow::QbspVisLight_Common(const std::filesystem::path &name, std
 
     m_activeLogTab = ETLogTab::TAB_LIGHTPREVIEW;
 
-    // serialize obj
+    // write the .bsp, and keep it rather than loading it back
     {
         bspdata_t bspdata;
-        LoadBSPFile(bsp_path, &bspdata);
+
+        if (auto written = pipeline.finish()) {
+            bspdata = std::move(*written);
+        } else {
+            LoadBSPFile(bsp_path, &bspdata);
+        }
 
         ConvertBSPFormat(&bspdata, &bspver_generic);
 
@@ -544,6 +544,28 @@ static void ExpandBrush(hullbrush_t &hullbrush, const aabb3d &hull_size)
 }
 #endif
 
+/*
+===============
+ExpandPlaneForHull
+
+Pushes the plane out by the hull corner it faces
+===============
+*/
+static qplane3d ExpandPlaneForHull(const qbsp_plane_t &src, const aabb3d &hull)
+{
+    qvec3d corner{};
+    for (int32_t x = 0; x < 3; x++) {
+        if (src.get_normal()[x] > 0) {
+            corner[x] = hull[1][x];
+        } else if (src.get_normal()[x] < 0) {
+            corner[x] = hull[0][x];
+        }
+    }
+    qplane3d plane = src;
+    plane.dist += qv::dot(corner, plane.normal);
+    return plane;
+}
+
 /*
 ===============
 LoadBrush
@@ -609,17 +631,7 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
             if (mapface.get_texinfo().flags.no_expand) {
                 continue;
             }
-            qvec3d corner{};
-            for (int32_t x = 0; x < 3; x++) {
-                if (mapface.get_plane().get_normal()[x] > 0) {
-                    corner[x] = hull[1][x];
-                } else if (mapface.get_plane().get_normal()[x] < 0) {
-                    corner[x] = hull[0][x];
-                }
-            }
-            qplane3d plane = mapface.get_plane();
-            plane.dist += qv::dot(corner, plane.normal);
-            mapface.planenum = map.add_or_find_plane(plane);
+            mapface.planenum = map.add_or_find_plane(ExpandPlaneForHull(mapface.get_plane(), hull));
             mapface.bevel = false;
         }
 #else
@@ -678,172 +690,211 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
 
 //=============================================================================
 
-static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, content_stats_t &stats,
-    bspbrush_t::container &brushes, logging::percent_clock &clock, size_t &num_clipped)
+// the detail type an entity gives all of its brushes
+struct entity_detail_t
 {
-    clock.max += src.mapbrushes.size();
+    bool detail = false;
+    bool detail_wall = false;
+    bool detail_fence = false;
+    bool detail_illusionary = false;
+};
 
-    bool all_detail = false;
-    bool all_detail_wall = false;
-    bool all_detail_fence = false;
-    bool all_detail_illusionary = false;
+static entity_detail_t EntityDetail(const mapentity_t &src)
+{
+    entity_detail_t all;
 
     const std::string &classname = src.epairs.get("classname");
 
     /* If the source entity is func_detail, set the content flag */
     if (!qbsp_options.nodetail.value()) {
         if (!Q_strcasecmp(classname, "func_detail")) {
-            all_detail = true;
+            all.detail = true;
         }
 
         if (!Q_strcasecmp(classname, "func_detail_wall")) {
-            all_detail_wall = true;
+            all.detail_wall = true;
         }
 
         if (!Q_strcasecmp(classname, "func_detail_fence")) {
-            all_detail_fence = true;
+            all.detail_fence = true;
         }
 
         if (!Q_strcasecmp(classname, "func_detail_illusionary")) {
-            all_detail_illusionary = true;
+            all.detail_illusionary = true;
         }
     }
 
-    for (auto &mapbrush : src.mapbrushes) {
-        clock();
+    return all;
+}
 
-        if (map.is_world_entity(src) || IsWorldBrushEntity(src) || IsNonRemoveWorldBrushEntity(src)) {
-            if (map.region) {
-                if (map.region->bounds.disjoint(mapbrush.bounds)) {
-                    // stats.regioned_brushes++;
-                    // it = entity.mapbrushes.erase(it);
-                    // logging::print("removed broosh\n");
-                    continue;
-                }
-            }
+/*
+============
+BrushContents
 
-            for (auto &region : map.antiregions) {
-                if (!region.bounds.disjoint(mapbrush.bounds)) {
-                    // stats.regioned_brushes++;
-                    // it = entity.mapbrushes.erase(it);
-                    // logging::print("removed broosh\n");
-                    continue;
-                }
+Returns the contents `mapbrush` is loaded with for the given hull, or nullopt if
+it's left out of that hull. Brush_ReserveHullPlanes uses this too, so it
+expands the planes of the same brushes Brush_LoadEntity loads.
+============
+*/
+static std::optional<contentflags_t> BrushContents(const mapentity_t &dst, const mapentity_t &src,
+    const entity_detail_t &all, const mapbrush_t &mapbrush, hull_index_t hullnum)
+{
+    if (map.is_world_entity(src) || IsWorldBrushEntity(src) || IsNonRemoveWorldBrushEntity(src)) {
+        if (map.region) {
+            if (map.region->bounds.disjoint(mapbrush.bounds)) {
+                // stats.regioned_brushes++;
+                // it = entity.mapbrushes.erase(it);
+                // logging::print("removed broosh\n");
+                return std::nullopt;
             }
         }
 
-        if (!hullnum.value_or(0)) {
-            if (src.epairs.get_int("_super_detail")) {
+        for (auto &region : map.antiregions) {
+            if (!region.bounds.disjoint(mapbrush.bounds)) {
+                // stats.regioned_brushes++;
+                // it = entity.mapbrushes.erase(it);
+                // logging::print("removed broosh\n");
                 continue;
             }
         }
+    }
 
-        contentflags_t contents = mapbrush.contents;
-
-        if (qbsp_options.nodetail.value()) {
-            contents = contentflags_t::make(contents.flags & (~EWT_CFLAG_DETAIL));
+    if (!hullnum.value_or(0)) {
+        if (src.epairs.get_int("_super_detail")) {
+            return std::nullopt;
         }
+    }
 
-        /* "origin" brushes always discarded beforehand */
-        Q_assert(!contents.is_origin());
+    contentflags_t contents = mapbrush.contents;
 
-        // per-brush settings
-        bool detail = false;
-        bool detail_illusionary = false;
-        bool detail_fence = false;
-        bool detail_wall = false;
+    if (qbsp_options.nodetail.value()) {
+        contents = contentflags_t::make(contents.flags & (~EWT_CFLAG_DETAIL));
+    }
 
-        // inherit the per-entity settings
-        detail |= all_detail;
-        detail_illusionary |= all_detail_illusionary;
-        detail_fence |= all_detail_fence;
-        detail_wall |= all_detail_wall;
+    /* "origin" brushes always discarded beforehand */
+    Q_assert(!contents.is_origin());
 
-        /* -omitdetail option omits all types of detail */
-        if (qbsp_options.omitdetail.value() && detail)
-            continue;
-        if ((qbsp_options.omitdetail.value() || qbsp_options.omitdetailillusionary.value()) && detail_illusionary)
-            continue;
-        if ((qbsp_options.omitdetail.value() || qbsp_options.omitdetailfence.value()) && detail_fence)
-            continue;
-        if ((qbsp_options.omitdetail.value() || qbsp_options.omitdetailwall.value()) && detail_wall)
-            continue;
-        if (qbsp_options.omitdetail.value() && contents.is_any_detail())
-            continue;
+    // per-brush settings
+    bool detail = false;
+    bool detail_illusionary = false;
+    bool detail_fence = false;
+    bool detail_wall = false;
 
-        /* turn solid brushes into detail, if we're in hull0 */
-        if (!hullnum.value_or(0) && contents.is_any_solid()) {
-            if (detail_illusionary) {
-                contents = contentflags_t::create_detail_illusionary_contents(contents);
-            } else if (detail_fence) {
-                contents = contentflags_t::create_detail_fence_contents(contents);
-            } else if (detail_wall) {
-                contents = contentflags_t::create_detail_wall_contents(contents);
-            } else if (detail) {
-                contents = contentflags_t::create_detail_solid_contents(contents);
-            }
-        }
+    // inherit the per-entity settings
+    detail |= all.detail;
+    detail_illusionary |= all.detail_illusionary;
+    detail_fence |= all.detail_fence;
+    detail_wall |= all.detail_wall;
 
-        /* func_detail_illusionary don't exist in the collision hull
-         * (or bspx export) except for Q2, who needs them in there */
-        if (hullnum.value_or(0) && detail_illusionary) {
-            continue;
+    /* -omitdetail option omits all types of detail */
+    if (qbsp_options.omitdetail.value() && detail)
+        return std::nullopt;
+    if ((qbsp_options.omitdetail.value() || qbsp_options.omitdetailillusionary.value()) && detail_illusionary)
+        return std::nullopt;
+    if ((qbsp_options.omitdetail.value() || qbsp_options.omitdetailfence.value()) && detail_fence)
+        return std::nullopt;
+    if ((qbsp_options.omitdetail.value() || qbsp_options.omitdetailwall.value()) && detail_wall)
+        return std::nullopt;
+    if (qbsp_options.omitdetail.value() && contents.is_any_detail())
+        return std::nullopt;
+
+    /* turn solid brushes into detail, if we're in hull0 */
+    if (!hullnum.value_or(0) && contents.is_any_solid()) {
+        if (detail_illusionary) {
+            contents = contentflags_t::create_detail_illusionary_contents(contents);
+        } else if (detail_fence) {
+            contents = contentflags_t::create_detail_fence_contents(contents);
+        } else if (detail_wall) {
+            contents = contentflags_t::create_detail_wall_contents(contents);
+        } else if (detail) {
+            contents = contentflags_t::create_detail_solid_contents(contents);
         }
+    }
 
-        /*
-         * "clip" brushes don't show up in the draw hull, but we still want to
-         * include them in the model bounds so collision detection works
-         * correctly.
-         */
-        if (hullnum.has_value() && contents.is_clip()) {
-            if (hullnum.value() == 0) {
-                if (auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped)) {
-                    dst.bounds += brush->bounds;
-                }
-                continue;
-                // for hull1, 2, etc., convert clip to CONTENTS_SOLID
-            } else {
-                contents = contentflags_t::make(EWT_VISCONTENTS_SOLID);
-            }
+    /* func_detail_illusionary don't exist in the collision hull
+     * (or bspx export) except for Q2, who needs them in there */
+    if (hullnum.value_or(0) && detail_illusionary) {
+        return std::nullopt;
+    }
+
+    /*
+     * "clip" brushes don't show up in the draw hull, but we still want to
+     * include them in the model bounds so collision detection works
+     * correctly; the caller handles that.
+     */
+    if (hullnum.has_value() && contents.is_clip()) {
+        if (hullnum.value() == 0) {
+            return contents;
+            // for hull1, 2, etc., convert clip to CONTENTS_SOLID
+        } else {
+            contents = contentflags_t::make(EWT_VISCONTENTS_SOLID);
         }
+    }
 
-        /* "hint" brushes don't affect the collision hulls */
-        if (mapbrush.is_hint) {
-            if (hullnum.value_or(0)) {
-                continue;
-            }
-            contents = contentflags_t::make(EWT_VISCONTENTS_EMPTY);
+    /* "hint" brushes don't affect the collision hulls */
+    if (mapbrush.is_hint) {
+        if (hullnum.value_or(0)) {
+            return std::nullopt;
         }
+        contents = contentflags_t::make(EWT_VISCONTENTS_EMPTY);
+    }
+
+    /* entities in some games never use water merging */
+    if (!map.is_world_entity(dst) &&
+        !(qbsp_options.target_game->allow_contented_bmodels || qbsp_options.bmodelcontents.value())) {
+        // bmodels become solid in Q1
 
-        /* entities in some games never use water merging */
-        if (!map.is_world_entity(dst) &&
-            !(qbsp_options.target_game->allow_contented_bmodels || qbsp_options.bmodelcontents.value())) {
-            // bmodels become solid in Q1
+        // to allow use of _mirrorinside, we'll set it to detail fence, which will get remapped back
+        // to CONTENTS_SOLID at export. (we wouldn't generate inside faces if the content was CONTENTS_SOLID
+        // from the start.)
+        contents = contentflags_t::create_detail_fence_contents(contentflags_t::make(EWT_VISCONTENTS_SOLID));
+    }
 
-            // to allow use of _mirrorinside, we'll set it to detail fence, which will get remapped back
-            // to CONTENTS_SOLID at export. (we wouldn't generate inside faces if the content was CONTENTS_SOLID
-            // from the start.)
-            contents = contentflags_t::create_detail_fence_contents(contentflags_t::make(EWT_VISCONTENTS_SOLID));
+    if (hullnum.value_or(0)) {
+        /* nonsolid brushes don't show up in clipping hulls */
+        if (!contents.is_any_solid() && !contents.is_sky() && !contents.is_fence()) {
+            return std::nullopt;
         }
 
-        if (hullnum.value_or(0)) {
-            /* nonsolid brushes don't show up in clipping hulls */
-            if (!contents.is_any_solid() && !contents.is_sky() && !contents.is_fence()) {
-                continue;
-            }
+        /* all used brushes are solid in the collision hulls */
+        contents = contentflags_t::make(EWT_VISCONTENTS_SOLID);
+    }
 
-            /* all used brushes are solid in the collision hulls */
-            contents = contentflags_t::make(EWT_VISCONTENTS_SOLID);
+    // fixme-brushbsp: function calls above can override the values below
+    // so we have to re-set them to be sure they stay what the mapper intended..
+    if (mapbrush.contents.mirror_inside())
+        contents.set_mirrored(mapbrush.contents.mirror_inside());
+    if (mapbrush.contents.clips_same_type())
+        contents.set_clips_same_type(mapbrush.contents.clips_same_type());
+
+    return contents;
+}
+
+static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, content_stats_t &stats,
+    bspbrush_t::container &brushes, logging::percent_clock &clock, size_t &num_clipped)
+{
+    clock.max += src.mapbrushes.size();
+
+    const entity_detail_t all = EntityDetail(src);
+
+    for (auto &mapbrush : src.mapbrushes) {
+        clock();
+
+        auto contents = BrushContents(dst, src, all, mapbrush, hullnum);
+
+        if (!contents) {
+            continue;
         }
 
-        // fixme-brushbsp: function calls above can override the values below
-        // so we have to re-set them to be sure they stay what the mapper intended..
-        if (mapbrush.contents.mirror_inside())
-            contents.set_mirrored(mapbrush.contents.mirror_inside());
-        if (mapbrush.contents.clips_same_type())
-            contents.set_clips_same_type(mapbrush.contents.clips_same_type());
+        // clip brushes only add to the bounds of hull 0
+        if (hullnum.has_value() && hullnum.value() == 0 && contents->is_clip()) {
+            if (auto brush = LoadBrush(src, mapbrush, *contents, hullnum, num_clipped)) {
+                dst.bounds += brush->bounds;
+            }
+            continue;
+        }
 
-        auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped);
+        auto brush = LoadBrush(src, mapbrush, *contents, hullnum, num_clipped);
 
         if (!brush) {
             continue;
@@ -919,6 +970,55 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
     }
 }
 
+/*
+============
+Brush_ReserveHullPlanes
+
+Creates the expanded planes that Brush_LoadEntity will need for the given
+collision hull, so the hulls can then be built in parallel without the plane
+list depending on task order (see CreateHulls).
+============
+*/
+static void Brush_ReserveHullPlanes(
+    const mapentity_t &dst, const mapentity_t &src, hull_index_t hullnum, const aabb3d &hull)
+{
+    const entity_detail_t all = EntityDetail(src);
+
+    for (auto &mapbrush : src.mapbrushes) {
+        if (!BrushContents(dst, src, all, mapbrush, hullnum)) {
+            continue;
+        }
+
+        for (auto &mapface : mapbrush.faces) {
+            if (mapface.get_texinfo().flags.no_expand) {
+                continue;
+            }
+            map.add_or_find_plane(ExpandPlaneForHull(mapface.get_plane(), hull));
+        }
+    }
+}
+
+void Brush_ReserveHullPlanes(const mapentity_t &entity, hull_index_t hullnum)
+{
+    Q_assert(hullnum.value_or(0));
+
+    auto hulls = qbsp_options.target_game->get_hull_sizes();
+    Q_assert(hullnum < hulls.size());
+    auto &hull = *(hulls.begin() + hullnum.value());
+
+    Brush_ReserveHullPlanes(entity, entity, hullnum, hull);
+
+    if (map.is_world_entity(entity)) {
+        for (int i = 1; i < map.entities.size(); i++) {
+            const mapentity_t &source = map.entities.at(i);
+
+            if (IsWorldBrushEntity(source) || IsNonRemoveWorldBrushEntity(source)) {
+                Brush_ReserveHullPlanes(entity, source, hullnum, hull);
+            }
+        }
+    }
+}
+
 bool bspbrush_t::update_bounds(bool warn_on_failures)
 {
     this->bounds = {};
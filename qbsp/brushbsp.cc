@@ -24,6 +24,7 @@
 #include <climits>
 
 #include <common/log.hh>
+#include <common/parallel.hh>
 #include <qbsp/brush.hh>
 #include <qbsp/map.hh>
 #include <qbsp/portals.hh>
@@ -32,6 +33,7 @@
 
 #include <list>
 #include <atomic>
+#include <numeric>
 
 #include "tbb/task_group.h"
 
@@ -1254,7 +1256,7 @@ BrushBSP
 */
 void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &brushlist, tree_split_t split_type)
 {
-    logging::header(__func__);
+    logging::funcheader();
 
     // NOTE: entity bounds may include brushes that were deleted
     // from the brush list (e.g. clip brushes in Q1 hull 0 still need to affect the model/node bounds)
@@ -1434,119 +1436,266 @@ struct chopstats_t : logging::stat_tracker_t
     stat &c_from_split = register_stat("brushes created from the chompening");
 };
 
+// a brush on a chop list, tagged with the index of the input brush it was
+// carved from so the islands can be merged back in the original order
+struct chop_entry_t
+{
+    bspbrush_t::ptr brush;
+    size_t root;
+};
+
+using chop_list_t = std::list<chop_entry_t>;
+
+static chop_list_t MakeChopList(bspbrush_t::list &&brushes, size_t root)
+{
+    chop_list_t result;
+
+    for (auto &brush : brushes) {
+        result.push_back({std::move(brush), root});
+    }
+
+    return result;
+}
+
 /*
 =================
-ChopBrushes
+ChopBrush
 
-Carves any intersecting solid brushes into the minimum number
-of non-intersecting brushes.
+Chops the brush at b1_it against the brushes after it in the list.
+Brushes that are already past the scan aren't revisited; the fragments
+of a bitten b2 are spliced into its place and the scan resumes at them.
 
-Modifies the input list and may free destroyed brushes.
+Returns the next brush to chop.
 =================
 */
-void ChopBrushes(bspbrush_t::container &brushes, bool allow_fragmentation)
+static chop_list_t::iterator ChopBrush(
+    chop_list_t &list, chop_list_t::iterator b1_it, bool allow_fragmentation, chopstats_t &stats)
 {
-    size_t original_count = brushes.size();
-    logging::funcheader();
+    auto b2_it = std::next(b1_it);
 
-    // convert brush container to list, so we don't lose
-    // track of the original ptrs and so we can re-organize things
-    bspbrush_t::list list{std::make_move_iterator(brushes.begin()), std::make_move_iterator(brushes.end())};
+    while (b2_it != list.end()) {
+        auto &b1 = b1_it->brush;
+        auto &b2 = b2_it->brush;
 
-    // clear original list
-    brushes.clear();
+        if (BrushesDisjoint(*b1, *b2)) {
+            ++b2_it;
+            continue;
+        }
 
-    logging::percent_clock clock(list.size());
-    chopstats_t stats;
+        bspbrush_t::list sub, sub2;
+        size_t c1 = std::numeric_limits<size_t>::max(), c2 = c1;
 
-    decltype(list)::iterator b1_it = list.begin();
+        if (BrushGE(*b2, *b1)) {
+            sub = SubtractBrush(b1, b2);
+            if (sub.size() == 1 && sub.front() == b1) {
+                ++b2_it;
+                continue; // didn't really intersect
+            }
 
-newlist:
+            if (sub.empty()) { // b1 is swallowed by b2
+                stats.c_swallowed++;
+                return list.erase(b1_it); // continue after b1_it
+            }
+            c1 = sub.size();
+        }
 
-    if (!list.size()) {
-        // clear output since this is kind of an error...
-        brushes.clear();
-        return;
+        if (BrushGE(*b1, *b2)) {
+            sub2 = SubtractBrush(b2, b1);
+            if (sub2.size() == 1 && sub2.front() == b2) {
+                ++b2_it;
+                continue; // didn't really intersect
+            }
+            if (sub2.empty()) { // b2 is swallowed by b1
+                stats.c_swallowed++;
+                b2_it = list.erase(b2_it);
+                continue;
+            }
+            c2 = sub2.size();
+        }
+
+        if (sub.empty() && sub2.empty()) {
+            ++b2_it;
+            continue; // neither one can bite
+        }
+
+        // only accept if it didn't fragment
+        if (!allow_fragmentation && c1 > 1 && c2 > 1) {
+            ++b2_it;
+            continue;
+        }
+
+        if (c1 < c2) {
+            stats.c_from_split += sub.size();
+            auto root = b1_it->root;
+            auto before = list.erase(b1_it); // remove the current brush
+            list.splice(before, MakeChopList(std::move(sub), root)); // splice new list in place of where the brush was
+            return before; // continue after the new brushes
+        } else {
+            stats.c_from_split += sub2.size();
+            auto fragments = MakeChopList(std::move(sub2), b2_it->root);
+            auto first = fragments.begin();
+            list.splice(b2_it, fragments); // splice new brushes before b2_it
+            list.erase(b2_it); // remove b2_it
+            // b1 is unchanged, so the brushes before b2 don't need to be checked again
+            b2_it = first;
+        }
     }
 
-    decltype(list)::iterator next;
+    return std::next(b1_it);
+}
 
-    for (; b1_it != list.end(); b1_it = next) {
-        clock.max = list.size();
-        next = std::next(b1_it);
+/*
+=================
+FindChopIslands
 
-        auto &b1 = *b1_it;
+Groups brushes whose bounds overlap (directly or through other brushes)
+into islands, with a sweep and prune along the X axis. Chopping only ever
+produces fragments inside the bounds of the brush they came from, so
+islands can be chopped independently.
 
-        for (auto b2_it = next; b2_it != list.end(); b2_it++) {
-            auto &b2 = *b2_it;
+Returns the island index of each brush; islands are numbered in order of
+their first brush.
+=================
+*/
+static std::vector<size_t> FindChopIslands(const bspbrush_t::container &brushes, size_t &num_islands)
+{
+    const size_t count = brushes.size();
 
-            if (BrushesDisjoint(*b1, *b2)) {
-                continue;
-            }
+    std::vector<size_t> parent(count);
+    std::iota(parent.begin(), parent.end(), 0);
 
-            bspbrush_t::list sub, sub2;
-            size_t c1 = std::numeric_limits<size_t>::max(), c2 = c1;
+    auto find = [&](size_t i) {
+        while (parent[i] != i) {
+            i = parent[i] = parent[parent[i]];
+        }
+        return i;
+    };
 
-            if (BrushGE(*b2, *b1)) {
-                sub = SubtractBrush(b1, b2);
-                if (sub.size() == 1 && sub.front() == b1) {
-                    continue; // didn't really intersect
-                }
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(),
+        [&](size_t a, size_t b) { return brushes[a]->bounds.mins()[0] < brushes[b]->bounds.mins()[0]; });
 
-                if (sub.empty()) { // b1 is swallowed by b2
-                    b1_it = list.erase(b1_it); // continue after b1_it
-                    stats.c_swallowed++;
-                    goto newlist;
-                }
-                c1 = sub.size();
-            }
+    std::vector<size_t> active;
 
-            if (BrushGE(*b1, *b2)) {
-                sub2 = SubtractBrush(b2, b1);
-                if (sub2.size() == 1 && sub2.front() == b2) {
-                    continue; // didn't really intersect
-                }
-                if (sub2.empty()) { // b2 is swallowed by b1
-                    list.erase(b2_it);
-                    // continue where b1_it was
-                    stats.c_swallowed++;
-                    goto newlist;
+    for (size_t i : order) {
+        const aabb3d &bounds = brushes[i]->bounds;
+
+        // same test as BrushesDisjoint; touching brushes never chop each other
+        std::erase_if(active, [&](size_t a) { return brushes[a]->bounds.maxs()[0] <= bounds.mins()[0]; });
+
+        for (size_t a : active) {
+            if (!bounds.disjoint_or_touching(brushes[a]->bounds)) {
+                size_t ra = find(a), ri = find(i);
+
+                // keep the lowest index as the root
+                if (ra < ri) {
+                    parent[ri] = ra;
+                } else if (ri < ra) {
+                    parent[ra] = ri;
                 }
-                c2 = sub2.size();
             }
+        }
 
-            if (sub.empty() && sub2.empty()) {
-                continue; // neither one can bite
-            }
+        active.push_back(i);
+    }
 
-            // only accept if it didn't fragment
-            if (!allow_fragmentation && c1 > 1 && c2 > 1) {
-                continue;
-            }
+    std::vector<size_t> island(count), root_island(count, std::numeric_limits<size_t>::max());
+    num_islands = 0;
 
-            if (c1 < c2) {
-                stats.c_from_split += sub.size();
-                auto before = list.erase(b1_it); // remove the current brush, go back one
-                list.splice(before, sub); // splice new list in place of where the brush was
-                b1_it = before; // restart list with the new brushes
-                goto newlist;
-            } else {
-                stats.c_from_split += sub2.size();
-                list.splice(b2_it, sub2); // splice new brushes before b2_it
-                list.erase(b2_it); // remove b2_it
-                // continue where b1_it left off
-                goto newlist;
+    for (size_t i = 0; i < count; i++) {
+        size_t &id = root_island[find(i)];
+
+        if (id == std::numeric_limits<size_t>::max()) {
+            id = num_islands++;
+        }
+
+        island[i] = id;
+    }
+
+    return island;
+}
+
+/*
+=================
+ChopBrushes
+
+Carves any intersecting solid brushes into the minimum number
+of non-intersecting brushes.
+
+Islands of overlapping brushes are chopped in parallel; the result is
+the same as chopping the whole list in order.
+
+Modifies the input list and may free destroyed brushes.
+=================
+*/
+void ChopBrushes(bspbrush_t::container &brushes, bool allow_fragmentation)
+{
+    size_t original_count = brushes.size();
+    logging::funcheader();
+
+    if (!brushes.size()) {
+        return;
+    }
+
+    size_t num_islands = 1;
+    std::vector<size_t> island(brushes.size(), 0);
+
+    if (!qbsp_options.debugchopnoislands.value()) {
+        island = FindChopIslands(brushes, num_islands);
+    }
+
+    // convert brush container to lists, so we don't lose
+    // track of the original ptrs and so we can re-organize things
+    std::vector<chop_list_t> lists(num_islands);
+
+    for (size_t i = 0; i < brushes.size(); i++) {
+        lists[island[i]].push_back({std::move(brushes[i]), i});
+    }
+
+    // clear original list
+    brushes.clear();
+
+    logging::percent_clock clock(original_count);
+    chopstats_t stats;
+
+    logging::parallel_for(static_cast<size_t>(0), lists.size(), [&](size_t i) {
+        chop_list_t &list = lists[i];
+        size_t list_count = list.size();
+
+        if (list_count > 1) {
+            for (auto b1_it = list.begin(); b1_it != list.end();) {
+                b1_it = ChopBrush(list, b1_it, allow_fragmentation, stats);
             }
         }
 
+        clock.count += list_count - 1;
         clock();
+    });
+
+    // merge the islands back; each island is already in input order, and
+    // fragments take the place of the brush they were carved from
+    std::vector<chop_entry_t> merged;
+
+    for (auto &list : lists) {
+        std::move(list.begin(), list.end(), std::back_inserter(merged));
+    }
+
+    std::stable_sort(
+        merged.begin(), merged.end(), [](const chop_entry_t &a, const chop_entry_t &b) { return a.root < b.root; });
+
+    if (merged.empty()) {
+        // clear output since this is kind of an error...
+        return;
     }
 
     // since chopbrushes can remove stuff, exact counts are hard...
-    clock.max = list.size();
     clock.print();
 
-    brushes.insert(brushes.begin(), std::make_move_iterator(list.begin()), std::make_move_iterator(list.end()));
+    brushes.reserve(merged.size());
+    for (auto &entry : merged) {
+        brushes.push_back(std::move(entry.brush));
+    }
     logging::print(logging::flag::STAT, "chopped {} brushes into {}\n", original_count, brushes.size());
 
     if (qbsp_options.debugchop.value()) {
@@ -27,8 +27,11 @@
 
 #include <common/log.hh>
 #include <common/parallel.hh>
+#include <algorithm>
 #include <atomic>
 #include <mutex>
+#include <numeric>
+#include <span>
 
 /*
 
@@ -275,6 +278,82 @@ struct csg_stats
     std::atomic<int> postcsgfaces{};
 };
 
+/*
+==================
+FindOverlappingBrushes
+
+Broad phase for CSGFaces. Sweep and prune along the axis with the largest
+extent; for each brush, collects the indices of the other brushes whose
+bounds touch or overlap it, in ascending order.
+==================
+*/
+brush_overlaps_t FindOverlappingBrushes(const bspbrush_t::container &brushes)
+{
+    const size_t count = brushes.size();
+
+    aabb3d total;
+    for (auto &brush : brushes) {
+        total += brush->bounds;
+    }
+
+    size_t axis = 0;
+    for (size_t j = 1; j < 3; j++) {
+        if (total.size()[j] > total.size()[axis]) {
+            axis = j;
+        }
+    }
+    const size_t axis1 = (axis + 1) % 3, axis2 = (axis + 2) % 3;
+
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return brushes[a]->bounds.mins()[axis] < brushes[b]->bounds.mins()[axis];
+    });
+
+    // both directions of every overlapping pair, as (brush, candidate)
+    std::vector<std::pair<size_t, size_t>> pairs;
+    std::vector<size_t> active;
+
+    for (size_t i : order) {
+        const aabb3d &bounds = brushes[i]->bounds;
+
+        // drop brushes that end before this one starts; inclusive, so touching
+        // bounds are still candidates
+        std::erase_if(active, [&](size_t a) { return brushes[a]->bounds.maxs()[axis] < bounds.mins()[axis]; });
+
+        for (size_t a : active) {
+            const aabb3d &other = brushes[a]->bounds;
+
+            if (bounds.mins()[axis1] > other.maxs()[axis1] || bounds.maxs()[axis1] < other.mins()[axis1] ||
+                bounds.mins()[axis2] > other.maxs()[axis2] || bounds.maxs()[axis2] < other.mins()[axis2]) {
+                continue;
+            }
+
+            pairs.emplace_back(i, a);
+            pairs.emplace_back(a, i);
+        }
+
+        active.push_back(i);
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+
+    brush_overlaps_t result;
+    result.offsets.resize(count + 1);
+    result.indices.reserve(pairs.size());
+
+    size_t p = 0;
+    for (size_t i = 0; i < count; i++) {
+        result.offsets[i] = result.indices.size();
+        for (; p < pairs.size() && pairs[p].first == i; p++) {
+            result.indices.push_back(pairs[p].second);
+        }
+    }
+    result.offsets[count] = result.indices.size();
+
+    return result;
+}
+
 /*
 ==================
 CSGFaces
@@ -323,6 +402,8 @@ bspbrush_t::container CSGFaces(bspbrush_t::container brushes)
 
     csg_stats stats{};
 
+    const brush_overlaps_t overlaps = FindOverlappingBrushes(brushes);
+
     // output vector for the parallel_for
     bspbrush_t::container brushvec_outsides;
     brushvec_outsides.resize(brushes.size());
@@ -334,6 +415,9 @@ bspbrush_t::container CSGFaces(bspbrush_t::container brushes)
      *   clipbrush => the brush we are clipping against
      *
      * The output of this is a face list for each brush called "outside"
+     *
+     * Only the brushes whose bounds touch `brush` are visited, in their
+     * original order, so the result matches testing against every brush.
      */
     logging::parallel_for(static_cast<size_t>(0), brushes.size(), [&](size_t i) {
         bspbrush_t::ptr &brush = brushes[i];
@@ -344,34 +428,20 @@ bspbrush_t::container CSGFaces(bspbrush_t::container brushes)
         std::vector<side_t> outside;
         std::swap(outside, brush_result->sides);
 
-        bool overwrite = false;
+        for (size_t j : overlaps.of(i)) {
+            const bspbrush_t::ptr &clipbrush = brushes[j];
+
+            /* Brushes further down the list override earlier ones.
+             * This is only relevant for choosing a winner when there's two
+             * overlapping faces.
+             */
+            const bool overwrite = j > i;
 
-        for (auto &clipbrush : brushes) {
-            if (&brush == &clipbrush) {
-                /* Brushes further down the list override earlier ones.
-                 * This is only relevant for choosing a winner when there's two
-                 * overlapping faces.
-                 */
-                overwrite = true;
-                continue;
-            }
             if (!brush->contents.equals(qbsp_options.target_game, clipbrush->contents)) {
                 /* Only consider clipping equal contents against each other */
                 continue;
             }
 
-            /* check bounding box first */
-            // TODO: is this a disjoint check? brush->bounds.disjoint(clipbrush->bounds)?
-            int j;
-            for (j = 0; j < 3; j++) {
-                if (brush->bounds.mins()[j] > clipbrush->bounds.maxs()[j])
-                    break;
-                if (brush->bounds.maxs()[j] < clipbrush->bounds.mins()[j])
-                    break;
-            }
-            if (j < 3)
-                continue;
-
             // divide faces by the planes of the new brush
             std::vector<side_t> inside;
 
@@ -30,6 +30,7 @@
 #include <utility>
 #include <optional>
 #include <fstream>
+#include <mutex>
 
 #include <qbsp/brush.hh>
 #include <qbsp/map.hh>
@@ -44,6 +45,7 @@
 #include <common/mapfile.hh>
 
 #include <pareto/spatial_map.h>
+#include <tbb/concurrent_unordered_map.h>
 
 mapdata_t map;
 
@@ -52,10 +54,39 @@ mapplane_t::mapplane_t(const qbsp_plane_t &copy)
 {
 }
 
+/*
+ * Epsilon-aware plane index.
+ *
+ * Planes are bucketed by their (normal, dist) quantized to cells a few epsilons
+ * wide; a lookup accepts anything within half an epsilon, so it only has to
+ * probe the cells its box overlaps (usually one or two, at most 16).
+ *
+ * Lookups don't take any locks. Inserting takes the stripe locks for every cell
+ * that the new plane (or its flip, which is inserted with it) could be found
+ * from, so two tasks adding nearly-equal planes at the same time are serialized
+ * and only one of them gets added.
+ */
 struct planehash_t
 {
+    using cell_t = std::array<int64_t, 4>;
+
+    struct cell_hash_t
+    {
+        size_t operator()(const cell_t &cell) const noexcept
+        {
+            uint64_t h = 0;
+            for (int64_t v : cell) {
+                h = (h ^ static_cast<uint64_t>(v)) * 0x9E3779B97F4A7C15ull;
+            }
+            return static_cast<size_t>(h ^ (h >> 32));
+        }
+    };
+
     // planes indices (into the `planes` vector)
-    pareto::spatial_map<double, 4, size_t> hash;
+    tbb::concurrent_unordered_multimap<cell_t, size_t, cell_hash_t> cells;
+
+    static constexpr size_t NUM_STRIPES = 256;
+    std::array<std::mutex, NUM_STRIPES> stripes;
 };
 
 struct vertexhash_t
@@ -70,52 +101,179 @@ mapdata_t::mapdata_t()
 {
 }
 
-// add the specified plane to the list
-size_t mapdata_t::add_plane(const qplane3d &plane)
+constexpr double HALF_NORMAL_EPSILON = NORMAL_EPSILON * 0.5;
+constexpr double HALF_DIST_EPSILON = DIST_EPSILON * 0.5;
+
+// cell size per dimension; larger than the lookup box so that most lookups
+// don't straddle a cell boundary
+constexpr std::array<double, 4> PLANE_CELL_SIZE{
+    NORMAL_EPSILON * 4, NORMAL_EPSILON * 4, NORMAL_EPSILON * 4, DIST_EPSILON * 4};
+
+// calls fn for each cell that the lookup box around `plane` overlaps
+template<typename F>
+static void ForEachPlaneCell(const qplane3d &plane, F &&fn)
 {
-    planes.emplace_back(plane);
-    planes.emplace_back(-plane);
+    const std::array<double, 4> key{plane.normal[0], plane.normal[1], plane.normal[2], plane.dist};
+    const std::array<double, 4> half{HALF_NORMAL_EPSILON, HALF_NORMAL_EPSILON, HALF_NORMAL_EPSILON, HALF_DIST_EPSILON};
 
-    size_t positive_index = planes.size() - 2;
-    size_t negative_index = planes.size() - 1;
+    planehash_t::cell_t lo, hi;
 
-    auto &positive = planes[positive_index];
-    auto &negative = planes[negative_index];
+    for (size_t i = 0; i < 4; i++) {
+        lo[i] = static_cast<int64_t>(std::floor((key[i] - half[i]) / PLANE_CELL_SIZE[i]));
+        hi[i] = static_cast<int64_t>(std::floor((key[i] + half[i]) / PLANE_CELL_SIZE[i]));
+    }
 
-    size_t result;
+    planehash_t::cell_t cell;
 
-    if (positive.get_normal()[static_cast<int32_t>(positive.get_type()) % 3] < 0.0) {
-        std::swap(positive, negative);
-        result = negative_index;
-    } else {
-        result = positive_index;
+    for (cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++) {
+        for (cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++) {
+            for (cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++) {
+                for (cell[3] = lo[3]; cell[3] <= hi[3]; cell[3]++) {
+                    fn(cell);
+                }
+            }
+        }
     }
+}
 
-    plane_hash->hash.emplace(pareto::point<double, 4>{positive.get_normal()[0], positive.get_normal()[1],
-                                 positive.get_normal()[2], positive.get_dist()},
-        positive_index);
-    plane_hash->hash.emplace(pareto::point<double, 4>{negative.get_normal()[0], negative.get_normal()[1],
-                                 negative.get_normal()[2], negative.get_dist()},
-        negative_index);
+static planehash_t::cell_t PlaneCell(const qplane3d &plane)
+{
+    const std::array<double, 4> key{plane.normal[0], plane.normal[1], plane.normal[2], plane.dist};
+    planehash_t::cell_t cell;
+
+    for (size_t i = 0; i < 4; i++) {
+        cell[i] = static_cast<int64_t>(std::floor(key[i] / PLANE_CELL_SIZE[i]));
+    }
+
+    return cell;
+}
+
+/*
+=================
+FindPlane
+
+Lock-free; if several planes are within epsilon, the lowest-numbered
+(first-created) one is returned.
+=================
+*/
+static std::optional<size_t> FindPlane(mapdata_t &map, const qplane3d &plane)
+{
+    std::optional<size_t> result;
+
+    ForEachPlaneCell(plane, [&](const planehash_t::cell_t &cell) {
+        auto [first, last] = map.plane_hash->cells.equal_range(cell);
+
+        for (auto it = first; it != last; ++it) {
+            if (result && *result <= it->second) {
+                continue;
+            }
+
+            const mapplane_t &candidate = map.planes[it->second];
+
+            if (fabs(candidate.get_normal()[0] - plane.normal[0]) <= HALF_NORMAL_EPSILON &&
+                fabs(candidate.get_normal()[1] - plane.normal[1]) <= HALF_NORMAL_EPSILON &&
+                fabs(candidate.get_normal()[2] - plane.normal[2]) <= HALF_NORMAL_EPSILON &&
+                fabs(candidate.get_dist() - plane.dist) <= HALF_DIST_EPSILON) {
+                result = it->second;
+            }
+        }
+    });
 
     return result;
 }
 
-std::optional<size_t> mapdata_t::find_plane_nonfatal(const qplane3d &plane)
+// holds the stripe locks needed to insert `plane` and its flip
+class plane_insert_lock_t
 {
-    constexpr double HALF_NORMAL_EPSILON = NORMAL_EPSILON * 0.5;
-    constexpr double HALF_DIST_EPSILON = DIST_EPSILON * 0.5;
+    planehash_t &hash;
+    std::vector<size_t> stripes;
 
-    if (auto it = plane_hash->hash.find_intersection(
-            {plane.normal[0] - HALF_NORMAL_EPSILON, plane.normal[1] - HALF_NORMAL_EPSILON,
-                plane.normal[2] - HALF_NORMAL_EPSILON, plane.dist - HALF_DIST_EPSILON},
-            {plane.normal[0] + HALF_NORMAL_EPSILON, plane.normal[1] + HALF_NORMAL_EPSILON,
-                plane.normal[2] + HALF_NORMAL_EPSILON, plane.dist + HALF_DIST_EPSILON});
-        it != plane_hash->hash.end()) {
-        return it->second;
+public:
+    plane_insert_lock_t(planehash_t &hash, const qplane3d &plane)
+        : hash(hash)
+    {
+        auto add_stripe = [this](const planehash_t::cell_t &cell) {
+            stripes.push_back(planehash_t::cell_hash_t{}(cell) % planehash_t::NUM_STRIPES);
+        };
+
+        ForEachPlaneCell(plane, add_stripe);
+        ForEachPlaneCell(-plane, add_stripe);
+
+        // always lock in the same order
+        std::sort(stripes.begin(), stripes.end());
+        stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+
+        for (size_t stripe : stripes) {
+            hash.stripes[stripe].lock();
+        }
     }
 
-    return std::nullopt;
+    ~plane_insert_lock_t()
+    {
+        for (auto it = stripes.rbegin(); it != stripes.rend(); ++it) {
+            hash.stripes[*it].unlock();
+        }
+    }
+};
+
+/*
+=================
+AppendPlane
+
+Adds `plane` and its flip to the list, but not to the hash; returns the
+index of `plane`.
+=================
+*/
+static size_t AppendPlane(mapdata_t &map, const qplane3d &plane)
+{
+    // the pair is allocated in one go so it's contiguous, even with other
+    // tasks adding planes at the same time
+    auto positive_it = map.planes.grow_by({mapplane_t(plane), mapplane_t(-plane)});
+
+    size_t positive_index = positive_it - map.planes.begin();
+    size_t negative_index = positive_index + 1;
+
+    auto &positive = map.planes[positive_index];
+    auto &negative = map.planes[negative_index];
+
+    if (positive.get_normal()[static_cast<int32_t>(positive.get_type()) % 3] < 0.0) {
+        std::swap(positive, negative);
+        return negative_index;
+    }
+
+    return positive_index;
+}
+
+/*
+=================
+AddPlane_Locked
+
+the plane_insert_lock_t for `plane` must be held by the caller.
+=================
+*/
+static size_t AddPlane_Locked(mapdata_t &map, const qplane3d &plane)
+{
+    size_t result = AppendPlane(map, plane);
+    size_t positive_index = result & ~1;
+    size_t negative_index = positive_index + 1;
+
+    // only published once the planes are filled in
+    map.plane_hash->cells.emplace(PlaneCell(map.planes[positive_index]), positive_index);
+    map.plane_hash->cells.emplace(PlaneCell(map.planes[negative_index]), negative_index);
+
+    return result;
+}
+
+// add the specified plane to the list
+size_t mapdata_t::add_plane(const qplane3d &plane)
+{
+    plane_insert_lock_t lock(*plane_hash, plane);
+    return AddPlane_Locked(*this, plane);
+}
+
+std::optional<size_t> mapdata_t::find_plane_nonfatal(const qplane3d &plane)
+{
+    return FindPlane(*this, plane);
 }
 
 // find the specified plane in the list if it exists. throws
@@ -133,11 +291,24 @@ size_t mapdata_t::find_plane(const qplane3d &plane)
 // return a new one
 size_t mapdata_t::add_or_find_plane(const qplane3d &plane)
 {
-    if (auto index = find_plane_nonfatal(plane)) {
+    if (auto index = FindPlane(*this, plane)) {
+        return *index;
+    }
+
+    // while frozen, the new plane is only seen by the task that asked for it;
+    // see frozen_plane_count
+    if (frozen_plane_count) {
+        return AppendPlane(*this, plane);
+    }
+
+    plane_insert_lock_t lock(*plane_hash, plane);
+
+    // another task may have added it before we got the lock
+    if (auto index = FindPlane(*this, plane)) {
         return *index;
     }
 
-    return add_plane(plane);
+    return AddPlane_Locked(*this, plane);
 }
 
 const qbsp_plane_t &mapdata_t::get_plane(size_t pnum)
@@ -23,6 +23,7 @@
 
 #include <common/log.hh>
 #include <common/ostream.hh>
+#include <common/pipeline.hh>
 #include <common/prtfile.hh>
 #include <qbsp/map.hh>
 #include <qbsp/portals.hh>
@@ -213,7 +214,18 @@ static void WritePortalfile(node_t *headnode, portal_state_t &state)
         WritePTR2ClusterMapping_r(headnode, portalFile);
     }
 
-    WritePortalfile(name, portalFile, qbsp_options.target_version, state.uses_detail, qbsp_options.forceprt1.value());
+    // if vis runs in this process, it gets the portals in memory instead
+    pipeline::handoff_t *handoff = pipeline::current();
+
+    if (!handoff || handoff->write_prt) {
+        WritePortalfile(
+            name, portalFile, qbsp_options.target_version, state.uses_detail, qbsp_options.forceprt1.value());
+    }
+
+    if (handoff) {
+        pipeline::give_prt(name, LoadPrtFile(std::move(portalFile), qbsp_options.target_version, state.uses_detail,
+                                     qbsp_options.forceprt1.value()));
+    }
 }
 
 /*
@@ -21,6 +21,7 @@
 
 #include <cstring>
 #include <algorithm>
+#include <unordered_map>
 
 #include <common/log.hh>
 #include <common/aabb.hh>
@@ -44,6 +45,8 @@
 
 #include <fmt/chrono.h>
 
+#include <common/parallel.hh>
+
 namespace settings
 {
 bool wadpath::operator<(const wadpath &other) const
@@ -504,6 +507,10 @@ qbsp_settings::qbsp_settings()
       outsidedebug{this, "outsidedebug", false, &debugging_group,
           "write a .map after outside filling showing non-visible brush sides"},
       debugchop{this, "debugchop", false, &debugging_group, "write a .map after ChopBrushes"},
+      debugchopnoislands{this, "debugchopnoislands", false, &debugging_group,
+          "chop all brushes as one list, instead of splitting them into islands chopped in parallel"},
+      debugserialhulls{this, "debugserialhulls", false, &debugging_group,
+          "build the collision hulls one entity at a time, without reserving their planes first"},
       debugleak{this, "debugleak", false, &debugging_group, "write more diagnostic files for debugging leaks"},
       debugbspbrushes{this, "debugbspbrushes", false, &debugging_group,
           "save bsp brushes after BrushBSP to a .map, for visualizing BSP splits"},
@@ -1010,14 +1017,17 @@ static bool ShouldGenerateClipnodes(mapentity_t &entity, hull_index_t hullnum)
 /*
 ===============
 ProcessEntity
+
+For the collision hulls, the finished tree is returned instead of being
+exported, so the caller can write clipnodes in a fixed order.
 ===============
 */
-static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
+static std::unique_ptr<tree_t> ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 {
     /* No map brushes means non-bmodel entity.
        We need to handle worldspawn containing no brushes, though. */
     if (!entity.mapbrushes.size() && !map.is_world_entity(entity)) {
-        return;
+        return nullptr;
     }
 
     /*
@@ -1025,7 +1035,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
      * worldspawn
      */
     if (IsWorldBrushEntity(entity) || IsNonRemoveWorldBrushEntity(entity))
-        return;
+        return nullptr;
 
     // for notriggermodels: if we have at least one trigger-like texture, do special trigger stuff
     bool discarded_trigger = !map.is_world_entity(entity) && qbsp_options.notriggermodels.value() && IsTrigger(entity);
@@ -1103,12 +1113,12 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
             entity.epairs.set("mins", fmt::to_string(entity.bounds.mins()));
             entity.epairs.set("maxs", fmt::to_string(entity.bounds.maxs()));
         }
-        return;
+        return nullptr;
     }
 
     // corner case, -omitdetail with all detail in an bmodel
     if (brushes.empty() && entity.bounds == aabb3d()) {
-        return;
+        return nullptr;
     }
 
     // _hulls key
@@ -1116,20 +1126,20 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
         // We still need to emit an empty tree otherwise hull 0 will point past
         // the clipnode array (FIXME?).
         bspbrush_t::container empty;
-        tree_t tree;
-        BrushBSP(tree, entity, empty, tree_split_t::FAST);
+        auto tree = std::make_unique<tree_t>();
+        BrushBSP(*tree, entity, empty, tree_split_t::FAST);
         if (hullnum.value_or(0)) {
-            ExportClipNodes(entity, tree.headnode, hullnum.value());
-        } else {
-            MakeTreePortals(tree); // needed to assign leaf bounds
-            ExportDrawNodes(entity, tree.headnode, map.bsp.dfaces.size());
+            return tree;
         }
-        return;
+        MakeTreePortals(*tree); // needed to assign leaf bounds
+        ExportDrawNodes(entity, tree->headnode, map.bsp.dfaces.size());
+        return nullptr;
     }
 
     // simpler operation for hulls
     if (hullnum.value_or(0)) {
-        tree_t tree;
+        auto result = std::make_unique<tree_t>();
+        tree_t &tree = *result;
         BrushBSP(tree, entity, brushes, tree_split_t::FAST);
         if (map.is_world_entity(entity) && !qbsp_options.nofill.value()) {
             // assume non-world bmodels are simple
@@ -1153,8 +1163,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
             }
             CountLeafs(tree.headnode);
         }
-        ExportClipNodes(entity, tree.headnode, hullnum.value());
-        return;
+        return result;
     }
 
     // full operation for collision (or main hull)
@@ -1317,6 +1326,7 @@ static void ProcessEntity(mapentity_t &entity, hull_index_t hullnum)
 
     ExportDrawNodes(entity, tree.headnode, entity.firstoutputfacenumber.value());
     FreeTreePortals(tree);
+    return nullptr;
 }
 
 /*
@@ -1519,6 +1529,33 @@ static void BSPX_CreateBrushList()
     map.exported_bspxbrushes = StringToVector(str.str());
 }
 
+/*
+=================
+HullLoggingMask
+
+the logging mask to use while processing this entity / hull combination
+=================
+*/
+static bitflags<logging::flag> HullLoggingMask(const mapentity_t &entity, hull_index_t hullnum)
+{
+    bool wants_logging = true;
+
+    // decide if we want to log this entity / hull combination
+    if (!map.is_world_entity(entity)) {
+        wants_logging = wants_logging && qbsp_options.logbmodels.value();
+    }
+    if (hullnum.value_or(0)) {
+        wants_logging = wants_logging && qbsp_options.loghulls.value();
+    }
+
+    if (!wants_logging) {
+        return logging::mask &
+               ~(bitflags<logging::flag>(logging::flag::STAT) | logging::flag::PROGRESS | logging::flag::CLOCK_ELAPSED);
+    }
+
+    return logging::mask;
+}
+
 /*
 =================
 CreateSingleHull
@@ -1534,28 +1571,117 @@ static void CreateSingleHull(hull_index_t hullnum)
 
     // for each entity in the map file that has geometry
     for (auto &entity : map.entities) {
-        bool wants_logging = true;
+        // update logging mask if requested
+        const auto prev_logging_mask = logging::mask;
+        logging::mask = HullLoggingMask(entity, hullnum);
 
-        // decide if we want to log this entity / hull combination
-        if (!map.is_world_entity(entity)) {
-            wants_logging = wants_logging && qbsp_options.logbmodels.value();
+        if (auto tree = ProcessEntity(entity, hullnum)) {
+            ExportClipNodes(entity, tree->headnode, hullnum.value());
         }
-        if (hullnum.value_or(0)) {
-            wants_logging = wants_logging && qbsp_options.loghulls.value();
+
+        // restore logging
+        logging::mask = prev_logging_mask;
+    }
+}
+
+/*
+=================
+MergeHullPlanes_r
+
+Swaps the planes in [first, last), which the hull tasks made without sharing
+them (see mapdata_t::frozen_plane_count), for the matching shared ones.
+=================
+*/
+static void MergeHullPlanes_r(
+    node_t *node, size_t first, size_t last, std::unordered_map<size_t, size_t> &merged)
+{
+    auto merge = [&](size_t &planenum) {
+        if (planenum < first || planenum >= last) {
+            return;
         }
 
-        // update logging mask if requested
-        const auto prev_logging_mask = logging::mask;
-        if (!wants_logging) {
-            logging::mask &= ~(
-                bitflags<logging::flag>(logging::flag::STAT) | logging::flag::PROGRESS | logging::flag::CLOCK_ELAPSED);
+        auto [it, inserted] = merged.try_emplace(planenum);
+
+        if (inserted) {
+            it->second = map.add_or_find_plane(map.planes[planenum]);
         }
 
-        ProcessEntity(entity, hullnum);
+        planenum = it->second;
+    };
+
+    if (node->volume) {
+        for (auto &side : node->volume->sides) {
+            merge(side.planenum);
+        }
+    }
+
+    if (auto *nodedata = node->get_nodedata()) {
+        merge(nodedata->planenum);
+        MergeHullPlanes_r(nodedata->children[0], first, last, merged);
+        MergeHullPlanes_r(nodedata->children[1], first, last, merged);
+    }
+}
+
+/*
+=================
+CreateClipHull
+
+Builds collision hull `hullnum` for every entity in parallel. The hulls of one
+entity can't overlap since they share the `visible` state on the entity's map
+faces, so the hulls themselves are built one after the other. Separate
+entities don't share anything: the planes they need are reserved by
+CreateHulls, and any others a task makes are its own until they're merged
+below, in entity order. So neither the task order nor -loghulls (which runs the
+same tasks one at a time) changes the .bsp.
+=================
+*/
+static void CreateClipHull(hull_index_t::value_type hullnum)
+{
+    logging::print("Processing hull {}...\n", hullnum);
+
+    std::vector<std::unique_ptr<tree_t>> trees(map.entities.size());
+
+    const size_t first_task_plane = map.planes.size();
+    map.frozen_plane_count = first_task_plane;
+
+    const auto prev_logging_mask = logging::mask;
+
+    if (qbsp_options.loghulls.value()) {
+        // one at a time, so each entity's log can be turned on or off
+        for (size_t i = 0; i < map.entities.size(); i++) {
+            logging::mask = HullLoggingMask(map.entities[i], hullnum);
+            trees[i] = ProcessEntity(map.entities[i], hullnum);
+            logging::mask = prev_logging_mask;
+        }
+    } else {
+        // hull logging is off (see HullLoggingMask), so the mask is the same
+        // for every task; set it once rather than from each of them.
+        logging::mask = HullLoggingMask(map.world_entity(), hullnum);
+
+        logging::parallel_for(static_cast<size_t>(0), map.entities.size(),
+            [&](size_t i) { trees[i] = ProcessEntity(map.entities[i], hullnum); });
 
-        // restore logging
         logging::mask = prev_logging_mask;
     }
+
+    const size_t last_task_plane = map.planes.size();
+    map.frozen_plane_count = std::nullopt;
+
+    std::unordered_map<size_t, size_t> merged;
+
+    for (auto &tree : trees) {
+        if (tree) {
+            MergeHullPlanes_r(tree->headnode, first_task_plane, last_task_plane, merged);
+        }
+    }
+
+    // export and free this hull before starting the next one
+    for (size_t i = 0; i < map.entities.size(); i++) {
+        if (trees[i]) {
+            ExportClipNodes(map.entities[i], trees[i]->headnode, hullnum);
+            trees[i].reset();
+        }
+    }
 }
 
 /*
@@ -1565,7 +1691,6 @@ CreateHulls
 */
 static void CreateHulls()
 {
-    /* create the hulls sequentially */
     auto hulls = qbsp_options.target_game->get_hull_sizes();
 
     // game has no hulls, so we have to export brush lists and stuff.
@@ -1574,15 +1699,37 @@ static void CreateHulls()
         return;
     }
 
-    // all the hulls
-    for (size_t i = 0; i < hulls.size(); i++) {
-        CreateSingleHull(i);
+    // hull 0 writes faces, leafs, etc. and is always built by itself
+    CreateSingleHull(0);
 
-        // only create hull 0 if fNoclip is set
-        if (qbsp_options.noclip.value()) {
-            break;
+    // only create hull 0 if fNoclip is set
+    if (qbsp_options.noclip.value()) {
+        return;
+    }
+
+    if (qbsp_options.debugserialhulls.value()) {
+        // the build from before the hulls were parallel, which creates and
+        // merges planes as it goes; the tests compare against it
+        for (size_t i = 1; i < hulls.size(); i++) {
+            CreateSingleHull(i);
+        }
+        return;
+    }
+
+    // the expanded hull planes are created up front, in the order the serial
+    // build creates them, so building the hulls in parallel doesn't change the
+    // planes a brush gets
+    for (size_t hullnum = 1; hullnum < hulls.size(); hullnum++) {
+        for (auto &entity : map.entities) {
+            if (!IsWorldBrushEntity(entity) && !IsNonRemoveWorldBrushEntity(entity)) {
+                Brush_ReserveHullPlanes(entity, hullnum);
+            }
         }
     }
+
+    for (size_t i = 1; i < hulls.size(); i++) {
+        CreateClipHull(i);
+    }
 }
 
 // Fill the BSP's `dtex` data
@@ -23,6 +23,7 @@
 #include <qbsp/map.hh>
 
 #include <common/log.hh>
+#include <common/pipeline.hh>
 #include <qbsp/qbsp.hh>
 
 #include <vector>
@@ -453,10 +454,17 @@ static void WriteBSPFile()
 
     qbsp_options.bsp_path.replace_extension("bsp");
 
-    WriteBSPFile(qbsp_options.bsp_path, &bspdata);
-    logging::print("Wrote {}\n", qbsp_options.bsp_path);
+    bspdata.file = qbsp_options.bsp_path;
+
+    // if vis/light run in this process, they get the .bsp in memory instead
+    if (!pipeline::current()) {
+        WriteBSPFile(qbsp_options.bsp_path, &bspdata);
+        logging::print("Wrote {}\n", qbsp_options.bsp_path);
+    }
 
     PrintBSPFileSizes(&bspdata);
+
+    pipeline::give_bsp(bspdata);
 }
 
 /*
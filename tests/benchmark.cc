@@ -141,6 +141,80 @@ TEST(benchmark, visWindings)
         FreeStackWinding(w1, stack);
         ankerl::nanobench::doNotOptimizeAway(stack);
     });
+
+    // 8 points is a typical portal winding
+    std::array<qvec3d, 8> points;
+    for (size_t i = 0; i < points.size(); i++) {
+        const double angle = i * (2.0 * Q_PI / points.size());
+        points[i] = {64.0 * cos(angle), 64.0 * sin(angle), 0.0};
+    }
+    const qplane3d plane(qv::normalize(qvec3d{1, 1, 0}), 8);
+
+    b.run("ClassifyPoints_Scalar (8 points)", [&]() {
+        double dists[8];
+        int sides[8], counts[3];
+        ClassifyPoints_Scalar(points.data(), points.size(), plane, dists, sides, counts);
+        ankerl::nanobench::doNotOptimizeAway(dists);
+        ankerl::nanobench::doNotOptimizeAway(counts);
+    });
+
+    b.run("ClassifyPoints (8 points)", [&]() {
+        double dists[8];
+        int sides[8], counts[3];
+        ClassifyPoints(points.data(), points.size(), plane, dists, sides, counts);
+        ankerl::nanobench::doNotOptimizeAway(dists);
+        ankerl::nanobench::doNotOptimizeAway(counts);
+    });
+
+    std::array<qplane3d, 8> separators;
+    for (size_t i = 0; i < separators.size(); i++) {
+        const double angle = i * (2.0 * Q_PI / separators.size());
+        separators[i] = qplane3d({cos(angle), 0, sin(angle)}, -48);
+    }
+
+    b.run("setup + 8x ClipStackWinding", [&]() {
+        visstats_t stats;
+        pstack_t stack;
+        for (int i = 0; i < 3; ++i)
+            stack.windings_used[i] = false;
+
+        auto *w1 = AllocStackWinding(stack);
+        w1->numpoints = 4;
+        w1->points[0] = {-32, 0, 32};
+        w1->points[1] = {32, 0, 32};
+        w1->points[2] = {32, 0, -32};
+        w1->points[3] = {-32, 0, -32};
+        w1->set_winding_sphere();
+
+        for (auto &sep : separators) {
+            w1 = ClipStackWinding(stats, w1, stack, sep);
+        }
+        ankerl::nanobench::doNotOptimizeAway(*w1);
+
+        FreeStackWinding(w1, stack);
+        ankerl::nanobench::doNotOptimizeAway(stack);
+    });
+
+    b.run("setup + ClipStackWindingToPlanes (8 planes)", [&]() {
+        visstats_t stats;
+        pstack_t stack;
+        for (int i = 0; i < 3; ++i)
+            stack.windings_used[i] = false;
+
+        auto *w1 = AllocStackWinding(stack);
+        w1->numpoints = 4;
+        w1->points[0] = {-32, 0, 32};
+        w1->points[1] = {32, 0, 32};
+        w1->points[2] = {32, 0, -32};
+        w1->points[3] = {-32, 0, -32};
+        w1->set_winding_sphere();
+
+        w1 = ClipStackWindingToPlanes(stats, w1, stack, separators.data(), separators.size());
+        ankerl::nanobench::doNotOptimizeAway(*w1);
+
+        FreeStackWinding(w1, stack);
+        ankerl::nanobench::doNotOptimizeAway(stack);
+    });
 }
 
 TEST(benchmark, vectorMath)
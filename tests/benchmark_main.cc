@@ -0,0 +1,301 @@
+/*
+ * benchmark [-runs n] [-json file] [-baseline file] [-threshold percent] [map...]
+ *
+ * Compiles each map in-process (qbsp, vis and light, handing the .bsp and .prt
+ * over in memory) and reports the time and number of heap allocations spent in
+ * each traced stage (BrushBSP, CSGFaces, MakeTreePortals, TJunc, CalcPortalVis,
+ * Direct Lighting, LightGrid, ...) as the median over the runs. Maps are relative
+ * to the testmaps directory; without any, a fixed corpus is used.
+ *
+ * -json writes the results so they can be used as a -baseline later. With
+ * -baseline, stages that got slower or allocate more than -threshold percent
+ * (default 10) compared to the baseline are listed, and the exit code is 1.
+ */
+
+#include <nanobench.h>
+
+#include <qbsp/qbsp.hh>
+#include <vis/vis.hh>
+#include <light/light.hh>
+#include <common/pipeline.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+#include <common/settings.hh>
+
+#include <testmaps.hh>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+
+// every allocation through the global operator new, on any thread
+static std::atomic_uint64_t allocations = 0;
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+static const std::vector<std::string> default_corpus{
+    "q1_rocks.map",
+    "q1_mountain.map",
+    "LibreQuake/lq1/maps/src/e3/e3m4.map",
+};
+
+struct stage_stats_t
+{
+    uint64_t ns = 0;
+    uint64_t allocations = 0;
+    uint64_t calls = 0;
+};
+
+// totals per stage name for one compile
+using stage_totals_t = std::map<std::string, stage_stats_t>;
+
+struct open_stage_t
+{
+    std::chrono::steady_clock::time_point start;
+    uint64_t allocations;
+};
+
+static stage_totals_t *current_totals;
+static std::mutex current_totals_mutex;
+
+// stages open and close on worker threads too (e.g. the per-entity stages
+// of qbsp's CreateClipHulls), so each thread keeps its own stack
+static thread_local std::vector<open_stage_t> open_stages;
+
+static void stage_callback(const std::string &name, bool entering)
+{
+    if (entering) {
+        open_stages.push_back({std::chrono::steady_clock::now(), allocations.load()});
+        return;
+    }
+
+    const open_stage_t opened = open_stages.back();
+    open_stages.pop_back();
+
+    // allocations are counted process-wide, so a stage running next to
+    // others on worker threads is charged for theirs as well
+    std::unique_lock lock(current_totals_mutex);
+
+    // nested stages count towards their parents as well
+    stage_stats_t &stats = (*current_totals)[name];
+    stats.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - opened.start)
+                    .count();
+    stats.allocations += allocations.load() - opened.allocations;
+    stats.calls++;
+}
+
+static void compile_map(const fs::path &map_path, const fs::path &bsp_path)
+{
+    const fs::path wal_metadata_path = fs::path(testmaps_dir) / "q2_wal_metadata";
+
+    pipeline::scope pipeline;
+
+    InitQBSP(std::vector<std::string>{
+        "", "-noverbose", "-path", wal_metadata_path.string(), map_path.string(), bsp_path.string()});
+    ProcessFile();
+    logging::close();
+
+    vis_main(std::vector<std::string>{"", "-noverbose", bsp_path.string()});
+    light_main(std::vector<std::string>{
+        "", "-noverbose", "-nodefaultpaths", "-path", wal_metadata_path.string(), bsp_path.string()});
+
+    pipeline.finish();
+}
+
+template<typename T>
+static T median(std::vector<T> values)
+{
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+static Json::Value benchmark_map(const std::string &map, int runs)
+{
+    const fs::path map_path = fs::path(testmaps_dir) / map;
+    const fs::path bsp_path = fs::temp_directory_path() / fs::path(map).filename().replace_extension("bsp");
+
+    std::vector<stage_totals_t> totals_per_run;
+
+    logging::set_stage_callback(stage_callback);
+
+    ankerl::nanobench::Bench bench;
+    bench.title(map).unit("compile").epochs(runs).epochIterations(1).warmup(0).run("qbsp + vis + light", [&] {
+        current_totals = &totals_per_run.emplace_back();
+        compile_map(map_path, bsp_path);
+    });
+
+    logging::set_stage_callback(nullptr);
+
+    std::map<std::string, std::vector<stage_stats_t>> runs_per_stage;
+    for (auto &totals : totals_per_run) {
+        for (auto &[name, stats] : totals) {
+            runs_per_stage[name].push_back(stats);
+        }
+    }
+
+    Json::Value j(Json::objectValue);
+    j["ns"] = static_cast<Json::UInt64>(
+        bench.results().back().median(ankerl::nanobench::Result::Measure::elapsed) * 1'000'000'000.0);
+    j["stages"] = Json::Value(Json::objectValue);
+
+    fmt::print("\n| {:>15} | {:>12} | {:>5} | stage\n", "ns/op", "allocs/op", "calls");
+    fmt::print("|----------------:|-------------:|------:|:------\n");
+
+    for (auto &[name, stats] : runs_per_stage) {
+        std::vector<uint64_t> ns, allocs;
+        for (auto &run : stats) {
+            ns.push_back(run.ns);
+            allocs.push_back(run.allocations);
+        }
+
+        auto &stage = (j["stages"][name] = Json::Value(Json::objectValue));
+        stage["ns"] = static_cast<Json::UInt64>(median(ns));
+        stage["allocations"] = static_cast<Json::UInt64>(median(allocs));
+        stage["calls"] = static_cast<Json::UInt64>(stats.front().calls);
+
+        fmt::print("| {:>15} | {:>12} | {:>5} | `{}`\n", median(ns), median(allocs), stats.front().calls, name);
+    }
+
+    fs::remove(bsp_path);
+
+    return j;
+}
+
+// returns the number of regressions
+static int compare_to_baseline(const Json::Value &results, const Json::Value &baseline, double threshold)
+{
+    // stages this short are mostly noise
+    constexpr uint64_t min_ns = 1'000'000;
+
+    int regressions = 0;
+
+    auto check = [&](const std::string &what, uint64_t base, uint64_t now, uint64_t floor) {
+        if (base < floor || now <= base * (1.0 + threshold)) {
+            return;
+        }
+
+        fmt::print("REGRESSION: {}: {} -> {} (+{:.1f}%)\n", what, base, now, (now / (double)base - 1.0) * 100.0);
+        regressions++;
+    };
+
+    for (auto &map : results["maps"].getMemberNames()) {
+        if (!baseline["maps"].isMember(map)) {
+            fmt::print("{}: not in baseline\n", map);
+            continue;
+        }
+
+        const Json::Value &now_map = results["maps"][map];
+        const Json::Value &base_map = baseline["maps"][map];
+
+        check(fmt::format("{} ns", map), base_map["ns"].asUInt64(), now_map["ns"].asUInt64(), min_ns);
+
+        for (auto &stage : now_map["stages"].getMemberNames()) {
+            if (!base_map["stages"].isMember(stage)) {
+                continue;
+            }
+
+            const Json::Value &now_stage = now_map["stages"][stage];
+            const Json::Value &base_stage = base_map["stages"][stage];
+
+            check(fmt::format("{}: {} ns", map, stage), base_stage["ns"].asUInt64(), now_stage["ns"].asUInt64(),
+                min_ns);
+            check(fmt::format("{}: {} allocations", map, stage), base_stage["allocations"].asUInt64(),
+                now_stage["allocations"].asUInt64(), 1);
+        }
+    }
+
+    return regressions;
+}
+
+int main(int argc, char **argv)
+{
+    logging::preinitialize();
+
+    int runs = 3;
+    double threshold = 0.1;
+    std::optional<fs::path> json_path, baseline_path;
+    std::vector<std::string> maps;
+
+    for (int i = 1; i < argc; i++) {
+        const std::string_view arg = argv[i];
+        const bool has_value = i + 1 < argc;
+
+        if (arg == "-runs" && has_value) {
+            runs = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-json" && has_value) {
+            json_path = argv[++i];
+        } else if (arg == "-baseline" && has_value) {
+            baseline_path = argv[++i];
+        } else if (arg == "-threshold" && has_value) {
+            threshold = atof(argv[++i]) / 100.0;
+        } else if (arg[0] == '-') {
+            fmt::print("usage: benchmark [-runs n] [-json file] [-baseline file] [-threshold percent] [map...]\n");
+            return 1;
+        } else {
+            maps.emplace_back(arg);
+        }
+    }
+
+    if (maps.empty()) {
+        maps = default_corpus;
+    }
+
+    Json::Value results(Json::objectValue);
+    results["runs"] = runs;
+    results["maps"] = Json::Value(Json::objectValue);
+
+    try {
+        for (auto &map : maps) {
+            results["maps"][map] = benchmark_map(map, runs);
+        }
+    } catch (const std::exception &e) {
+        exit_on_exception(e);
+    }
+
+    if (json_path) {
+        std::ofstream(*json_path, std::fstream::out | std::fstream::trunc) << std::setw(4) << results;
+    }
+
+    if (baseline_path) {
+        std::ifstream stream(*baseline_path, std::ios_base::in | std::ios_base::binary);
+        const std::vector<uint8_t> data((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+
+        if (data.empty()) {
+            fmt::print("can't read baseline {}\n", baseline_path->string());
+            return 1;
+        }
+
+        const Json::Value baseline = parse_json(data.data(), data.data() + data.size());
+
+        if (int regressions = compare_to_baseline(results, baseline, threshold)) {
+            fmt::print("{} regressions over {:.0f}% compared to {}\n", regressions, threshold * 100.0,
+                baseline_path->string());
+            return 1;
+        }
+
+        fmt::print("no regressions over {:.0f}% compared to {}\n", threshold * 100.0, baseline_path->string());
+    }
+
+    return 0;
+}
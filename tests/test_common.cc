@@ -5,12 +5,19 @@
 #include "gmock/gmock-matchers.h"
 #include <gtest/gtest.h>
 
+#include <array>
+#include <bit>
+#include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <string_view>
 #include <common/bspfile.hh>
 #include <common/bspfile_q1.hh>
 #include <common/bspfile_q2.hh>
+#include <common/fs.hh>
+#include <common/parallel.hh>
 #include <common/imglib.hh>
 #include <common/settings.hh>
 #include <testmaps.hh>
@@ -743,3 +750,328 @@ TEST(entdict, getVec3f)
     EXPECT_EQ(qvec3f(0, 0, 0), test.get_vec3f("fail2"));
     EXPECT_EQ(qvec3f(0, 0, 0), test.get_vec3f("fail3"));
 }
+
+TEST(common, fsMapMatchesLoad)
+{
+    auto path = std::filesystem::path(testmaps_dir) / "q1_cube.map";
+
+    fs::data loaded = fs::load(path);
+    fs::mapped mapped = fs::map(path);
+
+    ASSERT_TRUE(loaded);
+    ASSERT_TRUE(mapped);
+    ASSERT_EQ(loaded->size(), mapped->size());
+    EXPECT_TRUE(std::equal(loaded->begin(), loaded->end(), mapped->begin()));
+
+    EXPECT_FALSE(fs::map(std::filesystem::path(testmaps_dir) / "does_not_exist.map"));
+}
+
+TEST(common, bspRawLumpRoundtrip)
+{
+    // dvertexes, dedges, dsurfedges etc. are read and written as whole blocks;
+    // make sure they survive a save/load
+    fs::path bsp_path = std::filesystem::path(testmaps_dir) / "compiled" / "q1_cube.bsp";
+
+    bspdata_t original;
+    LoadBSPFile(bsp_path, &original);
+
+    auto out_path = std::filesystem::temp_directory_path() / "ericw_tools_raw_lump_roundtrip.bsp";
+    WriteBSPFile(out_path, &original);
+
+    bspdata_t reloaded;
+    LoadBSPFile(out_path, &reloaded);
+    std::filesystem::remove(out_path);
+
+    auto &a = std::get<bsp29_t>(original.bsp);
+    auto &b = std::get<bsp29_t>(reloaded.bsp);
+
+    ASSERT_FALSE(a.dvertexes.empty());
+    EXPECT_EQ(a.dvertexes, b.dvertexes);
+    EXPECT_EQ(a.dedges, b.dedges);
+    EXPECT_EQ(a.dsurfedges, b.dsurfedges);
+    EXPECT_EQ(a.dmarksurfaces, b.dmarksurfaces);
+    EXPECT_EQ(a.dlightdata, b.dlightdata);
+    EXPECT_EQ(a.dvisdata, b.dvisdata);
+
+    // a save/load can't catch the bulk read and write disagreeing with the
+    // file format in the same way, so also decode the bulk-read lumps from
+    // the raw file one little-endian field at a time
+    fs::data file = fs::load(bsp_path);
+    ASSERT_TRUE(file);
+
+    auto read_bytes = [&](size_t ofs, size_t n) {
+        EXPECT_LE(ofs + n, file->size());
+        uint32_t value = 0;
+        for (size_t i = 0; i < n; i++) {
+            value |= static_cast<uint32_t>((*file)[ofs + i]) << (i * 8);
+        }
+        return value;
+    };
+    auto read_i32 = [&](size_t ofs) { return static_cast<int32_t>(read_bytes(ofs, 4)); };
+    auto read_u16 = [&](size_t ofs) { return static_cast<uint16_t>(read_bytes(ofs, 2)); };
+    auto read_f32 = [&](size_t ofs) { return std::bit_cast<float>(read_bytes(ofs, 4)); };
+
+    ASSERT_EQ(read_i32(0), BSPVERSION);
+    auto lump = [&](q1_lump_t l) {
+        return std::pair<size_t, size_t>(read_i32(4 + l * 8), read_i32(4 + l * 8 + 4));
+    };
+
+    {
+        auto [ofs, len] = lump(LUMP_VERTEXES);
+        ASSERT_EQ(len / 12, a.dvertexes.size());
+        for (size_t i = 0; i < a.dvertexes.size(); i++) {
+            for (size_t j = 0; j < 3; j++) {
+                EXPECT_EQ(read_f32(ofs + i * 12 + j * 4), a.dvertexes[i][j]);
+            }
+        }
+    }
+    {
+        auto [ofs, len] = lump(LUMP_EDGES);
+        ASSERT_EQ(len / 4, a.dedges.size());
+        for (size_t i = 0; i < a.dedges.size(); i++) {
+            EXPECT_EQ(read_u16(ofs + i * 4), a.dedges[i][0]);
+            EXPECT_EQ(read_u16(ofs + i * 4 + 2), a.dedges[i][1]);
+        }
+    }
+    {
+        auto [ofs, len] = lump(LUMP_SURFEDGES);
+        ASSERT_EQ(len / 4, a.dsurfedges.size());
+        for (size_t i = 0; i < a.dsurfedges.size(); i++) {
+            EXPECT_EQ(read_i32(ofs + i * 4), a.dsurfedges[i]);
+        }
+    }
+    {
+        auto [ofs, len] = lump(LUMP_MARKSURFACES);
+        ASSERT_EQ(len / 2, a.dmarksurfaces.size());
+        for (size_t i = 0; i < a.dmarksurfaces.size(); i++) {
+            EXPECT_EQ(read_u16(ofs + i * 2), a.dmarksurfaces[i]);
+        }
+    }
+    {
+        auto [ofs, len] = lump(LUMP_LIGHTING);
+        ASSERT_EQ(len, a.dlightdata.size());
+        for (size_t i = 0; i < a.dlightdata.size(); i++) {
+            EXPECT_EQ((*file)[ofs + i], a.dlightdata[i]);
+        }
+    }
+    {
+        auto [ofs, len] = lump(LUMP_VISIBILITY);
+        ASSERT_EQ(len, a.dvisdata.size());
+        for (size_t i = 0; i < a.dvisdata.size(); i++) {
+            EXPECT_EQ((*file)[ofs + i], a.dvisdata[i]);
+        }
+    }
+}
+
+TEST(common, traceExport)
+{
+    auto trace_path = std::filesystem::temp_directory_path() / "ericw_tools_test_trace.json";
+
+    settings::common_settings settings;
+    settings.trace.set_value(trace_path, settings::source::COMMANDLINE);
+
+    logging::init(std::nullopt, settings);
+    {
+        logging::trace_scope stage("testStage");
+        logging::parallel_for(0, 100, [](int) {});
+
+        logging::stat_tracker_t stats;
+        stats.register_stat("things") += 5;
+        stats.print_stats();
+    }
+    logging::close();
+
+    ASSERT_FALSE(logging::tracing);
+
+    fs::data file = fs::load(trace_path);
+    ASSERT_TRUE(file);
+    std::filesystem::remove(trace_path);
+
+    Json::Value json = parse_json(file->data(), file->data() + file->size());
+    ASSERT_TRUE(json.isMember("traceEvents"));
+
+    bool found_stage = false, found_task = false, found_counter = false;
+
+    for (auto &event : json["traceEvents"]) {
+        const std::string name = event["name"].asString();
+        const std::string ph = event["ph"].asString();
+
+        if (ph == "X" && name == "testStage") {
+            if (event["cat"].asString() == "stage") {
+                found_stage = true;
+            } else if (event["cat"].asString() == "task") {
+                found_task = true;
+            }
+        } else if (ph == "C" && name == "testStage: things") {
+            EXPECT_EQ(event["args"]["count"].asInt(), 5);
+            found_counter = true;
+        }
+    }
+
+    EXPECT_TRUE(found_stage);
+    EXPECT_TRUE(found_task);
+    EXPECT_TRUE(found_counter);
+}
+
+// writes a .pak holding one file
+static void WriteTestPak(const fs::path &path, const std::string &name, const std::string &contents)
+{
+    std::ofstream stream(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+
+    const uint32_t dir_offset = 12 + contents.size();
+    const uint32_t dir_size = 64;
+    stream.write("PACK", 4);
+    stream.write(reinterpret_cast<const char *>(&dir_offset), 4);
+    stream.write(reinterpret_cast<const char *>(&dir_size), 4);
+    stream.write(contents.data(), contents.size());
+
+    std::array<char, 56> entry_name{};
+    std::copy(name.begin(), name.end(), entry_name.begin());
+    const uint32_t file_offset = 12, file_size = contents.size();
+    stream.write(entry_name.data(), entry_name.size());
+    stream.write(reinterpret_cast<const char *>(&file_offset), 4);
+    stream.write(reinterpret_cast<const char *>(&file_size), 4);
+}
+
+TEST(common, archiveCache)
+{
+    const fs::path pak_path = fs::temp_directory_path() / "ericw_tools_archive_cache.pak";
+    WriteTestPak(pak_path, "cached.txt", "one");
+
+    fs::clear();
+    fs::set_archive_cache(true);
+
+    auto first = fs::addArchive(pak_path);
+    ASSERT_TRUE(first);
+
+    // unchanged on disk: the same archive is handed out again
+    fs::clear();
+    EXPECT_EQ(fs::addArchive(pak_path), first);
+
+    // changed on disk: read again
+    WriteTestPak(pak_path, "cached.txt", "three");
+    fs::clear();
+    auto second = fs::addArchive(pak_path);
+    EXPECT_NE(second, first);
+
+    fs::data data = fs::load("cached.txt");
+    ASSERT_TRUE(data);
+    EXPECT_EQ(std::string(data->begin(), data->end()), "three");
+
+    fs::set_archive_cache(false);
+    fs::clear();
+    fs::remove(pak_path);
+}
+
+TEST(imglib, decodeCache)
+{
+    auto *game = bspver_q2.game;
+    const fs::path source_dir = fs::path(testmaps_dir) / "q2_wal_metadata" / "textures" / "e1u1";
+    const fs::path dir = fs::temp_directory_path() / "ericw_tools_decode_cache";
+    const fs::path wal_path = dir / "textures" / "cached.wal";
+
+    fs::create_directories(wal_path.parent_path());
+    fs::copy_file(source_dir / "test.wal", wal_path, fs::copy_options::overwrite_existing);
+
+    settings::common_settings settings;
+    settings.paths.add_value(dir.string(), settings::source::COMMANDLINE);
+    game->init_filesystem("placeholder.map", settings);
+
+    img::set_decode_cache(true);
+
+    auto [first, first_pos, first_data] = img::load_texture("cached", false, game, settings);
+    ASSERT_TRUE(first);
+
+    auto [again, again_pos, again_data] = img::load_texture("cached", false, game, settings);
+    ASSERT_TRUE(again);
+    EXPECT_EQ(first->pixels, again->pixels);
+
+    // same size, newer modification time
+    const auto time = fs::last_write_time(wal_path);
+    fs::copy_file(source_dir / "alphamask.wal", wal_path, fs::copy_options::overwrite_existing);
+    fs::last_write_time(wal_path, time + std::chrono::seconds(10));
+
+    auto [replaced, replaced_pos, replaced_data] = img::load_texture("cached", false, game, settings);
+    ASSERT_TRUE(replaced);
+    EXPECT_NE(first->pixels, replaced->pixels);
+
+    // same modification time, different size
+    fs::copy_file(source_dir / "test.wal", wal_path, fs::copy_options::overwrite_existing);
+    std::ofstream(wal_path, std::ios_base::app | std::ios_base::binary) << '\0';
+    fs::last_write_time(wal_path, time + std::chrono::seconds(10));
+
+    auto [resized, resized_pos, resized_data] = img::load_texture("cached", false, game, settings);
+    ASSERT_TRUE(resized);
+    EXPECT_EQ(first->pixels, resized->pixels);
+    EXPECT_EQ(resized_data->size(), first_data->size() + 1);
+
+    img::set_decode_cache(false);
+    fs::clear();
+    fs::remove_all(dir);
+}
+
+// writes a pics/colormap.pcx with the given palette; the image itself is never read
+static void WriteTestColormap(const fs::path &path, const std::function<qvec3b(int)> &color)
+{
+    fs::create_directories(path.parent_path());
+    std::ofstream stream(path, std::ios_base::out | std::ios_base::binary);
+
+    std::array<uint8_t, 128> header{};
+    header[0] = 0x0a; // manufacturer
+    header[1] = 5; // version
+    header[2] = 1; // encoding
+    header[3] = 8; // bits per pixel
+    stream.write(reinterpret_cast<const char *>(header.data()), header.size());
+
+    stream.put(0x0c);
+
+    for (int i = 0; i < 256; i++) {
+        const qvec3b c = color(i);
+        stream.write(reinterpret_cast<const char *>(&c[0]), 3);
+    }
+}
+
+TEST(imglib, decodeCacheFollowsPalette)
+{
+    auto *game = bspver_q2.game;
+    const fs::path source_dir = fs::path(testmaps_dir) / "q2_wal_metadata" / "textures" / "e1u1";
+    const fs::path dir = fs::temp_directory_path() / "ericw_tools_decode_cache_palette";
+    const fs::path colormap_path = dir / "pics" / "colormap.pcx";
+
+    fs::create_directories(dir / "textures");
+    fs::copy_file(source_dir / "test.wal", dir / "textures" / "cached.wal", fs::copy_options::overwrite_existing);
+
+    settings::common_settings settings;
+    settings.paths.add_value(dir.string(), settings::source::COMMANDLINE);
+
+    img::set_decode_cache(true);
+
+    // each job sets up its filesystem and palette, then loads the same .wal
+    auto run_job = [&]() {
+        game->init_filesystem("placeholder.map", settings);
+        img::init_palette(game);
+
+        auto [tex, pos, data] = img::load_texture("cached", false, game, settings);
+        EXPECT_TRUE(tex);
+        return tex ? tex->pixels : std::vector<qvec4b>{};
+    };
+
+    WriteTestColormap(colormap_path, [](int i) { return qvec3b(i, i, i); });
+    const auto first = run_job();
+
+    // the colormap is edited between jobs
+    WriteTestColormap(colormap_path, [](int i) { return qvec3b(255 - i, 0, i); });
+    const auto second = run_job();
+
+    EXPECT_FALSE(first.empty());
+    EXPECT_NE(first, second);
+
+    // and back again, which is a cache hit with the first job's pixels
+    WriteTestColormap(colormap_path, [](int i) { return qvec3b(i, i, i); });
+    EXPECT_EQ(run_job(), first);
+
+    img::set_decode_cache(false);
+    img::clear();
+    fs::clear();
+    fs::remove_all(dir);
+}
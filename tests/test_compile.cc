@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+
+#include <compile/compile.hh>
+#include <common/fs.hh>
+#include <common/imglib.hh>
+#include <light/light.hh>
+#include <testmaps.hh>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+
+#ifndef _WIN32
+
+// runs server_main on a thread for the duration of a test
+struct test_server_t
+{
+    fs::path socket_path = fs::temp_directory_path() / "ericw_tools_test_server.sock";
+    fs::path cwd = fs::current_path();
+    int result = -1;
+    std::thread thread;
+
+    test_server_t()
+    {
+        fs::remove(socket_path);
+
+        thread = std::thread([this] { result = server_main(socket_path); });
+
+        // wait for it to listen
+        for (int i = 0; i < 500 && !fs::exists(socket_path); i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    ~test_server_t()
+    {
+        if (thread.joinable()) {
+            client_main(socket_path, {"shutdown"});
+            thread.join();
+        }
+
+        // the server keeps these on, and runs jobs in the client's directory
+        fs::set_archive_cache(false);
+        img::set_decode_cache(false);
+        Embree_SetSceneCache(false);
+        fs::current_path(cwd);
+    }
+};
+
+TEST(compileServer, socketIsPrivate)
+{
+    test_server_t server;
+    ASSERT_TRUE(fs::is_socket(fs::symlink_status(server.socket_path)));
+
+    const auto perms = fs::status(server.socket_path).permissions();
+    EXPECT_EQ(perms & (fs::perms::group_all | fs::perms::others_all), fs::perms::none);
+}
+
+TEST(compileServer, shutdown)
+{
+    test_server_t server;
+
+    EXPECT_EQ(client_main(server.socket_path, {"shutdown"}), 0);
+    server.thread.join();
+
+    EXPECT_EQ(server.result, 0);
+    EXPECT_FALSE(fs::exists(server.socket_path));
+}
+
+TEST(compileServer, runsJobs)
+{
+    test_server_t server;
+
+    const fs::path map_path = fs::path(testmaps_dir) / "q1_cube.map";
+    const fs::path bsp_path = fs::temp_directory_path() / "ericw_tools_test_server.bsp";
+    fs::remove(bsp_path);
+
+    // twice, so the second job runs with the caches warm
+    for (int i = 0; i < 2; i++) {
+        EXPECT_EQ(client_main(server.socket_path, {"qbsp", map_path.string(), bsp_path.string()}), 0);
+        EXPECT_TRUE(fs::exists(bsp_path));
+        fs::remove(bsp_path);
+    }
+
+    EXPECT_NE(client_main(server.socket_path, {"unknown_tool", map_path.string()}), 0);
+}
+
+TEST(compileServer, keepsNonSocketFiles)
+{
+    const fs::path path = fs::temp_directory_path() / "ericw_tools_test_server_not_a_socket";
+    std::ofstream(path) << "keep me";
+
+    EXPECT_ANY_THROW(server_main(path));
+    EXPECT_TRUE(fs::exists(path));
+
+    fs::remove(path);
+}
+
+#endif
@@ -1,8 +1,11 @@
 #include <gtest/gtest.h>
 
 #include <light/light.hh>
+#include <light/bounce.hh>
 #include <light/trace.hh> // for clamp_texcoord
 #include <light/entities.hh>
+#include <light/surflight.hh>
+#include <light/ltface.hh>
 
 #include <random>
 #include <algorithm> // for std::sort
@@ -1068,3 +1071,157 @@ TEST(LightFormats, e5bgr9pack3)
     EXPECT_LT(error[1], 0.00001);
     EXPECT_LT(error[2], 0.000025);
 }
+
+TEST(Bounce, adaptivePointsFollowBrightness)
+{
+    // 256x256, so 16 cells at the default _bouncelightsubdivision of 64
+    auto points_for = [](float peak, float full_intensity) {
+        auto square = polylib::winding3f_t{{0, 0, 0}, {0, 256, 0}, {256, 256, 0}, {256, 0, 0}};
+        return AdaptiveBounceLightPoints(std::move(square), {0, 0, 1}, 64.0f, peak, full_intensity);
+    };
+
+    // as many points as "high" at the full intensity or above
+    EXPECT_EQ(16, points_for(64, 64).size());
+    EXPECT_EQ(16, points_for(1000, 64).size());
+
+    // dim faces get fewer, but always at least one
+    EXPECT_EQ(2, points_for(8, 64).size());
+    EXPECT_EQ(1, points_for(0.1f, 64).size());
+
+    size_t last = 0;
+    for (float peak = 1; peak <= 64; peak *= 2) {
+        const size_t count = points_for(peak, 64).size();
+        EXPECT_GE(count, last);
+        last = count;
+    }
+
+    // _bounceadaptiveintensity moves the scale
+    EXPECT_EQ(4, points_for(8, 32).size());
+
+    // the points are on the face, lifted off it by the normal
+    for (const qvec3f &point : points_for(8, 64)) {
+        EXPECT_EQ(point[2], 1);
+        EXPECT_GT(point[0], 0);
+        EXPECT_LT(point[0], 256);
+    }
+}
+
+TEST(SurfaceLightTree, QueryMatchesLinearScan)
+{
+    std::mt19937 engine(42);
+    std::uniform_real_distribution<float> dis(-1024.0f, 1024.0f);
+
+    std::vector<lightsurf_t> surfs(100);
+    std::vector<lightsurf_t *> emitters;
+
+    for (auto &surf : surfs) {
+        surf.vpl = std::make_unique<surfacelight_t>();
+        surf.vpl->pos = {dis(engine), dis(engine), dis(engine)};
+        surf.vpl->surfnormal = {0, 0, 1};
+        surf.vpl->points = {surf.vpl->pos, surf.vpl->pos + qvec3f(8, 0, 0)};
+        surf.vpl->styles.emplace_back().totalintensity = 100.0f;
+        emitters.push_back(&surf);
+    }
+
+    surflight_tree_t tree;
+    tree.build(emitters);
+    EXPECT_EQ(tree.nodes().size(), emitters.size() * 2 - 1);
+
+    // the root covers every emitter
+    const auto &root = tree.nodes().at(0);
+    for (const lightsurf_t *surf : emitters) {
+        EXPECT_TRUE(root.pos_bounds.containsPoint(surf->vpl->pos));
+    }
+    EXPECT_FLOAT_EQ(root.cone_angle, 0.0f);
+    EXPECT_FLOAT_EQ(root.peak_intensity, 0.0f); // color is zero
+
+    // cull everything outside a query box, compare against a linear scan
+    const aabb3f query_box({-256, -256, -256}, {256, 256, 256});
+
+    std::vector<uint32_t> result;
+    tree.query([&](const surflight_tree_t::node_t &node) { return node.pos_bounds.disjoint(query_box); }, result);
+
+    std::vector<uint32_t> expected;
+    for (uint32_t i = 0; i < emitters.size(); i++) {
+        if (query_box.containsPoint(emitters[i]->vpl->pos)) {
+            expected.push_back(i);
+        }
+    }
+
+    EXPECT_EQ(result, expected);
+}
+
+TEST(LightTree, QueryCullsAtTheGate)
+{
+    struct reach_case_t
+    {
+        light_formula_t formula;
+        float light, falloff, wait;
+        // where the light fades to the gate
+        float fade_dist;
+    };
+
+    const float gate = light_options.gate.value();
+    const float inf = std::numeric_limits<float>::infinity();
+    const reach_case_t cases[] = {
+        {LF_LINEAR, 300, 0, 1, 300 - gate},
+        {LF_LINEAR, -300, 0, 1, 300 - gate},
+        {LF_LINEAR, 300, 0, 2, (300 - gate) / 2},
+        {LF_LINEAR, 300, 200, 1, 200 * (1 - gate / 300)}, // _falloff
+        {LF_INVERSE, 300, 0, 1, 300 * 128 / gate},
+        {LF_INVERSE2, 300, 0, 1, 128 * sqrt(300 / gate)},
+        {LF_INVERSE2A, 300, 0, 1, 128 * sqrt(300 / gate) - 128},
+        {LF_INFINITE, 300, 0, 1, inf},
+        {LF_LOCALMIN, 300, 0, 1, inf},
+    };
+
+    std::vector<std::unique_ptr<light_t>> lights;
+    std::vector<float> reach;
+
+    for (const auto &c : cases) {
+        SCOPED_TRACE(fmt::format("delay {} light {} _falloff {} wait {}", static_cast<int>(c.formula), c.light,
+            c.falloff, c.wait));
+
+        auto &light = lights.emplace_back(std::make_unique<light_t>());
+        light->origin.set_value({lights.size() * 1024.0f, 0, 0}, settings::source::MAP);
+        light->formula.set_value(c.formula, settings::source::MAP);
+        light->light.set_value(c.light, settings::source::MAP);
+        light->falloff.set_value(c.falloff, settings::source::MAP);
+        light->atten.set_value(c.wait, settings::source::MAP);
+
+        reach.push_back(GetLightReach(light_options, light.get()));
+
+        // GetLightReach adds a unit past where the light fades out
+        if (std::isinf(c.fade_dist)) {
+            EXPECT_TRUE(std::isinf(reach.back()));
+        } else {
+            EXPECT_NEAR(reach.back(), c.fade_dist + 1, std::max(0.01f, c.fade_dist * 1e-5f));
+        }
+    }
+
+    light_tree_t tree;
+    tree.build(lights, reach);
+
+    auto query_contains = [&](const qvec3f &point, uint32_t light) {
+        std::vector<uint32_t> result;
+        tree.query(point, 0, result);
+        return std::find(result.begin(), result.end(), light) != result.end();
+    };
+
+    for (uint32_t i = 0; i < lights.size(); i++) {
+        SCOPED_TRACE(fmt::format("light {}", i));
+
+        const qvec3f &origin = lights[i]->origin.value();
+
+        if (std::isinf(reach[i])) {
+            EXPECT_TRUE(query_contains(origin + qvec3f{0, 1e6f, 0}, i));
+            continue;
+        }
+
+        // just inside and just outside the reach
+        const float margin = std::max(0.5f, reach[i] * 1e-6f);
+        EXPECT_TRUE(query_contains(origin + qvec3f{0, reach[i] - margin, 0}, i));
+        EXPECT_FALSE(query_contains(origin + qvec3f{0, reach[i] + margin, 0}, i));
+        EXPECT_FALSE(query_contains(origin + qvec3f{0, 0, -(reach[i] + margin)}, i));
+    }
+}
@@ -12,6 +12,11 @@
 #include "test_qbsp.hh"
 #include "test_main.hh"
 
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <random>
+
 static testresults_t QbspVisLight_Common(const std::filesystem::path &name, std::vector<std::string> extra_qbsp_args,
     std::vector<std::string> extra_light_args, runvis_t run_vis)
 {
@@ -1073,6 +1078,24 @@ TEST(ltfaceQ1, sunlightTwoSuns)
     }
 }
 
+TEST(ltfaceQ1, lightgridDenseMatchesOctreeFirst)
+{
+    SCOPED_TRACE("skipping solid bricks and reusing the nudged points shouldn't change the light grid");
+
+    for (const auto &[format, lump] : {std::pair<std::string, std::string>{"octree", "LIGHTGRID_OCTREE"},
+             {"lightgrids", "LIGHTGRIDS"}}) {
+        SCOPED_TRACE(format);
+
+        auto octree_first = QbspVisLight_Q1("deprecated/suntest.map", {"-lightgrid", "-lightgrid_format", format});
+        auto dense = QbspVisLight_Q1(
+            "deprecated/suntest.map", {"-lightgrid", "-lightgrid_format", format, "-debug_lightgrid_dense"});
+
+        ASSERT_NE(octree_first.bspx.find(lump), octree_first.bspx.end());
+        ASSERT_NE(dense.bspx.find(lump), dense.bspx.end());
+        EXPECT_EQ(octree_first.bspx.at(lump), dense.bspx.at(lump));
+    }
+}
+
 // same as above, but tests LIGHTGRIDS lump (directionality)
 TEST(ltfaceQ1, sunlightTwoSunsLightgrids)
 {
@@ -1161,6 +1184,386 @@ TEST(ltfaceQ1, bounceNoshadow)
     CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {118, 118, 118}, {128, 12, 156}, {-1, 0, 0});
 }
 
+TEST(ltfaceQ1, bounceAdaptiveCloseToHigh)
+{
+    SCOPED_TRACE("-emissivequality adaptive should bounce about the same amount of light as high");
+
+    auto high = QbspVisLight_Q1("q1_light_bounce_litwater.map", {"-bounce", "4", "-emissivequality", "high"});
+    auto adaptive = QbspVisLight_Q1("q1_light_bounce_litwater.map", {"-bounce", "4", "-emissivequality", "adaptive"});
+
+    ASSERT_EQ(high.bsp.dlightdata.size(), adaptive.bsp.dlightdata.size());
+
+    int64_t high_total = 0, adaptive_total = 0, total_difference = 0;
+    for (size_t i = 0; i < high.bsp.dlightdata.size(); i++) {
+        high_total += high.bsp.dlightdata[i];
+        adaptive_total += adaptive.bsp.dlightdata[i];
+        total_difference += std::abs(high.bsp.dlightdata[i] - adaptive.bsp.dlightdata[i]);
+    }
+
+    EXPECT_NEAR(high_total, adaptive_total, high_total * 0.02);
+    EXPECT_LE(total_difference, high.bsp.dlightdata.size() * 2);
+}
+
+TEST(ltfaceQ1, bounceDenoise)
+{
+    SCOPED_TRACE("-denoise should redistribute bounced light, not add or remove it");
+
+    auto plain = QbspVisLight_Q1("q1_light_bounce_litwater.map", {"-bounce", "4"});
+    auto denoised = QbspVisLight_Q1("q1_light_bounce_litwater.map", {"-bounce", "4", "-denoise"});
+
+    ASSERT_EQ(plain.bsp.dlightdata.size(), denoised.bsp.dlightdata.size());
+
+    int64_t plain_total = 0, denoised_total = 0;
+    for (size_t i = 0; i < plain.bsp.dlightdata.size(); i++) {
+        plain_total += plain.bsp.dlightdata[i];
+        denoised_total += denoised.bsp.dlightdata[i];
+    }
+
+    EXPECT_NEAR(plain_total, denoised_total, plain_total * 0.02);
+
+    CheckFaceLuxelAtPoint(&denoised.bsp, &denoised.bsp.dmodels[0], {118, 118, 118}, {128, 12, 156}, {-1, 0, 0});
+}
+
+TEST(ltfaceQ1, surfaceLightTreeMatchesLinearScan)
+{
+    SCOPED_TRACE("culling surface lights with the surface light tree shouldn't change the lighting");
+
+    // q1_light_surflight_group.map has texture surface lights, q1_light_bounce_litwater.map only bounce lights
+    for (const std::string map : {"q1_light_surflight_group.map", "q1_light_bounce_litwater.map"}) {
+        SCOPED_TRACE(map);
+
+        auto tree = QbspVisLight_Q1(map, {"-lit", "-bounce", "4"});
+        auto linear = QbspVisLight_Q1(map, {"-lit", "-bounce", "4", "-debug_surflight_linear"});
+
+        EXPECT_EQ(tree.bsp.dlightdata, linear.bsp.dlightdata);
+
+        const auto *tree_lit = std::get_if<lit1_t>(&tree.lit);
+        const auto *linear_lit = std::get_if<lit1_t>(&linear.lit);
+        ASSERT_TRUE(tree_lit);
+        ASSERT_TRUE(linear_lit);
+        EXPECT_EQ(tree_lit->rgbdata, linear_lit->rgbdata);
+    }
+}
+
+TEST(ltface, denoiseSmoothsNoiseKeepsCreases)
+{
+    // a 16x8 patch of samples folded 45 degrees down the middle, with noisy
+    // light that is bright on one side of the crease and dim on the other
+    constexpr int width = 16, height = 8;
+    constexpr float bright = 100, dim = 20;
+
+    lightsurf_t lightsurf{};
+    lightsurf.width = width;
+    lightsurf.height = height;
+
+    const qvec3f folded_normal = qv::normalize(qvec3f{-1, 0, 1});
+    std::vector<lightsample_t> samples(width * height);
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> noise(-15.0f, 15.0f);
+
+    for (int t = 0; t < height; t++) {
+        for (int s = 0; s < width; s++) {
+            auto &sample = lightsurf.samples.emplace_back();
+
+            if (s < width / 2) {
+                sample.point = {static_cast<float>(s), static_cast<float>(t), 0};
+                sample.normal = {0, 0, 1};
+            } else {
+                const float along = (s - (width / 2) + 1) / std::sqrt(2.0f);
+                sample.point = {(width / 2) - 1 + along, static_cast<float>(t), along};
+                sample.normal = folded_normal;
+            }
+            sample.occluded = false;
+
+            const float value = ((s < width / 2) ? bright : dim) + noise(rng);
+            samples[(t * width) + s].color = {value, value, value};
+        }
+    }
+
+    // mean and variance of each side of the crease
+    auto side_stats = [&](const std::vector<lightsample_t> &data, bool right) {
+        float sum = 0, sum_sq = 0;
+        int count = 0;
+        for (int t = 0; t < height; t++) {
+            for (int s = right ? width / 2 : 0; s < (right ? width : width / 2); s++) {
+                const float v = data[(t * width) + s].color[0];
+                sum += v;
+                sum_sq += v * v;
+                count++;
+            }
+        }
+        const float mean = sum / count;
+        return std::make_pair(mean, (sum_sq / count) - (mean * mean));
+    };
+
+    const auto [bright_mean, bright_variance] = side_stats(samples, false);
+    const auto [dim_mean, dim_variance] = side_stats(samples, true);
+
+    auto filtered = samples;
+    Denoise_Lightsamples(lightsurf, 1.0f, 3, filtered);
+
+    const auto [filtered_bright_mean, filtered_bright_variance] = side_stats(filtered, false);
+    const auto [filtered_dim_mean, filtered_dim_variance] = side_stats(filtered, true);
+
+    SCOPED_TRACE("the noise is smoothed out");
+    EXPECT_LT(filtered_bright_variance, bright_variance * 0.25f);
+    EXPECT_LT(filtered_dim_variance, dim_variance * 0.25f);
+
+    SCOPED_TRACE("but light doesn't leak across the crease");
+    EXPECT_NEAR(filtered_bright_mean, bright_mean, 1.5f);
+    EXPECT_NEAR(filtered_dim_mean, dim_mean, 1.5f);
+
+    for (int t = 0; t < height; t++) {
+        EXPECT_NEAR(filtered[(t * width) + (width / 2) - 1].color[0], bright, 10.0f);
+        EXPECT_NEAR(filtered[(t * width) + (width / 2)].color[0], dim, 10.0f);
+    }
+}
+
+TEST(ltfaceQ1, sunGroupsMatchSeparateSuns)
+{
+    SCOPED_TRACE("suns sharing a direction should light exactly as if each was traced on its own");
+
+    // worldspawn sun and domes, plus two _sunlight2 domes (one styled) and a _sunlight3 dome from light entities
+    for (const std::vector<std::string> &args : {std::vector<std::string>{"-lit"}, {"-lit", "-dirt"}}) {
+        auto separate_args = args;
+        separate_args.push_back("-nosungroups");
+
+        auto grouped = QbspVisLight_Q1("q1_sunlight2_groups.map", args);
+        auto separate = QbspVisLight_Q1("q1_sunlight2_groups.map", separate_args);
+
+        ASSERT_EQ(grouped.bsp.dfaces.size(), separate.bsp.dfaces.size());
+        for (size_t i = 0; i < grouped.bsp.dfaces.size(); i++) {
+            SCOPED_TRACE(fmt::format("face {}", i));
+            EXPECT_EQ(grouped.bsp.dfaces[i].styles, separate.bsp.dfaces[i].styles);
+            EXPECT_EQ(grouped.bsp.dfaces[i].lightofs, separate.bsp.dfaces[i].lightofs);
+        }
+
+        EXPECT_EQ(grouped.bsp.dlightdata, separate.bsp.dlightdata);
+
+        const auto *grouped_lit = std::get_if<lit1_t>(&grouped.lit);
+        const auto *separate_lit = std::get_if<lit1_t>(&separate.lit);
+        ASSERT_TRUE(grouped_lit);
+        ASSERT_TRUE(separate_lit);
+        EXPECT_EQ(grouped_lit->rgbdata, separate_lit->rgbdata);
+
+        // the styled dome should have made it into the lightmaps
+        EXPECT_TRUE(std::any_of(grouped.bsp.dfaces.begin(), grouped.bsp.dfaces.end(), [](const mface_t &face) {
+            return std::find(face.styles.begin(), face.styles.end(), 5) != face.styles.end();
+        }));
+    }
+}
+
+TEST(ltfaceQ1, faceLeavesMatchMarksurfaceSearch)
+{
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_func_illusionary_visblocker.map", {}, runvis_t::yes);
+
+    BuildFaceLeaves(&bsp);
+
+    size_t faces_in_leaves = 0;
+
+    for (int facenum = 0; facenum < bsp.dfaces.size(); facenum++) {
+        SCOPED_TRACE(fmt::format("face {}", facenum));
+
+        // search every leaf's marksurfaces for the face
+        std::vector<const mleaf_t *> expected;
+        for (auto &leaf : bsp.dleafs) {
+            for (uint32_t k = 0; k < leaf.nummarksurfaces; k++) {
+                if (bsp.dleaffaces[leaf.firstmarksurface + k] == facenum) {
+                    expected.push_back(&leaf);
+                }
+            }
+        }
+
+        const auto leaves = LeavesForFace(facenum);
+        EXPECT_EQ(std::vector<const mleaf_t *>(leaves.begin(), leaves.end()), expected);
+
+        if (!expected.empty()) {
+            faces_in_leaves++;
+        }
+    }
+
+    EXPECT_GT(faces_in_leaves, 0);
+    EXPECT_TRUE(LeavesForFace(-1).empty());
+    EXPECT_TRUE(LeavesForFace(bsp.dfaces.size()).empty());
+}
+
+TEST(ltfaceQ1, sharedLightsurfPvsMatchesPerFacePvs)
+{
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_func_illusionary_visblocker.map", {}, runvis_t::yes);
+
+    BuildFaceLeaves(&bsp);
+    const auto vis = DecompressAllVis(&bsp, true);
+    ASSERT_FALSE(vis.empty());
+
+    ClearLightsurfPvsPool();
+
+    std::map<const std::vector<uint8_t> *, std::vector<uint8_t>> pvs_by_pointer;
+    size_t shared = 0;
+
+    for (int facenum = 0; facenum < bsp.dfaces.size(); facenum++) {
+        SCOPED_TRACE(fmt::format("face {}", facenum));
+
+        const auto leaves = LeavesForFace(facenum);
+
+        // OR the face's own copy of its leaves' rows together
+        std::vector<uint8_t> expected(DecompressedVisSize(&bsp), 0);
+        for (const mleaf_t *leaf : leaves) {
+            const bool liquid = bsp.loadversion->game->create_contents_from_native(leaf->contents).is_liquid();
+            const auto it = vis.find(leaf->visofs);
+
+            if (liquid || it == vis.end()) {
+                std::fill(expected.begin(), expected.end(), 0xff);
+                break;
+            }
+
+            for (size_t j = 0; j < expected.size(); j++) {
+                expected[j] |= it->second[j];
+            }
+        }
+
+        const std::vector<uint8_t> *pvs = LightsurfPvs(&bsp, vis, leaves);
+        ASSERT_NE(pvs, nullptr);
+        EXPECT_EQ(*pvs, expected);
+
+        // faces that get the same row must have wanted the same bits
+        auto [it, inserted] = pvs_by_pointer.try_emplace(pvs, expected);
+        if (!inserted) {
+            EXPECT_EQ(it->second, expected);
+            shared++;
+        }
+    }
+
+    EXPECT_GT(shared, 0);
+
+    ClearLightsurfPvsPool();
+}
+
+TEST(ltfaceQ1, skyvis)
+{
+    SCOPED_TRACE("-skyvis should only miss dome shadows that fall between its traced samples");
+
+    auto plain = QbspVisLight_Q1("q1_mountain.map", {});
+    auto skyvis = QbspVisLight_Q1("q1_mountain.map", {"-skyvis"});
+
+    ASSERT_EQ(plain.bsp.dfaces.size(), skyvis.bsp.dfaces.size());
+
+    size_t lit_faces = 0, differing_faces = 0;
+
+    for (size_t i = 0; i < plain.bsp.dfaces.size(); i++) {
+        SCOPED_TRACE(fmt::format("face {}", i));
+
+        const mface_t &plain_face = plain.bsp.dfaces[i];
+        const mface_t &skyvis_face = skyvis.bsp.dfaces[i];
+
+        EXPECT_EQ(plain_face.styles, skyvis_face.styles);
+        ASSERT_EQ(plain_face.lightofs, skyvis_face.lightofs);
+
+        if (plain_face.lightofs == -1) {
+            continue;
+        }
+
+        // compare each face's average sky visibility, which -skyvis should keep to within about one dome sun
+        const size_t num_samples = faceextents_t(plain_face, plain.bsp, LMSCALE_DEFAULT).numsamples();
+        ASSERT_LE(plain_face.lightofs + num_samples, plain.bsp.dlightdata.size());
+
+        int64_t plain_total = 0, skyvis_total = 0;
+        for (size_t j = 0; j < num_samples; j++) {
+            plain_total += plain.bsp.dlightdata[plain_face.lightofs + j];
+            skyvis_total += skyvis.bsp.dlightdata[skyvis_face.lightofs + j];
+        }
+
+        EXPECT_NEAR(static_cast<float>(plain_total) / num_samples, static_cast<float>(skyvis_total) / num_samples, 5.0f);
+
+        lit_faces++;
+        if (plain_total != skyvis_total) {
+            differing_faces++;
+        }
+    }
+
+    EXPECT_GT(lit_faces, 0);
+    // the lattice does miss some shadows here, so this isn't comparing two copies of the same path
+    EXPECT_GT(differing_faces, 0);
+}
+
+TEST(ltface, skyvisLatticeRefinesShadowEdges)
+{
+    // sizes that aren't a multiple of the spacing, so the last row and column
+    // are lattice samples closer than `spacing` to the ones before them
+    constexpr int width = 19, height = 10, spacing = 4;
+
+    // shadows of large occluders, all with straight edges, including ones
+    // that only cover the last column or the last row
+    const std::vector<std::function<bool(int, int)>> shadows{
+        [](int s, int t) { return s + 2 * t > 20; },
+        [](int s, int t) { return 3 * s - t < 14; },
+        [](int s, int t) { return s >= width - 1; },
+        [](int s, int t) { return t >= height - 1; },
+        [](int s, int t) { return s == width - 2 || s == width - 1; },
+    };
+
+    for (size_t shadow_index = 0; shadow_index < shadows.size(); shadow_index++) {
+        SCOPED_TRACE(fmt::format("shadow {}", shadow_index));
+
+        const auto &in_shadow = shadows[shadow_index];
+        std::vector<uint8_t> wanted(width * height, true);
+
+        // a sample that isn't wanted (e.g. occluded) is a lattice sample that can't be trusted
+        wanted[4 * width + 4] = false;
+
+        std::vector<int> hits(width * height, -1);
+        std::vector<int> trace_count(width * height, 0);
+
+        const size_t traced =
+            SkyVis_TraceLattice(width, height, spacing, wanted, hits, [&](const std::vector<int> &batch) {
+                for (int i : batch) {
+                    hits[i] = in_shadow(i % width, i / width) ? 0 : 1;
+                    trace_count[i]++;
+                }
+            });
+
+        EXPECT_LT(traced, width * height);
+
+        for (int t = 0; t < height; t++) {
+            for (int s = 0; s < width; s++) {
+                SCOPED_TRACE(fmt::format("sample {} {}", s, t));
+
+                const int i = t * width + s;
+
+                if (!wanted[i]) {
+                    EXPECT_EQ(trace_count[i], 0);
+                    EXPECT_EQ(hits[i], -1);
+                    continue;
+                }
+
+                EXPECT_LE(trace_count[i], 1);
+                EXPECT_EQ(hits[i], in_shadow(s, t) ? 0 : 1);
+            }
+        }
+    }
+
+    // an occluder that falls between the lattice samples is missed
+    std::vector<uint8_t> wanted(width * height, true);
+    std::vector<int> hits(width * height, -1);
+
+    SkyVis_TraceLattice(width, height, spacing, wanted, hits, [&](const std::vector<int> &batch) {
+        for (int i : batch) {
+            hits[i] = (i == 2 * width + 2) ? 0 : 1;
+        }
+    });
+
+    EXPECT_EQ(hits[2 * width + 2], 1);
+
+    // with a spacing of 1, every sample is traced
+    std::fill(hits.begin(), hits.end(), -1);
+    EXPECT_EQ(SkyVis_TraceLattice(width, height, 1, wanted, hits, [&](const std::vector<int> &batch) {
+        for (int i : batch) {
+            hits[i] = (i == 2 * width + 2) ? 0 : 1;
+        }
+    }),
+        width * height);
+    EXPECT_EQ(hits[2 * width + 2], 0);
+}
+
 TEST(ltfaceQ2, lightBlack)
 {
     auto [bsp, bspx] = QbspVisLight_Q2("q2_light_black.map", {});
@@ -1343,6 +1746,65 @@ TEST(ltfaceQ2, hdr)
     }
 }
 
+TEST(ltfaceQ1, rayPacketsMatchSingleRays)
+{
+    SCOPED_TRACE("tracing in ray packets shouldn't change the lighting through glass, fences or switchable shadows");
+
+    auto packets = QbspVisLight_Q1("q1_light_glass_fence_switchableshadow.map", {"-lit"});
+    auto single = QbspVisLight_Q1("q1_light_glass_fence_switchableshadow.map", {"-lit", "-debug_single_rays"});
+
+    ASSERT_EQ(packets.bsp.dfaces.size(), single.bsp.dfaces.size());
+    for (size_t i = 0; i < packets.bsp.dfaces.size(); i++) {
+        SCOPED_TRACE(fmt::format("face {}", i));
+        EXPECT_EQ(packets.bsp.dfaces[i].styles, single.bsp.dfaces[i].styles);
+        EXPECT_EQ(packets.bsp.dfaces[i].lightofs, single.bsp.dfaces[i].lightofs);
+    }
+
+    EXPECT_EQ(packets.bsp.dlightdata, single.bsp.dlightdata);
+
+    const auto *packets_lit = std::get_if<lit1_t>(&packets.lit);
+    const auto *single_lit = std::get_if<lit1_t>(&single.lit);
+    ASSERT_TRUE(packets_lit);
+    ASSERT_TRUE(single_lit);
+    EXPECT_EQ(packets_lit->rgbdata, single_lit->rgbdata);
+
+    // the switchable shadow should have put its light in a style of its own
+    EXPECT_TRUE(std::any_of(packets.bsp.dfaces.begin(), packets.bsp.dfaces.end(), [](const mface_t &face) {
+        return std::any_of(face.styles.begin(), face.styles.end(), [](uint8_t style) { return style != 0 && style != 255; });
+    }));
+}
+
+TEST(ltfaceQ1, sceneCacheMatchesFreshBuild)
+{
+    SCOPED_TRACE("a scene kept from the last run should only be reused for the same geometry, and light the same");
+
+    Embree_SetSceneCache(true);
+
+    QbspVisLight_Q1("q1_light_glass_fence_switchableshadow.map", {"-lit"});
+    EXPECT_FALSE(Embree_SceneReused());
+
+    auto cached = QbspVisLight_Q1("q1_light_glass_fence_switchableshadow.map", {"-lit"});
+    EXPECT_TRUE(Embree_SceneReused());
+
+    // different geometry has to rebuild it
+    QbspVisLight_Q1("q1_light_skip_shadow.map", {"-lit"});
+    EXPECT_FALSE(Embree_SceneReused());
+
+    Embree_SetSceneCache(false);
+
+    auto fresh = QbspVisLight_Q1("q1_light_glass_fence_switchableshadow.map", {"-lit"});
+    EXPECT_FALSE(Embree_SceneReused());
+
+    ASSERT_EQ(cached.bsp.dfaces.size(), fresh.bsp.dfaces.size());
+    EXPECT_EQ(cached.bsp.dlightdata, fresh.bsp.dlightdata);
+
+    const auto *cached_lit = std::get_if<lit1_t>(&cached.lit);
+    const auto *fresh_lit = std::get_if<lit1_t>(&fresh.lit);
+    ASSERT_TRUE(cached_lit);
+    ASSERT_TRUE(fresh_lit);
+    EXPECT_EQ(cached_lit->rgbdata, fresh_lit->rgbdata);
+}
+
 TEST(ltfaceQ1, switchableshadowTarget)
 {
     SCOPED_TRACE("Vanilla-compatible switchable shadows");
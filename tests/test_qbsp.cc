@@ -20,8 +20,10 @@
 #include <stdexcept>
 #include <tuple>
 #include <map>
+#include <random>
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
+#include <tbb/parallel_for.h>
 #include "test_main.hh"
 
 // FIXME: Clear global data (planes, etc) between each test
@@ -365,6 +367,84 @@ TEST(qbsp, duplicatePlanes)
     EXPECT_EQ(6, brush->sides.size());
 }
 
+TEST(qbsp, planeHash)
+{
+    map.reset();
+    mapdata_t &data = map;
+
+    const size_t up = data.add_or_find_plane({{0, 0, 1}, 64});
+    EXPECT_EQ(2, data.planes.size());
+
+    // within epsilon finds the same plane, and the flip is its pair
+    EXPECT_EQ(up, data.add_or_find_plane({{0, 0, 1}, 64 + DIST_EPSILON * 0.25}));
+    EXPECT_EQ(up ^ 1, data.add_or_find_plane({{0, 0, -1}, -64}));
+    EXPECT_EQ(2, data.planes.size());
+
+    // outside of it makes a new one
+    EXPECT_NE(up, data.add_or_find_plane({{0, 0, 1}, 64 + DIST_EPSILON * 2}));
+    EXPECT_EQ(4, data.planes.size());
+}
+
+TEST(qbsp, planeHashParallel)
+{
+    map.reset();
+    mapdata_t &data = map;
+
+    std::vector<qplane3d> planes;
+    for (int i = 0; i < 100; i++) {
+        planes.emplace_back(qv::normalize(qvec3d(i % 7 - 3, i % 5 - 2, 1)), i * 8.0);
+    }
+
+    // lots of tasks asking for the same planes (and their flips), slightly jittered
+    std::vector<size_t> results(planes.size() * 20);
+    tbb::parallel_for(static_cast<size_t>(0), results.size(), [&](size_t i) {
+        qplane3d plane = planes[i % planes.size()];
+        plane.dist += DIST_EPSILON * 0.1 * ((i / planes.size()) % 3);
+        if (i & 1) {
+            plane = -plane;
+        }
+        results[i] = data.add_or_find_plane(plane);
+    });
+
+    // each one was only added once
+    EXPECT_EQ(planes.size() * 2, data.planes.size());
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const qplane3d &expected = planes[i % planes.size()];
+        const qplane3d &found = data.planes[results[i] & ~1];
+        EXPECT_TRUE(qv::epsilonEqual(expected, found, NORMAL_EPSILON, DIST_EPSILON) ||
+                    qv::epsilonEqual(-expected, found, NORMAL_EPSILON, DIST_EPSILON));
+    }
+}
+
+TEST(qbsp, planeHashFrozen)
+{
+    map.reset();
+    mapdata_t &data = map;
+
+    const size_t up = data.add_or_find_plane({{0, 0, 1}, 64});
+
+    data.frozen_plane_count = data.planes.size();
+
+    // the planes from before are still found within epsilon
+    EXPECT_EQ(up, data.add_or_find_plane({{0, 0, 1}, 64 + DIST_EPSILON * 0.25}));
+
+    // new ones aren't shared, even when identical
+    const size_t first = data.add_or_find_plane({{1, 0, 0}, 32});
+    const size_t second = data.add_or_find_plane({{1, 0, 0}, 32});
+    EXPECT_NE(first, second);
+    EXPECT_EQ(6, data.planes.size());
+
+    data.frozen_plane_count = std::nullopt;
+
+    // and they aren't in the hash, so this adds the shared one
+    const size_t shared = data.add_or_find_plane(data.planes[first]);
+    EXPECT_NE(first, shared);
+    EXPECT_NE(second, shared);
+    EXPECT_EQ(shared, data.add_or_find_plane(data.planes[second]));
+    EXPECT_EQ(8, data.planes.size());
+}
+
 TEST(qbsp, emptyBrush)
 {
     SCOPED_TRACE("the empty brush should be discarded");
@@ -587,6 +667,54 @@ TEST(testmapsQ1, chopNoChange)
     // TODO: ideally we should check we get back the same brush pointers from ChopBrushes
 }
 
+/**
+ * ChopBrushes splits the brushes into islands of overlapping brushes and chops
+ * them in parallel; the fragments and their order must be the same as chopping
+ * the whole list at once.
+ */
+TEST(testmapsQ1, chopIslandsMatchSingleList)
+{
+    auto *game = bspver_q1.game;
+
+    auto &entity = LoadMapPath("q1_chop_islands.map");
+
+    // three clusters of overlapping cubes and a lone cube, with the brushes of
+    // the clusters interleaved in the .map
+    ASSERT_EQ(entity.mapbrushes.size(), 9);
+
+    auto load_brushes = [&]() {
+        bspbrush_t::container brushes;
+        for (auto &mapbrush : entity.mapbrushes) {
+            auto b = LoadBrush(entity, mapbrush, game->create_contents_from_native(CONTENTS_SOLID), 0, std::nullopt);
+            brushes.push_back(bspbrush_t::make_ptr(std::move(*b)));
+        }
+        return brushes;
+    };
+
+    bspbrush_t::container islands = load_brushes();
+    ChopBrushes(islands, false);
+
+    qbsp_options.debugchopnoislands.set_value(true, settings::source::COMMANDLINE);
+    bspbrush_t::container single_list = load_brushes();
+    ChopBrushes(single_list, false);
+    qbsp_options.debugchopnoislands.set_value(false, settings::source::COMMANDLINE);
+
+    EXPECT_GT(single_list.size(), entity.mapbrushes.size());
+    ASSERT_EQ(islands.size(), single_list.size());
+
+    for (size_t i = 0; i < islands.size(); i++) {
+        SCOPED_TRACE(fmt::format("brush {}", i));
+
+        EXPECT_EQ(islands[i]->mapbrush, single_list[i]->mapbrush);
+        EXPECT_EQ(islands[i]->bounds, single_list[i]->bounds);
+
+        ASSERT_EQ(islands[i]->sides.size(), single_list[i]->sides.size());
+        for (size_t j = 0; j < islands[i]->sides.size(); j++) {
+            EXPECT_EQ(islands[i]->sides[j].planenum, single_list[i]->sides[j].planenum);
+        }
+    }
+}
+
 TEST(testmapsQ1, simpleSealed)
 {
     const std::vector<std::string> quake_maps{"qbsp_simple_sealed.map", "qbsp_simple_sealed_rotated.map"};
@@ -1701,6 +1829,67 @@ TEST(testmapsQ1, hullsFlag)
     }
 }
 
+TEST(testmapsQ1, clipHullsIndependentOfThreadCount)
+{
+    // the collision hulls of the entities are built in parallel; neither
+    // the thread count nor -loghulls (which runs the same tasks one at a
+    // time) may change the .bsp
+    auto compile = [](std::vector<std::string> extra_args) {
+        LoadTestmapQ1("q1_tjunc_matrix.map", extra_args);
+
+        std::ifstream f(qbsp_options.bsp_path, std::ios_base::in | std::ios_base::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    };
+
+    const auto parallel = compile({});
+    ASSERT_FALSE(parallel.empty());
+
+    EXPECT_EQ(parallel, compile({"-threads", "1"}));
+    EXPECT_EQ(parallel, compile({"-loghulls"}));
+}
+
+class ClipHullsMatchSequentialTest : public testing::TestWithParam<std::string>
+{
+};
+
+INSTANTIATE_TEST_SUITE_P(ClipHullsMatchSequentialCases, ClipHullsMatchSequentialTest,
+    testing::Values("q1_tjunc_matrix.map", "q1_hulls.map", "q1_hull_expansion.map", "q1_rocks.map", "q1_mountain.map",
+        "q1_clip_func_wall.map", "q1_tjunc_angled_face.map"));
+
+/**
+ * -debugserialhulls builds the hulls one at a time without reserving or
+ * freezing the plane list, as qbsp did before the hulls were built in parallel.
+ * The parallel build reserves the expanded planes first and merges the planes
+ * its tasks make afterwards (see CreateClipHull), which must not change hulls
+ * 1..n or the planes.
+ */
+TEST_P(ClipHullsMatchSequentialTest, run)
+{
+    const auto [sequential, sequential_bspx, sequential_prt] = LoadTestmapQ1(GetParam(), {"-debugserialhulls"});
+    const auto [parallel, parallel_bspx, parallel_prt] = LoadTestmapQ1(GetParam());
+
+    ASSERT_EQ(sequential.dplanes.size(), parallel.dplanes.size());
+    for (size_t i = 0; i < sequential.dplanes.size(); i++) {
+        SCOPED_TRACE(fmt::format("plane {}", i));
+        EXPECT_EQ(sequential.dplanes[i].normal, parallel.dplanes[i].normal);
+        EXPECT_EQ(sequential.dplanes[i].dist, parallel.dplanes[i].dist);
+    }
+
+    ASSERT_EQ(sequential.dclipnodes.size(), parallel.dclipnodes.size());
+    for (size_t i = 0; i < sequential.dclipnodes.size(); i++) {
+        SCOPED_TRACE(fmt::format("clipnode {}", i));
+        EXPECT_EQ(sequential.dclipnodes[i].planenum, parallel.dclipnodes[i].planenum);
+        EXPECT_EQ(sequential.dclipnodes[i].children.front, parallel.dclipnodes[i].children.front);
+        EXPECT_EQ(sequential.dclipnodes[i].children.back, parallel.dclipnodes[i].children.back);
+    }
+
+    ASSERT_EQ(sequential.dmodels.size(), parallel.dmodels.size());
+    for (size_t i = 0; i < sequential.dmodels.size(); i++) {
+        SCOPED_TRACE(fmt::format("model {}", i));
+        EXPECT_EQ(sequential.dmodels[i].headnode, parallel.dmodels[i].headnode);
+    }
+}
+
 TEST(testmapsQ1, 0125UnitFaces)
 {
     GTEST_SKIP();
@@ -1791,6 +1980,89 @@ TEST(testmapsQ1, csg)
     }
 }
 
+/**
+ * The CSGFaces broad phase has to find the same pairs as the all-pairs bounds
+ * check it replaced, including brushes that only touch.
+ */
+TEST(qbsp, findOverlappingBrushes)
+{
+    // the bounds check CSGFaces did against every brush before
+    auto brute_force = [](const bspbrush_t::container &brushes, size_t i) {
+        std::vector<size_t> result;
+
+        for (size_t j = 0; j < brushes.size(); j++) {
+            if (j == i) {
+                continue;
+            }
+
+            const aabb3d &a = brushes[i]->bounds, &b = brushes[j]->bounds;
+            bool disjoint = false;
+
+            for (size_t k = 0; k < 3; k++) {
+                if (a.mins()[k] > b.maxs()[k] || a.maxs()[k] < b.mins()[k]) {
+                    disjoint = true;
+                }
+            }
+
+            if (!disjoint) {
+                result.push_back(j);
+            }
+        }
+
+        return result;
+    };
+
+    auto check = [&](const bspbrush_t::container &brushes) {
+        const brush_overlaps_t overlaps = FindOverlappingBrushes(brushes);
+
+        for (size_t i = 0; i < brushes.size(); i++) {
+            SCOPED_TRACE(fmt::format("brush {}", i));
+
+            auto found = overlaps.of(i);
+            EXPECT_EQ(std::vector<size_t>(found.begin(), found.end()), brute_force(brushes, i));
+        }
+    };
+
+    auto make_brush = [](const qvec3d &mins, const qvec3d &maxs) {
+        auto brush = bspbrush_t::make_ptr();
+        brush->bounds = {mins, maxs};
+        return brush;
+    };
+
+    {
+        SCOPED_TRACE("touching on the sweep axis");
+
+        // x has the largest extent, so it's the sweep axis; b starts exactly
+        // where a ends, c starts just past the end of b, d shares a's mins
+        bspbrush_t::container brushes{make_brush({0, 0, 0}, {64, 16, 16}), make_brush({64, 0, 0}, {128, 16, 16}),
+            make_brush({128.5, 0, 0}, {192, 16, 16}), make_brush({0, 16, 16}, {0, 32, 32})};
+        check(brushes);
+
+        const brush_overlaps_t overlaps = FindOverlappingBrushes(brushes);
+        EXPECT_EQ(std::vector<size_t>(overlaps.of(0).begin(), overlaps.of(0).end()), (std::vector<size_t>{1, 3}));
+        EXPECT_TRUE(overlaps.of(2).empty());
+    }
+
+    // integer bounds on a small grid, so many pairs touch on one or more axes
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> position(0, 32), size(0, 8);
+
+    for (int round = 0; round < 20; round++) {
+        SCOPED_TRACE(fmt::format("round {}", round));
+
+        bspbrush_t::container brushes;
+        for (int i = 0; i < 100; i++) {
+            const qvec3d mins{
+                static_cast<double>(position(rng)), static_cast<double>(position(rng)), static_cast<double>(position(rng))};
+            const qvec3d extent{
+                static_cast<double>(size(rng)), static_cast<double>(size(rng)), static_cast<double>(size(rng))};
+            brushes.push_back(make_brush(mins, mins + extent));
+        }
+
+        check(brushes);
+    }
+}
+
 /**
  * Test for WAD internal textures
  **/
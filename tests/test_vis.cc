@@ -1,8 +1,16 @@
 #include <common/bsputils.hh>
+#include <common/pipeline.hh>
 #include <common/qvec.hh>
 
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <random>
 #include <stdexcept>
 #include <vis/vis.hh>
+#include <qbsp/qbsp.hh>
+#include <light/light.hh>
+#include <testmaps.hh>
 
 #include "test_qbsp.hh"
 #include <gtest/gtest.h>
@@ -57,6 +65,40 @@ TEST(vis, detailLeakTest)
     }
 }
 
+TEST(vis, q2PhsIsUnionOfVisiblePvs)
+{
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_detail_leak_test.map", {}, runvis_t::yes);
+
+    const size_t numclusters = bsp.dvis.bit_offsets.size();
+    const size_t clusterbytes = (numclusters + 7) / 8;
+    ASSERT_GT(numclusters, 1);
+
+    auto decompress = [&](vistype_t type, size_t cluster) {
+        std::vector<uint8_t> row(clusterbytes);
+        DecompressVis(bsp.dvis.bits.data() + bsp.dvis.get_bit_offset(type, cluster),
+            bsp.dvis.bits.data() + bsp.dvis.bits.size(), row.data(), row.data() + row.size());
+        return row;
+    };
+
+    for (size_t i = 0; i < numclusters; i++) {
+        SCOPED_TRACE(fmt::format("cluster {}", i));
+
+        const auto pvs = decompress(VIS_PVS, i);
+        auto expected = pvs;
+
+        for (size_t j = 0; j < numclusters; j++) {
+            if (pvs[j >> 3] & nth_bit(j & 7)) {
+                const auto other = decompress(VIS_PVS, j);
+                for (size_t k = 0; k < clusterbytes; k++) {
+                    expected[k] |= other[k];
+                }
+            }
+        }
+
+        EXPECT_EQ(expected, decompress(VIS_PHS, i));
+    }
+}
+
 TEST(vis, q2FuncIllusionaryVisblocker)
 {
     auto [bsp, bspx] = QbspVisLight_Q2("q2_func_illusionary_visblocker.map", {}, runvis_t::yes);
@@ -183,6 +225,98 @@ TEST(vis, ClipStackWinding)
     FreeStackWinding(w1, stack);
 }
 
+TEST(vis, ClassifyPointsMatchesScalar)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> coord(-512, 512);
+
+    for (size_t numpoints = 1; numpoints <= 13; numpoints++) {
+        for (int iter = 0; iter < 200; iter++) {
+            std::array<qvec3d, 13> points;
+            for (size_t i = 0; i < numpoints; i++) {
+                points[i] = {coord(rng), coord(rng), coord(rng)};
+            }
+            // make some of the points land in the VIS_ON_EPSILON band
+            const qplane3d plane =
+                (iter & 1) ? qplane3d(qv::normalize(qvec3d{coord(rng), coord(rng), coord(rng)}), coord(rng))
+                           : qplane3d({0, 0, 1}, points[0][2] + 0.05);
+
+            std::array<double, 13> dists, expected_dists;
+            std::array<int, 13> sides, expected_sides;
+            int counts[3], expected_counts[3];
+
+            ClassifyPoints_Scalar(
+                points.data(), numpoints, plane, expected_dists.data(), expected_sides.data(), expected_counts);
+            ClassifyPoints(points.data(), numpoints, plane, dists.data(), sides.data(), counts);
+
+            for (size_t i = 0; i < numpoints; i++) {
+                // must be bit-identical, not just close
+                ASSERT_EQ(0, memcmp(&dists[i], &expected_dists[i], sizeof(double)));
+                ASSERT_EQ(sides[i], expected_sides[i]);
+            }
+            for (int side : {SIDE_FRONT, SIDE_BACK, SIDE_ON}) {
+                ASSERT_EQ(counts[side], expected_counts[side]);
+            }
+
+            std::array<qplane3d, 13> planes;
+            for (size_t i = 0; i < numpoints; i++) {
+                planes[i] = qplane3d(qv::normalize(qvec3d{coord(rng), coord(rng), coord(rng)}), coord(rng));
+            }
+
+            ClassifySphere_Scalar(planes.data(), numpoints, points[0], 256.0, expected_sides.data());
+            ClassifySphere(planes.data(), numpoints, points[0], 256.0, sides.data());
+
+            for (size_t i = 0; i < numpoints; i++) {
+                ASSERT_EQ(sides[i], expected_sides[i]);
+            }
+        }
+    }
+}
+
+TEST(vis, ClipStackWindingToPlanes)
+{
+    const std::array<qplane3d, 3> planes{
+        qplane3d({-1, 0, 0}, -16), // clips
+        qplane3d({0, 0, 1}, -64), // entirely in front, skipped by the sphere test
+        qplane3d({0, 0, 1}, -8) // clips
+    };
+
+    auto make_winding = [](pstack_t &stack) {
+        auto *w = AllocStackWinding(stack);
+        w->numpoints = 4;
+        w->points[0] = {0, 0, 0};
+        w->points[1] = {32, 0, 0};
+        w->points[2] = {32, 0, -32};
+        w->points[3] = {0, 0, -32};
+        w->set_winding_sphere();
+        return w;
+    };
+
+    pstack_t stack{}, expected_stack{};
+    visstats_t stats{}, expected_stats{};
+
+    auto *expected = make_winding(expected_stack);
+    for (auto &plane : planes) {
+        expected = ClipStackWinding(expected_stats, expected, expected_stack, plane);
+    }
+
+    auto *w = ClipStackWindingToPlanes(stats, make_winding(stack), stack, planes.data(), planes.size());
+    ASSERT_NE(w, nullptr);
+    ASSERT_NE(expected, nullptr);
+    ASSERT_EQ(w->size(), expected->size());
+    for (size_t i = 0; i < w->size(); i++) {
+        EXPECT_EQ((*w)[i], (*expected)[i]);
+    }
+    EXPECT_EQ(stats.c_noclip, expected_stats.c_noclip);
+
+    FreeStackWinding(w, stack);
+    FreeStackWinding(expected, expected_stack);
+
+    // a plane with the whole winding behind it
+    const qplane3d behind({1, 0, 0}, 64);
+    EXPECT_EQ(ClipStackWindingToPlanes(stats, make_winding(stack), stack, &behind, 1), nullptr);
+}
+
 TEST(vis, q1NoambientFuncGroup)
 {
     auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_vis_noambient_func_group.map", {}, runvis_t::yes);
@@ -195,3 +329,126 @@ TEST(vis, q1NoambientFuncGroup)
     // sky in this room has func_group with "_noambient" "1"
     EXPECT_EQ(other_room_leaf->ambient_level[AMBIENT_SKY], 0);
 }
+
+TEST(vis, q1IncrementalAfterEditMatchesFullRun)
+{
+    const fs::path bsp_dir = fs::weakly_canonical(fs::path(test_quake_maps_dir).empty()
+                                                      ? fs::current_path()
+                                                      : fs::path(test_quake_maps_dir));
+    const fs::path incremental_path = bsp_dir / "q1_incremental_vis.bsp";
+    const fs::path full_path = bsp_dir / "q1_incremental_vis_full.bsp";
+    const fs::path state_path = fs::path(incremental_path).replace_extension("vis");
+    const std::string wal_metadata_path = (fs::path(testmaps_dir) / "q2_wal_metadata").string();
+
+    auto compile = [&](const char *map, const fs::path &bsp_path) {
+        InitQBSP(std::vector<std::string>{"", "-noverbose", "-path", wal_metadata_path,
+            (fs::path(testmaps_dir) / map).string(), bsp_path.string()});
+        ProcessFile();
+    };
+
+    auto load_bsp = [](fs::path bsp_path) {
+        bspdata_t bspdata;
+        LoadBSPFile(bsp_path, &bspdata);
+        ConvertBSPFormat(&bspdata, &bspver_generic);
+        return std::get<mbsp_t>(std::move(bspdata.bsp));
+    };
+
+    fs::remove(state_path);
+    fs::remove(fs::path(full_path).replace_extension("vis"));
+
+    // map A, keeping the state file
+    compile("q1_func_illusionary_visblocker.map", incremental_path);
+    vis_main(std::vector<std::string>{"", "-incremental", incremental_path.string()});
+    ASSERT_TRUE(fs::exists(state_path));
+    const mbsp_t original = load_bsp(incremental_path);
+
+    // A', the same map with one of the ramps moved along the corridor, vised from A's state
+    compile("q1_incremental_vis_moved_brush.map", incremental_path);
+    const fs::path prt_path = fs::path(incremental_path).replace_extension("prt");
+    fs::last_write_time(prt_path, fs::last_write_time(state_path) + std::chrono::seconds(10));
+    vis_main(std::vector<std::string>{"", "-incremental", incremental_path.string()});
+    const mbsp_t incremental = load_bsp(incremental_path);
+
+    // some portals away from the edit kept their old results, and the ones near it were flowed again
+    EXPECT_GT(reusedportals, 0);
+    EXPECT_LT(reusedportals, numportals * 2);
+
+    // the old mightsee carried over for the reused portals still covers what they see
+    for (const visportal_t &p : portals) {
+        for (int leafnum = 0; leafnum < portalleafs; leafnum++) {
+            if (p.visbits[leafnum]) {
+                EXPECT_TRUE(p.mightsee[leafnum]);
+            }
+        }
+    }
+
+    // A', vised from scratch
+    compile("q1_incremental_vis_moved_brush.map", full_path);
+    vis_main(std::vector<std::string>{"", full_path.string()});
+    const mbsp_t full = load_bsp(full_path);
+
+    // the edit has to matter, or nothing was invalidated
+    EXPECT_NE(original.dvis.bits, full.dvis.bits);
+
+    EXPECT_EQ(incremental.dvis.bits, full.dvis.bits);
+    EXPECT_EQ(incremental.dvis.bit_offsets, full.dvis.bit_offsets);
+
+    fs::remove(state_path);
+}
+
+TEST(vis, q1InMemoryPipelineMatchesDisk)
+{
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_func_illusionary_visblocker.map", {}, runvis_t::yes);
+
+    fs::path bsp_path = bsp.file;
+    const fs::path prt_path = fs::path(bsp_path).replace_extension("prt");
+    const fs::path map_path = fs::path(testmaps_dir) / "q1_func_illusionary_visblocker.map";
+    const std::string wal_metadata_path = (fs::path(testmaps_dir) / "q2_wal_metadata").string();
+
+    // same stages as above, but handing the .bsp and .prt over in memory
+    pipeline::scope pipeline;
+
+    InitQBSP(std::vector<std::string>{
+        "", "-noverbose", "-path", wal_metadata_path, map_path.string(), bsp_path.string()});
+    ProcessFile();
+
+    EXPECT_FALSE(fs::exists(bsp_path));
+    EXPECT_FALSE(fs::exists(prt_path));
+
+    vis_main(std::vector<std::string>{"", bsp_path.string()});
+    light_main(std::vector<std::string>{"", "-nodefaultpaths", "-path", wal_metadata_path, bsp_path.string()});
+
+    auto written = pipeline.finish();
+    ASSERT_TRUE(written);
+    ConvertBSPFormat(&*written, &bspver_generic);
+    const mbsp_t &inmemory_bsp = std::get<mbsp_t>(written->bsp);
+
+    EXPECT_EQ(bsp.dvis.bits, inmemory_bsp.dvis.bits);
+    EXPECT_EQ(bsp.dvis.bit_offsets, inmemory_bsp.dvis.bit_offsets);
+    EXPECT_EQ(bsp.dlightdata, inmemory_bsp.dlightdata);
+
+    // and it's written once at the end
+    bspdata_t bspdata;
+    LoadBSPFile(bsp_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    EXPECT_EQ(inmemory_bsp.dlightdata, std::get<mbsp_t>(bspdata.bsp).dlightdata);
+}
+
+TEST(vis, q1ThreadCountDoesNotChangeResult)
+{
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_func_illusionary_visblocker.map", {}, runvis_t::yes);
+
+    fs::path bsp_path = bsp.file;
+
+    // one thread takes every portal from a single shard, in order
+    vis_main(std::vector<std::string>{"", "-threads", "1", bsp_path.string()});
+
+    bspdata_t bspdata;
+    LoadBSPFile(bsp_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+    const mbsp_t &single_bsp = std::get<mbsp_t>(bspdata.bsp);
+
+    EXPECT_EQ(bsp.dvis.bits, single_bsp.dvis.bits);
+    EXPECT_EQ(bsp.dvis.bit_offsets, single_bsp.dvis.bit_offsets);
+}
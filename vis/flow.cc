@@ -2,7 +2,25 @@
 #include <vis/leafbits.hh>
 #include <common/log.hh>
 #include <common/parallel.hh>
+#include <algorithm>
 #include <bit> // for std::popcount
+#include <atomic>
+
+// the portals' own mightsee can be cleared by UpdateMightsee on other threads
+// while this one reads it
+static inline uint32_t LoadMightsee(const uint32_t &word)
+{
+    return std::atomic_ref(const_cast<uint32_t &>(word)).load(std::memory_order_relaxed);
+}
+
+static inline bool MightseeBit(const leafbits_t &mightsee, size_t leafnum)
+{
+    return LoadMightsee(mightsee.data()[leafnum >> leafbits_t::shift]) & nth_bit(leafnum & leafbits_t::mask);
+}
+
+// pass points classified against a candidate separator at a time; the width of
+// the AVX2 kernel
+constexpr size_t SEPARATOR_BATCH = 4;
 
 /*
   ==============
@@ -22,11 +40,27 @@
 
   Note that when passing in the 'source' plane, taking a copy, rather than a
   pointer, was measurably faster
+
+  The pass points are classified against the source plane once up front, and
+  against each candidate plane a batch at a time (see ClassifyPoints),
+  stopping at the first batch with a point behind it.
   ==============
 */
 static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, const qplane3d src_pl,
     const viswinding_t *pass, viswinding_t *&target, unsigned int test, pstack_t &stack)
 {
+    double src_dists[MAX_WINDING], sep_dists[MAX_WINDING];
+    int src_sides[MAX_WINDING], sep_sides[MAX_WINDING];
+    int counts[3];
+
+    if (pass->size() > MAX_WINDING)
+        FError("pass->numpoints > MAX_WINDING ({} > {})", pass->size(), MAX_WINDING);
+
+    // Which side of the source portal is each pass point?
+    // This also tells us which side of the separating plane has
+    //  the source portal.
+    ClassifyPoints(pass->points, pass->size(), src_pl, src_dists, src_sides, counts);
+
     // check all combinations
     for (size_t i = 0; i < source->size(); i++) {
         const size_t l = (i + 1) % source->size();
@@ -37,18 +71,11 @@ static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, cons
         // source on the back side
         for (size_t j = 0; j < pass->size(); j++) {
 
-            // Which side of the source portal is this point?
-            // This also tells us which side of the separating plane has
-            //  the source portal.
-            bool fliptest;
-            double d = src_pl.distance_to(pass->at(j));
-            if (d < -VIS_ON_EPSILON)
-                fliptest = true;
-            else if (d > VIS_ON_EPSILON)
-                fliptest = false;
-            else
+            if (src_sides[j] == SIDE_ON)
                 continue; // Point lies in source plane
 
+            const bool fliptest = (src_sides[j] == SIDE_BACK);
+
             // Make a plane with the three points
             qplane3d sep;
             const qvec3d v2 = pass->at(j) - source->at(i);
@@ -72,20 +99,22 @@ static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, cons
             // if all of the pass portal points are now on the positive side,
             // this is the separating plane
             //
-            int count = 0;
-            size_t k = 0;
-            for (; k < pass->size(); k++) {
-                if (k == j)
-                    continue;
-                d = sep.distance_to(pass->at(k));
-                if (d < -VIS_ON_EPSILON)
-                    break;
-                else if (d > VIS_ON_EPSILON)
-                    ++count;
+            // (point j is on the plane by construction, so it's left out)
+            int numfront = 0;
+            bool anyback = false;
+
+            for (size_t k = 0; k < pass->size() && !anyback; k += SEPARATOR_BATCH) {
+                const size_t n = std::min(SEPARATOR_BATCH, pass->size() - k);
+                ClassifyPoints(pass->points + k, n, sep, sep_dists + k, sep_sides + k, counts);
+
+                const bool has_j = j >= k && j < k + n;
+                anyback = counts[SIDE_BACK] - (has_j && sep_sides[j] == SIDE_BACK) > 0;
+                numfront += counts[SIDE_FRONT] - (has_j && sep_sides[j] == SIDE_FRONT);
             }
-            if (k != pass->size())
+
+            if (anyback)
                 continue; // points on negative side, not a separating plane
-            if (!count)
+            if (!numfront)
                 continue; // planar with separating plane
 
             //
@@ -133,11 +162,8 @@ static vistest_action VisTests(
     /* TEST 0 :: source -> pass -> target */
     if (vis_options.level.value() > 0) {
         if (stack.numseparators[0]) {
-            for (int j = 0; j < stack.numseparators[0]; j++) {
-                stack.pass = ClipStackWinding(stats, stack.pass, stack, stack.separators[0][j]);
-                if (!stack.pass)
-                    break;
-            }
+            stack.pass = ClipStackWindingToPlanes(
+                stats, stack.pass, stack, stack.separators[0], stack.numseparators[0]);
         } else {
             /* Using prevstack source for separator cache correctness */
             ClipToSeparators(stats, prevstack->source, head->portalplane, prevstack->pass, stack.pass, 0, stack);
@@ -151,11 +177,8 @@ static vistest_action VisTests(
     /* TEST 1 :: pass -> source -> target */
     if (vis_options.level.value() > 1) {
         if (stack.numseparators[1]) {
-            for (int j = 0; j < stack.numseparators[1]; j++) {
-                stack.pass = ClipStackWinding(stats, stack.pass, stack, stack.separators[1][j]);
-                if (!stack.pass)
-                    break;
-            }
+            stack.pass = ClipStackWindingToPlanes(
+                stats, stack.pass, stack, stack.separators[1], stack.numseparators[1]);
         } else {
             /* Using prevstack source for separator cache correctness */
             ClipToSeparators(stats, prevstack->pass, prevstack->portalplane, prevstack->source, stack.pass, 1, stack);
@@ -229,7 +252,7 @@ static unsigned TargetChecks(visstats_t &stats, const pstack_t *const head, cons
         if ((*stack.mightsee)[p->leaf])
             continue; // target check already done and passed
 
-        if (!(*prevstack->mightsee)[p->leaf])
+        if (!MightseeBit(*prevstack->mightsee, p->leaf))
             continue; // can't possibly see it
 
         if (!prevportalbits[i])
@@ -297,8 +320,18 @@ static unsigned TargetChecks(visstats_t &stats, const pstack_t *const head, cons
         FreeStackWinding(stack.pass, stack);
     }
 
-    // transfer results back to prevstack
-    *prevstack->mightsee = std::move(local);
+    // transfer results back to prevstack. the head's mightsee is the portal's
+    // own, which PortalCompleted reads from other threads, so that one keeps
+    // its buffer and is stored word by word
+    if (prevstack == head) {
+        const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
+        uint32_t *mightsee = prevstack->mightsee->data();
+        for (int j = 0; j < numblocks; j++) {
+            std::atomic_ref(mightsee[j]).store(local.data()[j], std::memory_order_relaxed);
+        }
+    } else {
+        *prevstack->mightsee = std::move(local);
+    }
 
     return numchecks;
 }
@@ -334,7 +367,7 @@ static unsigned IterativeTargetChecks(visstats_t &stats, pstack_t *const head)
             uint32_t *nextsee = next->mightsee->data();
             uint32_t *mightsee = stack->mightsee->data();
             for (int i = 0; i < numblocks; i++)
-                nextsee[i] &= mightsee[i];
+                nextsee[i] &= LoadMightsee(mightsee[i]);
         }
 
         // mark done
@@ -403,7 +436,7 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
 
     // check all portals for flowing into other leafs
     for (visportal_t *p : leaf->portals) {
-        if (!(*prevstack.mightsee)[p->leaf]) {
+        if (!MightseeBit(*prevstack.mightsee, p->leaf)) {
             thread->stats.c_leafskip++;
             continue; // can't possibly see it
         }
@@ -411,7 +444,7 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
         uint32_t *test;
 
         // if the portal can't see anything we haven't allready seen, skip it
-        if (p->status == pstat_done) {
+        if (PortalStatus(*p) == pstat_done) {
             thread->stats.c_vistest++;
             test = p->visbits.data();
         } else {
@@ -423,7 +456,7 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
         uint32_t more = 0;
         const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
         for (int j = 0; j < numblocks; j++) {
-            might[j] = prevstack.mightsee->data()[j] & test[j];
+            might[j] = LoadMightsee(prevstack.mightsee->data()[j]) & LoadMightsee(test[j]);
             more |= (might[j] & ~vis[j]);
         }
 
@@ -518,7 +551,7 @@ visstats_t PortalFlow(visportal_t *p)
 {
     threaddata_t data{p->visbits};
 
-    if (p->status != pstat_working)
+    if (PortalStatus(*p) != pstat_working)
         FError("reflowed");
 
     data.leafvis.resize(portalleafs);
@@ -21,6 +21,9 @@
 #include <vis/vis.hh>
 #include <common/bsputils.hh>
 #include <common/parallel.hh>
+
+#include <atomic>
+#include <bit>
 /*
 
 Some textures (sky, water, slime, lava) are considered ambien sound emiters.
@@ -185,62 +188,82 @@ void CalcPHS(mbsp_t *bsp)
     logging::funcheader();
 
     const int32_t leafbytes = (portalleafs + 7) >> 3;
-    const int32_t leaflongs = leafbytes / sizeof(long);
-
-    // increase the bits size with approximately how much space we'll need
-    bsp->dvis.bits.reserve(bsp->dvis.bits.size() * 2);
+    // rows are padded out to whole words; the padding stays zero
+    const size_t rowwords = (leafbytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+    const uint8_t *bits_end = bsp->dvis.bits.data() + bsp->dvis.bits.size();
 
-    std::vector<uint8_t> uncompressed(leafbytes);
-    std::vector<uint8_t> uncompressed_2(leafbytes);
-    std::vector<uint8_t> compressed(leafbytes * 2);
-    std::vector<uint8_t> uncompressed_orig(leafbytes);
+    // decompress every PVS row once, up front
+    std::vector<uint64_t> pvs(rowwords * portalleafs);
 
-    int32_t count = 0;
-    for (int32_t i = 0; i < portalleafs; i++) {
+    logging::parallel_for(0, portalleafs, [&](int32_t i) {
+        uint8_t *row = reinterpret_cast<uint8_t *>(pvs.data() + rowwords * i);
         const uint8_t *scan = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, i);
 
-        DecompressVis(scan, bsp->dvis.bits.data() + bsp->dvis.bits.size(), uncompressed.data(),
-            uncompressed.data() + uncompressed.size());
-        std::copy(uncompressed.begin(), uncompressed.end(), uncompressed_orig.begin());
+        DecompressVis(scan, bits_end, row, row + leafbytes);
+
+        if (portalleafs & 7) {
+            if (row[leafbytes - 1] & ~(nth_bit(portalleafs & 7) - 1)) {
+                FError("Bad bit in PVS"); // pad bits should be 0
+            }
+        }
+    });
+
+    std::vector<std::vector<uint8_t>> compressed(portalleafs);
+    std::atomic<int64_t> count = 0;
 
-        scan = uncompressed_orig.data();
+    logging::parallel_for(0, portalleafs, [&](int32_t i) {
+        const uint64_t *scan = pvs.data() + rowwords * i;
+        std::vector<uint64_t> phs(scan, scan + rowwords);
 
-        for (int32_t j = 0; j < leafbytes; j++) {
-            uint8_t bitbyte = scan[j];
-            if (!bitbyte)
+        for (size_t j = 0; j < rowwords; j++) {
+            if (!scan[j])
                 continue;
-            for (int32_t k = 0; k < 8; k++) {
-                if (!(bitbyte & nth_bit(k)))
-                    continue;
-                // OR this pvs row into the phs
-                int32_t index = ((j << 3) + k);
-                if (index >= portalleafs)
-                    FError("Bad bit in PVS"); // pad bits should be 0
-                const uint8_t *src_compressed = bsp->dvis.bits.data() + bsp->dvis.get_bit_offset(VIS_PVS, index);
-                DecompressVis(src_compressed, bsp->dvis.bits.data() + bsp->dvis.bits.size(), uncompressed_2.data(),
-                    uncompressed_2.data() + uncompressed_2.size());
-                const long *src = reinterpret_cast<long *>(uncompressed_2.data());
-                long *dest = reinterpret_cast<long *>(uncompressed.data());
-                for (int32_t l = 0; l < leaflongs; l++)
-                    dest[l] |= src[l];
+
+            const uint8_t *bytes = reinterpret_cast<const uint8_t *>(scan + j);
+
+            for (size_t b = 0; b < sizeof(uint64_t); b++) {
+                uint32_t bitbyte = bytes[b];
+
+                while (bitbyte) {
+                    // OR this pvs row into the phs
+                    const size_t index = ((j * sizeof(uint64_t) + b) << 3) + std::countr_zero(bitbyte);
+                    const uint64_t *src = pvs.data() + rowwords * index;
+
+                    for (size_t l = 0; l < rowwords; l++) {
+                        phs[l] |= src[l];
+                    }
+
+                    bitbyte &= bitbyte - 1;
+                }
             }
         }
-        for (int32_t j = 0; j < portalleafs; j++)
-            if (uncompressed[j >> 3] & nth_bit(j & 7))
-                count++;
+
+        int64_t row_count = 0;
+        for (uint64_t word : phs) {
+            row_count += std::popcount(word);
+        }
+        count += row_count;
 
         //
         // compress the bit string
         //
-        compressed.clear();
-        CompressRow(uncompressed.data(), leafbytes, std::back_inserter(compressed));
+        CompressRow(reinterpret_cast<const uint8_t *>(phs.data()), leafbytes, std::back_inserter(compressed[i]));
+    });
+
+    size_t total = 0;
+    for (auto &row : compressed) {
+        total += row.size();
+    }
 
+    bsp->dvis.bits.reserve(bsp->dvis.bits.size() + total);
+
+    for (int32_t i = 0; i < portalleafs; i++) {
         bsp->dvis.set_bit_offset(VIS_PHS, i, bsp->dvis.bits.size());
 
-        std::copy(compressed.begin(), compressed.end(), std::back_inserter(bsp->dvis.bits));
+        std::copy(compressed[i].begin(), compressed[i].end(), std::back_inserter(bsp->dvis.bits));
     }
 
-    fmt::print("Average clusters hearable: {}\n", count / portalleafs);
+    fmt::print("Average clusters hearable: {}\n", count.load() / portalleafs);
 
     bsp->dvis.bits.shrink_to_fit();
-}
\ No newline at end of file
+}
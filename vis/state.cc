@@ -28,9 +28,11 @@
 #include <common/cmdlib.hh>
 #include "common/fs.hh"
 #include <common/log.hh>
+#include <bit>
 #include <fstream>
+#include <unordered_map>
 
-constexpr uint32_t VIS_STATE_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | '1');
+constexpr uint32_t VIS_STATE_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | '2');
 
 struct dvisstate_t
 {
@@ -39,8 +41,9 @@ struct dvisstate_t
     uint32_t numleafs;
     uint32_t testlevel;
     uint32_t time_elapsed;
+    uint32_t level;
 
-    auto stream_data() { return std::tie(version, numportals, numleafs, testlevel, time_elapsed); }
+    auto stream_data() { return std::tie(version, numportals, numleafs, testlevel, time_elapsed, level); }
 };
 
 struct dportal_t
@@ -50,10 +53,46 @@ struct dportal_t
     uint32_t vis;
     uint32_t nummightsee;
     uint32_t numcansee;
+    // for -incremental; see ReuseVisState
+    uint64_t hash;
+    uint32_t leaf;
 
-    auto stream_data() { return std::tie(status, might, vis, nummightsee, numcansee); }
+    auto stream_data() { return std::tie(status, might, vis, nummightsee, numcansee, hash, leaf); }
 };
 
+/*
+  ==============
+  PortalHash
+
+  Hash of the portal's plane and winding, used to match up portals between
+  compiles. Portal files are written with fixed precision, so an unchanged
+  portal hashes the same.
+  ==============
+*/
+static uint64_t PortalHash(const visportal_t &p)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    auto add = [&hash](double v) {
+        hash ^= std::bit_cast<uint64_t>(v);
+        hash *= 0x100000001b3ull;
+        hash ^= hash >> 29;
+    };
+
+    for (size_t i = 0; i < 3; i++) {
+        add(p.plane.normal[i]);
+    }
+    add(p.plane.dist);
+
+    for (size_t i = 0; i < p.winding->size(); i++) {
+        for (size_t j = 0; j < 3; j++) {
+            add(p.winding->at(i)[j]);
+        }
+    }
+
+    return hash;
+}
+
 static int CompressBits(uint8_t *out, const leafbits_t &in)
 {
     int i, rep, shift, numbytes;
@@ -94,11 +133,11 @@ static int CompressBits(uint8_t *out, const leafbits_t &in)
     return numbytes;
 }
 
-static void DecompressBits(leafbits_t &dst, const uint8_t *src)
+static void DecompressBits(leafbits_t &dst, const uint8_t *src, size_t numleafs)
 {
-    const size_t numbytes = (portalleafs + 7) >> 3;
+    const size_t numbytes = (numleafs + 7) >> 3;
 
-    dst.resize(portalleafs);
+    dst.resize(numleafs);
 
     for (size_t i = 0; i < numbytes; i++) {
         uint8_t val = *src++;
@@ -146,6 +185,7 @@ void SaveVisState()
     state.numleafs = portalleafs;
     state.testlevel = vis_options.visdist.value();
     state.time_elapsed = (uint32_t)(statetime - starttime).count();
+    state.level = vis_options.level.value();
 
     out <= state;
 
@@ -153,19 +193,33 @@ void SaveVisState()
     std::vector<uint8_t> might((portalleafs + 7) >> 3);
     std::vector<uint8_t> vis((portalleafs + 7) >> 3);
 
+    // snapshot of a portal's mightsee; UpdateMightsee may be clearing bits in it
+    leafbits_t mightsee(portalleafs);
+
     for (const auto &p : portals) {
-        might_len = CompressBits(might.data(), p.mightsee);
-        if (p.status == pstat_done) {
+        // saved while other threads are flowing portals
+        const pstatus_t status = PortalStatus(p);
+
+        const size_t numwords = (p.mightsee.size() + leafbits_t::mask) >> leafbits_t::shift;
+        for (size_t i = 0; i < numwords; i++) {
+            mightsee.data()[i] =
+                std::atomic_ref(const_cast<uint32_t &>(p.mightsee.data()[i])).load(std::memory_order_relaxed);
+        }
+
+        might_len = CompressBits(might.data(), mightsee);
+        if (status == pstat_done) {
             vis_len = CompressBits(vis.data(), p.visbits);
         } else {
             vis_len = 0;
         }
 
-        pstate.status = p.status;
+        pstate.status = status;
         pstate.might = might_len;
         pstate.vis = vis_len;
-        pstate.nummightsee = p.nummightsee;
+        pstate.nummightsee = std::atomic_ref(const_cast<int &>(p.nummightsee)).load();
         pstate.numcansee = p.numcansee;
+        pstate.hash = PortalHash(p);
+        pstate.leaf = p.leaf;
 
         out <= pstate;
         out.write((const char *)might.data(), might_len);
@@ -220,6 +274,12 @@ bool LoadVisState()
         state_time = fs::last_write_time(statefile);
     }
 
+    // portals handed over in memory by qbsp are always newer
+    if (portalfile.empty()) {
+        logging::print("State file is out of date, will be overwritten\n");
+        return false;
+    }
+
     prt_time = fs::last_write_time(portalfile);
     if (prt_time > state_time) {
         logging::print("State file is out of date, will be overwritten\n");
@@ -233,7 +293,8 @@ bool LoadVisState()
 
     /* Sanity check the headers */
     if (state.version != VIS_STATE_VERSION) {
-        FError("state file version does not match");
+        logging::print("State file is from a different version, will be overwritten\n");
+        return false;
     }
     if (state.numportals != numportals || state.numleafs != portalleafs) {
         FError("state file {} does not match portal file {}", statefile, portalfile);
@@ -257,7 +318,7 @@ bool LoadVisState()
         p.mightsee.resize(portalleafs);
 
         if (pstate.might < numbytes) {
-            DecompressBits(p.mightsee, compressed.data());
+            DecompressBits(p.mightsee, compressed.data(), portalleafs);
         } else {
             CopyLeafBits(p.mightsee, compressed.data(), portalleafs);
         }
@@ -267,7 +328,7 @@ bool LoadVisState()
         if (pstate.vis) {
             in.read((char *)compressed.data(), pstate.vis);
             if (pstate.vis < numbytes) {
-                DecompressBits(p.visbits, compressed.data());
+                DecompressBits(p.visbits, compressed.data(), portalleafs);
             } else {
                 CopyLeafBits(p.visbits, compressed.data(), portalleafs);
             }
@@ -281,3 +342,290 @@ bool LoadVisState()
 
     return true;
 }
+
+/*
+  ==============
+  ReuseVisState
+
+  For -incremental: called after BasePortalVis when the state file is from an
+  older portal file. Portals are matched between the two by PortalHash, and
+  leafs by the portals bounding them. A leaf is unchanged if all of its portals
+  matched, to portals that all bounded the same old leaf, and lead to the same
+  leafs as before.
+
+  A portal's flow only ever looks at the leafs in its mightsee, and BasePortalVis
+  only depends on the portals in them, so if every one of those leafs is
+  unchanged, the old flow saw exactly the same geometry and its visbits can be
+  reused as-is. The remaining portals are flowed as usual, so the result is the
+  same as a full run.
+
+  Returns the number of portals reused.
+  ==============
+*/
+int ReuseVisState()
+{
+    dvisstate_t state;
+    dportal_t pstate;
+
+    if (vis_options.nostate.value() || vis_options.fast.value() || !fs::exists(statefile)) {
+        return 0;
+    }
+
+    std::ifstream in(statefile, std::ios_base::in | std::ios_base::binary);
+    in >> endianness<std::endian::little>;
+
+    in >= state;
+
+    if (state.version != VIS_STATE_VERSION) {
+        return 0;
+    }
+    if (state.testlevel != static_cast<uint32_t>(vis_options.visdist.value()) ||
+        state.level != static_cast<uint32_t>(vis_options.level.value())) {
+        logging::print("State file was made with different vis settings, not reusing it\n");
+        return 0;
+    }
+
+    // every portal takes at least its dportal_t in the file
+    constexpr uint64_t PORTAL_RECORD_SIZE = sizeof(uint32_t) * 6 + sizeof(uint64_t);
+    if (uint64_t(state.numportals) * 2 * PORTAL_RECORD_SIZE > fs::file_size(statefile)) {
+        logging::print("State file is truncated, not reusing it\n");
+        return 0;
+    }
+
+    struct old_portal_t
+    {
+        pstatus_t status;
+        uint64_t hash;
+        int leaf;
+        leafbits_t mightsee;
+        leafbits_t visbits;
+    };
+
+    const size_t old_numleafs = state.numleafs;
+    const size_t numbytes = (old_numleafs + 7) >> 3;
+    std::vector<uint8_t> compressed(numbytes);
+    std::vector<old_portal_t> old_portals(state.numportals * 2);
+
+    for (auto &op : old_portals) {
+        in >= pstate;
+
+        // the file is from another version of the map, so don't trust its sizes
+        if (pstate.might > numbytes || pstate.vis > numbytes || pstate.leaf >= old_numleafs ||
+            pstate.status > pstat_done) {
+            logging::print("State file is corrupt, not reusing it\n");
+            return 0;
+        }
+
+        op.status = static_cast<pstatus_t>(pstate.status);
+        op.hash = pstate.hash;
+        op.leaf = pstate.leaf;
+
+        if (pstate.might) {
+            in.read((char *)compressed.data(), pstate.might);
+            if (pstate.might < numbytes) {
+                DecompressBits(op.mightsee, compressed.data(), old_numleafs);
+            } else {
+                CopyLeafBits(op.mightsee, compressed.data(), old_numleafs);
+            }
+        }
+
+        if (pstate.vis) {
+            in.read((char *)compressed.data(), pstate.vis);
+            if (pstate.vis < numbytes) {
+                DecompressBits(op.visbits, compressed.data(), old_numleafs);
+            } else {
+                CopyLeafBits(op.visbits, compressed.data(), old_numleafs);
+            }
+        }
+
+        if (!in) {
+            logging::print("State file is truncated, not reusing it\n");
+            return 0;
+        }
+    }
+
+    // match portals; anything with a duplicate hash on either side is left unmatched
+    std::unordered_map<uint64_t, int> old_by_hash, new_by_hash;
+
+    for (size_t i = 0; i < old_portals.size(); i++) {
+        auto [it, inserted] = old_by_hash.emplace(old_portals[i].hash, i);
+        if (!inserted) {
+            it->second = -1;
+        }
+    }
+
+    std::vector<uint64_t> hashes(portals.size());
+    for (size_t i = 0; i < portals.size(); i++) {
+        hashes[i] = PortalHash(portals[i]);
+        auto [it, inserted] = new_by_hash.emplace(hashes[i], i);
+        if (!inserted) {
+            it->second = -1;
+        }
+    }
+
+    std::vector<int> match(portals.size(), -1);
+    for (size_t i = 0; i < portals.size(); i++) {
+        if (new_by_hash[hashes[i]] < 0) {
+            continue;
+        }
+        if (auto it = old_by_hash.find(hashes[i]); it != old_by_hash.end()) {
+            match[i] = it->second;
+        }
+    }
+
+    // the leaf a portal is in is the one its pair leads to
+    auto old_owner = [&](int j) { return old_portals[j ^ 1].leaf; };
+
+    std::vector<int> old_leaf_numportals(old_numleafs);
+    for (size_t j = 0; j < old_portals.size(); j++) {
+        old_leaf_numportals[old_owner(j)]++;
+    }
+
+    // map leafs: a leaf maps to the old leaf all of its portals came from
+    std::vector<int> leaf_to_old(portalleafs, -1), old_to_leaf(old_numleafs, -1);
+    std::vector<bool> leaf_changed(portalleafs, false);
+    std::vector<int> old_claims(old_numleafs, 0);
+
+    for (int i = 0; i < portalleafs; i++) {
+        const leaf_t &leaf = leafs[i];
+        int old = -1;
+
+        for (const visportal_t *p : leaf.portals) {
+            const int j = match[p - portals.data()];
+
+            if (j < 0 || (old != -1 && old_owner(j) != old)) {
+                leaf_changed[i] = true;
+                break;
+            }
+
+            old = old_owner(j);
+        }
+
+        if (leaf_changed[i] || old == -1) {
+            continue;
+        }
+
+        if (old_leaf_numportals[old] != static_cast<int>(leaf.portals.size())) {
+            leaf_changed[i] = true;
+            continue;
+        }
+
+        leaf_to_old[i] = old;
+        old_claims[old]++;
+    }
+
+    // two leafs mapping to the same old one can't both be it; neither is
+    // trusted, and nor is the old leaf
+    for (int i = 0; i < portalleafs; i++) {
+        const int old = leaf_to_old[i];
+
+        if (old == -1) {
+            continue;
+        }
+
+        if (old_claims[old] > 1) {
+            leaf_to_old[i] = -1;
+            leaf_changed[i] = true;
+        } else {
+            old_to_leaf[old] = i;
+        }
+    }
+
+    for (int i = 0; i < portalleafs; i++) {
+        if (leaf_changed[i]) {
+            continue;
+        }
+
+        for (const visportal_t *p : leafs[i].portals) {
+            const int j = match[p - portals.data()];
+
+            if (old_to_leaf[old_portals[j].leaf] != p->leaf) {
+                leaf_changed[i] = true;
+                break;
+            }
+        }
+    }
+
+    // reuse the portals whose whole neighbourhood is unchanged
+    leafbits_t visbits(portalleafs);
+    int reused = 0;
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        visportal_t &p = portals[i];
+        const int j = match[i];
+
+        if (j < 0 || old_portals[j].status != pstat_done || old_portals[j].visbits.size() != old_numleafs) {
+            continue;
+        }
+
+        bool affected = leaf_changed[portals[i ^ 1].leaf] || leaf_changed[p.leaf];
+
+        for (int leafnum = 0; leafnum < portalleafs && !affected; leafnum++) {
+            if (p.mightsee[leafnum] && leaf_changed[leafnum]) {
+                affected = true;
+            }
+        }
+
+        if (affected) {
+            continue;
+        }
+
+        visbits.clear();
+        int numcansee = 0;
+
+        const leafbits_t &old_visbits = old_portals[j].visbits;
+        for (size_t old_leafnum = 0; old_leafnum < old_numleafs && !affected; old_leafnum++) {
+            if (!old_visbits[old_leafnum]) {
+                continue;
+            }
+
+            const int leafnum = old_to_leaf[old_leafnum];
+
+            // can't happen if the above holds, but don't trust it blindly
+            if (leafnum == -1 || !p.mightsee[leafnum]) {
+                affected = true;
+                break;
+            }
+
+            visbits[leafnum] = true;
+            numcansee++;
+        }
+
+        if (affected) {
+            continue;
+        }
+
+        // the old mightsee is at least as tight as the base one; keep it so the
+        // next state file has it too. every leaf in mightsee is unchanged here,
+        // so the leafs with portals all map back
+        const leafbits_t &old_mightsee = old_portals[j].mightsee;
+        if (old_mightsee.size() == old_numleafs) {
+            int nummightsee = 0;
+
+            for (int leafnum = 0; leafnum < portalleafs; leafnum++) {
+                if (!p.mightsee[leafnum]) {
+                    continue;
+                }
+
+                const int old_leafnum = leaf_to_old[leafnum];
+
+                if (old_leafnum != -1 && !old_mightsee[old_leafnum] && !visbits[leafnum]) {
+                    p.mightsee[leafnum] = false;
+                } else {
+                    nummightsee++;
+                }
+            }
+
+            p.nummightsee = nummightsee;
+        }
+
+        p.visbits = visbits;
+        p.numcansee = numcansee;
+        p.status = pstat_done;
+        reused++;
+    }
+
+    logging::print("Reused {} of {} portals from the previous state\n", reused, portals.size());
+
+    return reused;
+}
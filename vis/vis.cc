@@ -13,6 +13,17 @@
 
 #include <fmt/chrono.h>
 
+#if defined(__x86_64__) || defined(_M_X64)
+#define VIS_AVX2_KERNELS
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VIS_TARGET_AVX2
+#else
+#define VIS_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
 /*
  * If the portal file is "PRT2" format, then the leafs we are dealing with are
  * really clusters of leaves. So, after the vis job is done we need to expand
@@ -21,6 +32,7 @@
 int numportals;
 int portalleafs; /* leafs (PRT1) or clusters (PRT2) */
 int portalleafs_real; /* real no. of leafs after expanding PRT2 clusters. Not used for Q2. */
+int reusedportals; /* portals whose visbits -incremental took from the state file */
 
 std::vector<visportal_t> portals; // always numportals * 2; front and back
 std::vector<leaf_t> leafs;
@@ -111,49 +123,212 @@ void FreeStackWinding(viswinding_t *&w, pstack_t &stack)
 
 /*
   ==================
-  ClipStackWinding
+  Plane classification kernels
 
-  Clips the winding to the plane, returning the new winding on the positive
-  side. Frees the input winding (if on stack). If the resulting winding would
-  have too many points, the clip operation is aborted and the original winding
-  is returned.
+  The point-plane distances in ClipStackWinding and ClipToSeparators are the
+  innermost loop of the flow. These do all points of a winding (or one point
+  against several planes) at once. The AVX2 versions are picked at runtime
+  when the CPU has it; they evaluate qplane3d::distance_to in the same order
+  as the scalar code, without FMA, so the results are bit-identical.
   ==================
 */
-viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split)
+static_assert(sizeof(qvec3d) == sizeof(double) * 3);
+static_assert(sizeof(qplane3d) == sizeof(double) * 4);
+
+static inline int PointSide(double dist)
 {
-    double dists[MAX_WINDING + 1];
-    int sides[MAX_WINDING + 1];
-    size_t i;
+    if (dist > VIS_ON_EPSILON)
+        return SIDE_FRONT;
+    else if (dist < -VIS_ON_EPSILON)
+        return SIDE_BACK;
+    return SIDE_ON;
+}
 
-    /* Fast test first */
-    double dot = split.distance_to(in->origin);
-    if (dot < -in->radius) {
-        FreeStackWinding(in, stack);
-        return nullptr;
-    } else if (dot > in->radius) {
-        return in;
-    }
+void ClassifyPoints_Scalar(
+    const qvec3d *points, size_t numpoints, const qplane3d &plane, double *dists, int *sides, int *counts)
+{
+    counts[SIDE_FRONT] = counts[SIDE_BACK] = counts[SIDE_ON] = 0;
 
-    if (in->size() > MAX_WINDING)
-        FError("in->numpoints > MAX_WINDING ({} > {})", in->size(), MAX_WINDING);
+    for (size_t i = 0; i < numpoints; i++) {
+        dists[i] = plane.distance_to(points[i]);
+        sides[i] = PointSide(dists[i]);
+        counts[sides[i]]++;
+    }
+}
 
-    int counts[3] = {0, 0, 0};
+void ClassifySphere_Scalar(const qplane3d *planes, size_t numplanes, const qvec3d &origin, double radius, int *sides)
+{
+    for (size_t i = 0; i < numplanes; i++) {
+        const double dist = planes[i].distance_to(origin);
 
-    /* determine sides for each point */
-    for (i = 0; i < in->size(); i++) {
-        dot = split.distance_to((*in)[i]);
-        dists[i] = dot;
-        if (dot > VIS_ON_EPSILON)
-            sides[i] = SIDE_FRONT;
-        else if (dot < -VIS_ON_EPSILON)
+        if (dist < -radius)
             sides[i] = SIDE_BACK;
-        else {
+        else if (dist > radius)
+            sides[i] = SIDE_FRONT;
+        else
             sides[i] = SIDE_ON;
+    }
+}
+
+#ifdef VIS_AVX2_KERNELS
+static bool CPUHasAVX2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // AVX, and the OS saves the ymm registers
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)))
+        return false;
+    if ((_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static const bool cpu_has_avx2 = CPUHasAVX2();
+
+// (x * nx + (y * ny + z * nz)) - dist, matching the fold in qv::dot
+VIS_TARGET_AVX2 static inline __m256d PlaneDist4(
+    __m256d x, __m256d y, __m256d z, __m256d nx, __m256d ny, __m256d nz, __m256d dist)
+{
+    const __m256d yz = _mm256_add_pd(_mm256_mul_pd(y, ny), _mm256_mul_pd(z, nz));
+    return _mm256_sub_pd(_mm256_add_pd(_mm256_mul_pd(x, nx), yz), dist);
+}
+
+VIS_TARGET_AVX2 static void ClassifyPoints_AVX2(
+    const qvec3d *points, size_t numpoints, const qplane3d &plane, double *dists, int *sides, int *counts)
+{
+    const __m256d nx = _mm256_set1_pd(plane.normal[0]);
+    const __m256d ny = _mm256_set1_pd(plane.normal[1]);
+    const __m256d nz = _mm256_set1_pd(plane.normal[2]);
+    const __m256d dist = _mm256_set1_pd(plane.dist);
+    const __m256d on_pos = _mm256_set1_pd(VIS_ON_EPSILON);
+    const __m256d on_neg = _mm256_set1_pd(-VIS_ON_EPSILON);
+    const __m256i stride = _mm256_setr_epi64x(0, 3, 6, 9);
+
+    int front = 0, back = 0;
+    size_t i = 0;
+
+    for (; i + 4 <= numpoints; i += 4) {
+        const double *base = &points[i][0];
+        const __m256d x = _mm256_i64gather_pd(base, stride, 8);
+        const __m256d y = _mm256_i64gather_pd(base + 1, stride, 8);
+        const __m256d z = _mm256_i64gather_pd(base + 2, stride, 8);
+
+        const __m256d d = PlaneDist4(x, y, z, nx, ny, nz, dist);
+        _mm256_storeu_pd(dists + i, d);
+
+        const int front_mask = _mm256_movemask_pd(_mm256_cmp_pd(d, on_pos, _CMP_GT_OQ));
+        const int back_mask = _mm256_movemask_pd(_mm256_cmp_pd(d, on_neg, _CMP_LT_OQ));
+
+        for (size_t j = 0; j < 4; j++) {
+            sides[i + j] = (front_mask & (1 << j)) ? SIDE_FRONT : (back_mask & (1 << j)) ? SIDE_BACK : SIDE_ON;
         }
-        counts[sides[i]]++;
+
+        front += std::popcount(static_cast<unsigned>(front_mask));
+        back += std::popcount(static_cast<unsigned>(back_mask));
+    }
+
+    for (; i < numpoints; i++) {
+        dists[i] = plane.distance_to(points[i]);
+        sides[i] = PointSide(dists[i]);
+        front += (sides[i] == SIDE_FRONT);
+        back += (sides[i] == SIDE_BACK);
     }
-    sides[i] = sides[0];
-    dists[i] = dists[0];
+
+    counts[SIDE_FRONT] = front;
+    counts[SIDE_BACK] = back;
+    counts[SIDE_ON] = static_cast<int>(numpoints) - front - back;
+}
+
+VIS_TARGET_AVX2 static void ClassifySphere_AVX2(
+    const qplane3d *planes, size_t numplanes, const qvec3d &origin, double radius, int *sides)
+{
+    const __m256d x = _mm256_set1_pd(origin[0]);
+    const __m256d y = _mm256_set1_pd(origin[1]);
+    const __m256d z = _mm256_set1_pd(origin[2]);
+    const __m256d r_pos = _mm256_set1_pd(radius);
+    const __m256d r_neg = _mm256_set1_pd(-radius);
+    const __m256i stride = _mm256_setr_epi64x(0, 4, 8, 12);
+
+    size_t i = 0;
+
+    for (; i + 4 <= numplanes; i += 4) {
+        const double *base = &planes[i].normal[0];
+        const __m256d nx = _mm256_i64gather_pd(base, stride, 8);
+        const __m256d ny = _mm256_i64gather_pd(base + 1, stride, 8);
+        const __m256d nz = _mm256_i64gather_pd(base + 2, stride, 8);
+        const __m256d dist = _mm256_i64gather_pd(base + 3, stride, 8);
+
+        const __m256d d = PlaneDist4(x, y, z, nx, ny, nz, dist);
+
+        const int back_mask = _mm256_movemask_pd(_mm256_cmp_pd(d, r_neg, _CMP_LT_OQ));
+        const int front_mask = _mm256_movemask_pd(_mm256_cmp_pd(d, r_pos, _CMP_GT_OQ));
+
+        for (size_t j = 0; j < 4; j++) {
+            sides[i + j] = (back_mask & (1 << j)) ? SIDE_BACK : (front_mask & (1 << j)) ? SIDE_FRONT : SIDE_ON;
+        }
+    }
+
+    ClassifySphere_Scalar(planes + i, numplanes - i, origin, radius, sides + i);
+}
+#endif
+
+void ClassifyPoints(
+    const qvec3d *points, size_t numpoints, const qplane3d &plane, double *dists, int *sides, int *counts)
+{
+#ifdef VIS_AVX2_KERNELS
+    if (cpu_has_avx2) {
+        ClassifyPoints_AVX2(points, numpoints, plane, dists, sides, counts);
+        return;
+    }
+#endif
+    ClassifyPoints_Scalar(points, numpoints, plane, dists, sides, counts);
+}
+
+void ClassifySphere(const qplane3d *planes, size_t numplanes, const qvec3d &origin, double radius, int *sides)
+{
+#ifdef VIS_AVX2_KERNELS
+    if (cpu_has_avx2) {
+        ClassifySphere_AVX2(planes, numplanes, origin, radius, sides);
+        return;
+    }
+#endif
+    ClassifySphere_Scalar(planes, numplanes, origin, radius, sides);
+}
+
+/*
+  ==================
+  ClipStackWinding_Points
+
+  ClipStackWinding, after the bounding sphere test has found that the plane
+  crosses the sphere.
+  ==================
+*/
+static viswinding_t *ClipStackWinding_Points(
+    visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split)
+{
+    double dists[MAX_WINDING + 1];
+    int sides[MAX_WINDING + 1];
+    int counts[3];
+    size_t i;
+
+    if (in->size() > MAX_WINDING)
+        FError("in->numpoints > MAX_WINDING ({} > {})", in->size(), MAX_WINDING);
+
+    /* determine sides for each point */
+    ClassifyPoints(in->points, in->size(), split, dists, sides, counts);
+
+    sides[in->size()] = sides[0];
+    dists[in->size()] = dists[0];
 
     // ericw -- coplanar portals: return without clipping. Otherwise when two portals are less than ON_EPSILON apart,
     // one will get fully clipped away and we can't see through it causing
@@ -222,13 +397,118 @@ noclip:
     return in;
 }
 
+/*
+  ==================
+  ClipStackWinding
+
+  Clips the winding to the plane, returning the new winding on the positive
+  side. Frees the input winding (if on stack). If the resulting winding would
+  have too many points, the clip operation is aborted and the original winding
+  is returned.
+  ==================
+*/
+viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split)
+{
+    /* Fast test first */
+    double dot = split.distance_to(in->origin);
+    if (dot < -in->radius) {
+        FreeStackWinding(in, stack);
+        return nullptr;
+    } else if (dot > in->radius) {
+        return in;
+    }
+
+    return ClipStackWinding_Points(stats, in, stack, split);
+}
+
+/*
+  ==================
+  ClipStackWindingToPlanes
+
+  Same as calling ClipStackWinding with each plane in turn, but the bounding
+  sphere tests are done for all of the planes in one pass up front. Clipping
+  doesn't change the winding's sphere, so they stay valid throughout.
+  ==================
+*/
+viswinding_t *ClipStackWindingToPlanes(
+    visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d *planes, size_t numplanes)
+{
+    int sides[MAX_SEPARATORS];
+
+    Q_assert(numplanes <= MAX_SEPARATORS);
+
+    ClassifySphere(planes, numplanes, in->origin, in->radius, sides);
+
+    for (size_t i = 0; i < numplanes; i++) {
+        if (sides[i] == SIDE_FRONT) {
+            continue;
+        } else if (sides[i] == SIDE_BACK) {
+            FreeStackWinding(in, stack);
+            return nullptr;
+        }
+
+        in = ClipStackWinding_Points(stats, in, stack, planes[i]);
+        if (!in)
+            return nullptr;
+    }
+
+    return in;
+}
+
 //============================================================================
 
+#include <memory>
 #include <mutex>
+#include <set>
+#include <tbb/task_arena.h>
 
-static std::mutex portal_mutex;
 static std::atomic_int64_t portalIndex;
 
+/*
+ * Unstarted portals, dealt out round-robin over a number of shards. Each
+ * shard orders its portals by (nummightsee, portal index) behind a lock of
+ * its own. A thread takes the least complex portal of its home shard, and
+ * only moves on to the other shards once that one's empty. Since portals
+ * are spread evenly, each shard's front is close to the global minimum, so
+ * the later portals still reuse the earlier information.
+ *
+ * There is no global lock: a completed portal updates mightsee bits with
+ * atomic operations and only locks the shard of a portal whose count has
+ * to be re-keyed.
+ */
+struct portal_shard_t
+{
+    std::mutex mutex;
+    std::set<std::pair<int, size_t>> queue;
+};
+
+static std::unique_ptr<portal_shard_t[]> portal_shards;
+static size_t num_portal_shards;
+
+static portal_shard_t &PortalShard(const visportal_t *p)
+{
+    return portal_shards[static_cast<size_t>(p - portals.data()) % num_portal_shards];
+}
+
+/*
+  =============
+  InitPortalQueue
+
+  Queues every portal that hasn't been started yet
+  =============
+*/
+static void InitPortalQueue()
+{
+    num_portal_shards = std::max(1, tbb::this_task_arena::max_concurrency());
+    portal_shards = std::make_unique<portal_shard_t[]>(num_portal_shards);
+
+    for (size_t i = 0; i < portals.size(); i++) {
+        if (portals[i].status == pstat_none) {
+            portal_shards[i % num_portal_shards].queue.emplace(portals[i].nummightsee, i);
+        }
+    }
+}
+
 /*
   =============
   GetNextPortal
@@ -240,25 +520,27 @@ static std::atomic_int64_t portalIndex;
 */
 visportal_t *GetNextPortal()
 {
-    visportal_t *ret = nullptr;
-    uint32_t min = INT_MAX;
+    static std::atomic_size_t next_thread = 0;
+    thread_local const size_t thread_number = next_thread++;
 
-    portal_mutex.lock();
+    const size_t home = thread_number % num_portal_shards;
 
-    for (auto &p : portals) {
-        if (p.nummightsee < min && p.status == pstat_none) {
-            min = p.nummightsee;
-            ret = &p;
+    for (size_t i = 0; i < num_portal_shards; i++) {
+        portal_shard_t &shard = portal_shards[(home + i) % num_portal_shards];
+        std::unique_lock lock(shard.mutex);
+
+        if (shard.queue.empty()) {
+            continue;
         }
-    }
 
-    if (ret) {
-        ret->status = pstat_working;
-    }
+        visportal_t *ret = &portals[shard.queue.begin()->second];
+        shard.queue.erase(shard.queue.begin());
+        SetPortalStatus(*ret, pstat_working);
 
-    portal_mutex.unlock();
+        return ret;
+    }
 
-    return ret;
+    return nullptr;
 }
 
 /*
@@ -270,21 +552,48 @@ visportal_t *GetNextPortal()
   must also be true. Update mightsee for any portals on the source leaf which
   haven't yet started processing.
 
-  Called with the lock held.
+  GetNextPortal claims a portal with its shard's lock held, so the status is
+  checked again under that lock before the bit is cleared; a portal that has
+  started in the meantime is left alone.
   =============
 */
 static void UpdateMightsee(visstats_t &stats, const leaf_t &source, const leaf_t &dest)
 {
-    size_t leafnum = &dest - leafs.data();
+    const size_t leafnum = &dest - leafs.data();
+    const uint32_t bit = nth_bit(leafnum & leafbits_t::mask);
+
     for (visportal_t *p : source.portals) {
-        if (p->status != pstat_none) {
+        // a portal never goes back to pstat_none, so this can skip without the lock
+        if (PortalStatus(*p) != pstat_none) {
             continue;
         }
-        if (p->mightsee[leafnum]) {
-            p->mightsee[leafnum] = false;
-            p->nummightsee--;
-            stats.c_mightseeupdate++;
+
+        portal_shard_t &shard = PortalShard(p);
+        std::unique_lock lock(shard.mutex);
+
+        if (PortalStatus(*p) != pstat_none) {
+            continue;
+        }
+
+        std::atomic_ref word(p->mightsee.data()[leafnum >> leafbits_t::shift]);
+
+        // already cleared, possibly by another thread
+        if (!(word.fetch_and(~bit) & bit)) {
+            continue;
         }
+
+        // re-key the portal in its shard without reallocating the node;
+        // nummightsee is only written with the shard's lock held
+        std::atomic_ref nummightsee(p->nummightsee);
+        const int old_nummightsee = nummightsee.fetch_sub(1);
+
+        auto node = shard.queue.extract({old_nummightsee, static_cast<size_t>(p - portals.data())});
+        if (node) {
+            node.value().first = old_nummightsee - 1;
+            shard.queue.insert(std::move(node));
+        }
+
+        stats.c_mightseeupdate++;
     }
 }
 
@@ -295,30 +604,32 @@ static void UpdateMightsee(visstats_t &stats, const leaf_t &source, const leaf_t
   Mark the portal completed and propogate new vis information across
   to the complementry portals.
 
-  Called with the lock held.
+  Runs concurrently with other completions. A portal on the same leaf
+  that isn't done yet is checked against its mightsee, which contains its
+  eventual visbits, so a concurrent completion at worst skips an update.
   =============
 */
 static void PortalCompleted(visstats_t &stats, visportal_t *completed)
 {
-    portal_mutex.lock();
-
-    completed->status = pstat_done;
+    // visbits are final; publish them
+    SetPortalStatus(*completed, pstat_done);
 
     /*
      * For each portal on the leaf, check the leafs we eliminated from
      * mightsee during the full vis so far.
      */
     const leaf_t &myleaf = leafs[completed->leaf];
+    const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
+
     for (int i = 0; i < myleaf.portals.size(); i++) {
-        const visportal_t *p = myleaf.portals[i];
-        if (p->status != pstat_done)
+        visportal_t *p = myleaf.portals[i];
+        if (PortalStatus(*p) != pstat_done)
             continue;
 
-        auto might = p->mightsee.data();
-        auto vis = p->visbits.data();
-        int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
+        uint32_t *might = p->mightsee.data();
+        const uint32_t *vis = p->visbits.data();
         for (int j = 0; j < numblocks; j++) {
-            uint32_t changed = might[j] & ~vis[j];
+            uint32_t changed = std::atomic_ref(might[j]).load(std::memory_order_relaxed) & ~vis[j];
             if (!changed)
                 continue;
 
@@ -329,11 +640,11 @@ static void PortalCompleted(visstats_t &stats, visportal_t *completed)
             for (int k = 0; k < myleaf.portals.size(); k++) {
                 if (k == i)
                     continue;
-                const visportal_t *p2 = myleaf.portals[k];
-                if (p2->status == pstat_done)
+                visportal_t *p2 = myleaf.portals[k];
+                if (PortalStatus(*p2) == pstat_done)
                     changed &= ~p2->visbits.data()[j];
                 else
-                    changed &= ~p2->mightsee.data()[j];
+                    changed &= ~std::atomic_ref(p2->mightsee.data()[j]).load(std::memory_order_relaxed);
                 if (!changed)
                     break;
             }
@@ -349,8 +660,6 @@ static void PortalCompleted(visstats_t &stats, visportal_t *completed)
             }
         }
     }
-
-    portal_mutex.unlock();
 }
 
 qtime_point starttime, endtime, statetime;
@@ -363,14 +672,15 @@ static duration stateinterval;
 */
 static visstats_t LeafThread()
 {
-    portal_mutex.lock();
-    /* Save state if sufficient time has elapsed */
-    auto now = I_FloatTime();
-    if (now > statetime + stateinterval) {
-        statetime = now;
-        SaveVisState();
+    /* Save state if sufficient time has elapsed; one thread at a time, the others carry on */
+    static std::mutex state_mutex;
+    if (std::unique_lock lock(state_mutex, std::try_to_lock); lock) {
+        auto now = I_FloatTime();
+        if (now > statetime + stateinterval) {
+            statetime = now;
+            SaveVisState();
+        }
     }
-    portal_mutex.unlock();
 
     visportal_t *p = GetNextPortal();
     if (!p)
@@ -381,7 +691,7 @@ static visstats_t LeafThread()
     PortalCompleted(stats, p);
 
     logging::print(logging::flag::VERBOSE, "portal:{:4}  mightsee:{:4}  cansee:{:4}\n", (ptrdiff_t)(p - portals.data()),
-        p->nummightsee, p->numcansee);
+        std::atomic_ref(p->nummightsee).load(), p->numcansee);
 
     return stats;
 }
@@ -514,6 +824,8 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
 
     portalIndex = startcount;
 
+    InitPortalQueue();
+
     std::vector<visstats_t> stats_perportal;
     stats_perportal.resize(numportals * 2);
 
@@ -543,20 +855,32 @@ visstats_t CalcVis(mbsp_t *bsp)
         logging::print("Loaded previous state. Resuming progress...\n");
     } else {
         logging::print("Calculating Base Vis:\n");
+        logging::trace_scope stage("BasePortalVis");
         BasePortalVis();
+
+        if (vis_options.incremental.value()) {
+            reusedportals = ReuseVisState();
+        }
     }
 
     logging::print("Calculating Full Vis:\n");
-    auto stats = CalcPortalVis(bsp);
+    visstats_t stats;
+    {
+        logging::trace_scope stage("CalcPortalVis");
+        stats = CalcPortalVis(bsp);
+    }
 
     //
     // assemble the leaf vis lists by oring and compressing the portal lists
     //
     logging::print("Expanding clusters...\n");
-    leafbits_t buffer(portalleafs);
-    for (int i = 0; i < portalleafs; i++) {
-        ClusterFlow(i, buffer, bsp);
-        buffer.clear();
+    {
+        logging::trace_scope stage("ClusterFlow");
+        leafbits_t buffer(portalleafs);
+        for (int i = 0; i < portalleafs; i++) {
+            ClusterFlow(i, buffer, bsp);
+            buffer.clear();
+        }
     }
 
     int64_t avg = totalvis;
@@ -577,6 +901,7 @@ visstats_t CalcVis(mbsp_t *bsp)
 // ===========================================================================
 
 #include <fstream>
+#include <common/pipeline.hh>
 #include <common/prtfile.hh>
 
 /*
@@ -584,10 +909,8 @@ visstats_t CalcVis(mbsp_t *bsp)
   LoadPortals
   ============
 */
-static void LoadPortals(const fs::path &name, mbsp_t *bsp)
+static void LoadPortals(const prtfile_t &prtfile, mbsp_t *bsp)
 {
-    const prtfile_t prtfile = LoadPrtFile(name, bsp->loadversion);
-
     portalleafs = prtfile.portalleafs;
     portalleafs_real = prtfile.portalleafs_real;
 
@@ -683,6 +1006,7 @@ void vis_reset()
     numportals = 0;
     portalleafs = 0;
     portalleafs_real = 0;
+    reusedportals = 0;
 
     portals.clear();
     leafs.clear();
@@ -704,6 +1028,8 @@ void vis_reset()
     statetmpfile = fs::path();
 
     portalIndex = 0;
+    portal_shards.reset();
+    num_portal_shards = 0;
 
     starttime = {};
     endtime = {};
@@ -740,7 +1066,12 @@ int vis_main(int argc, const char **argv)
     stateinterval = std::chrono::minutes(5); /* 5 minutes */
     starttime = statetime = I_FloatTime();
 
-    LoadBSPFile(vis_options.sourceMap, &bspdata);
+    // qbsp may have just handed it to us
+    if (auto handoff = pipeline::take_bsp(vis_options.sourceMap)) {
+        bspdata = std::move(*handoff);
+    } else {
+        LoadBSPFile(vis_options.sourceMap, &bspdata);
+    }
 
     bspdata.version->game->init_filesystem(vis_options.sourceMap, vis_options);
 
@@ -764,8 +1095,16 @@ int vis_main(int argc, const char **argv)
             originalvismapsize = portalleafs * ((portalleafs + 7) / 8);
         }
     } else {
-        portalfile = fs::path(vis_options.sourceMap).replace_extension("prt");
-        LoadPortals(portalfile, &bsp);
+        fs::path prtpath = fs::path(vis_options.sourceMap).replace_extension("prt");
+
+        if (auto prtfile = pipeline::take_prt(prtpath)) {
+            // no .prt on disk to check the state file's age against, but the
+            // portals are newer than any state file anyway
+            LoadPortals(*prtfile, &bsp);
+        } else {
+            portalfile = prtpath;
+            LoadPortals(LoadPrtFile(portalfile, bsp.loadversion), &bsp);
+        }
 
         statefile = fs::path(vis_options.sourceMap).replace_extension("vis");
         statetmpfile = fs::path(vis_options.sourceMap).replace_extension("vi0");
@@ -791,18 +1130,22 @@ int vis_main(int argc, const char **argv)
         CalcAmbientSounds(&bsp);
     }
     if (bsp.loadversion->game->has_phs) {
+        logging::trace_scope stage("CalcPHS");
         CalcPHS(&bsp);
     }
 
     /* Convert data format back if necessary */
     ConvertBSPFormat(&bspdata, loadversion);
 
-    WriteBSPFile(vis_options.sourceMap, &bspdata);
+    if (!pipeline::give_bsp(bspdata)) {
+        WriteBSPFile(vis_options.sourceMap, &bspdata);
+    }
 
     endtime = I_FloatTime();
     logging::print("{:.2} elapsed\n", (endtime - starttime));
 
-    if (vis_options.autoclean.value()) {
+    // -incremental needs the final state for the next run
+    if (vis_options.autoclean.value() && !vis_options.incremental.value()) {
         CleanVisState();
     }
 